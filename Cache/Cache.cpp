@@ -0,0 +1,235 @@
+#include "Cache.h"
+#include "Hash.h"
+#include "Record.h"
+#include "../Compiler/Arena.h"
+#include "../utils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct FileHeader {
+    char magic[8];
+    uint64_t version;
+    uint64_t configuration;
+};
+
+static const char fileMagic[8] = {'L', 'A', 'V', 'X', 'T', 'C', '\n', 0};
+
+static bool isValid(const uint8_t* record, size_t remaining) {
+    if (remaining < sizeof(RecordHeader)) {
+        return false;
+    }
+    auto header = (const RecordHeader*)record;
+    return header->magic == recordMagic
+        && header->size <= remaining
+        && header->size <= maxRecordSize
+        && header->size == recordSize(header->relocationCount, header->origLength, header->chunkLength)
+        && header->checksum == recordChecksum(record, header->size);
+}
+
+static bool before(const uint8_t* a, const uint8_t* b) {
+    auto first = (const RecordHeader*)a;
+    auto second = (const RecordHeader*)b;
+    return first->module != second->module ? first->module < second->module : first->offset < second->offset;
+}
+
+uint64_t cacheConfiguration(uint32_t maxBlockInstructions, uint32_t ymmSegment, int32_t ymmOffset) {
+    struct {
+        uint32_t maxBlockInstructions;
+        uint32_t segment;
+        int64_t offset;
+    } configuration = { maxBlockInstructions, ymmSegment, ymmOffset };
+    return hash64(&configuration, sizeof(configuration));
+}
+
+std::string cacheFilePath(std::string const& dir, const char* program, uint64_t configuration) {
+    char name[256];
+    snprintf(name, sizeof(name), "/%s-%016llx.cache", program, (unsigned long long)configuration);
+    return dir + name;
+}
+
+Cache::Cache(const char* path, uint64_t configuration) {
+    int file = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (file < 0) {
+        debug_print("Can't open the translation cache %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    // no other process appends while the file is checked
+    flock(file, LOCK_EX);
+    FileHeader expected = { .version = cacheVersion, .configuration = configuration };
+    memcpy(expected.magic, fileMagic, sizeof(fileMagic));
+
+    struct stat st;
+    size_t valid = 0;
+    const uint8_t* contents = nullptr;
+    if (fstat(file, &st) == 0 && (size_t)st.st_size > sizeof(FileHeader)) {
+        auto memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, file, 0);
+        if (memory != MAP_FAILED) {
+            contents = (const uint8_t*)memory;
+            if (memcmp(contents, &expected, sizeof(expected)) == 0) {
+                valid = sizeof(FileHeader);
+                while (isValid(contents + valid, st.st_size - valid)) {
+                    valid += ((const RecordHeader*)(contents + valid))->size;
+                }
+            }
+        }
+    }
+
+    if (valid == 0) {
+        if (contents != nullptr) {
+            munmap((void*)contents, st.st_size);
+            contents = nullptr;
+        }
+        if (ftruncate(file, 0) != 0 || write(file, &expected, sizeof(expected)) != sizeof(expected)) {
+            debug_print("Can't write the translation cache %s: %s\n", path, strerror(errno));
+            flock(file, LOCK_UN);
+            ::close(file);
+            return;
+        }
+    } else if (valid < (size_t)st.st_size) {
+        debug_print("Cutting %lu bytes of a torn record off the translation cache\n", st.st_size - valid);
+        if (ftruncate(file, valid) != 0) {
+            debug_print("Can't truncate the translation cache %s: %s\n", path, strerror(errno));
+        }
+    }
+    flock(file, LOCK_UN);
+
+    fd = file;
+    if (contents != nullptr) {
+        // only the records checked above are ever read, the rest may have been cut off
+        mapped = contents;
+        mappedSize = st.st_size;
+        for (size_t offset = sizeof(FileHeader); offset < valid; offset += ((const RecordHeader*)(contents + offset))->size) {
+            index.push_back(contents + offset);
+        }
+        std::stable_sort(index.begin(), index.end(), before);
+    }
+    debug_print("Translation cache %s has %lu records\n", path, index.size());
+}
+
+std::vector<uint64_t> Cache::modules(const char* path) {
+    std::vector<uint64_t> modules;
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (file < 0 || fstat(file, &st) != 0 || (size_t)st.st_size <= sizeof(FileHeader)) {
+        if (file >= 0) {
+            ::close(file);
+        }
+        return modules;
+    }
+    auto memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, file, 0);
+    ::close(file);
+    if (memory == MAP_FAILED) {
+        return modules;
+    }
+
+    auto contents = (const uint8_t*)memory;
+    auto header = (const FileHeader*)contents;
+    if (memcmp(header->magic, fileMagic, sizeof(fileMagic)) == 0 && header->version == cacheVersion) {
+        for (size_t offset = sizeof(FileHeader); isValid(contents + offset, st.st_size - offset); offset += ((const RecordHeader*)(contents + offset))->size) {
+            modules.push_back(((const RecordHeader*)(contents + offset))->module);
+        }
+    }
+    munmap(memory, st.st_size);
+
+    std::sort(modules.begin(), modules.end());
+    modules.erase(std::unique(modules.begin(), modules.end()), modules.end());
+    return modules;
+}
+
+Cache::Cache(Cache&& other) {
+    *this = std::move(other);
+}
+
+Cache& Cache::operator=(Cache&& other) {
+    if (this != &other) {
+        close();
+        fd = other.fd;
+        mapped = other.mapped;
+        mappedSize = other.mappedSize;
+        index = std::move(other.index);
+        other.fd = -1;
+        other.mapped = nullptr;
+        other.mappedSize = 0;
+    }
+    return *this;
+}
+
+Cache::~Cache() {
+    close();
+}
+
+void Cache::close() {
+    if (mapped != nullptr) {
+        munmap((void*)mapped, mappedSize);
+        mapped = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    index.clear();
+}
+
+void Cache::store(CacheRecord const& record) {
+    if (fd < 0) {
+        return;
+    }
+
+    uint64_t size = recordSize(record.relocationCount, record.origLength, record.chunkLength);
+    if (size > maxRecordSize) {
+        return;
+    }
+    ArenaVector<uint8_t> buffer(size, 0);
+    writeRecord(record, buffer.data(), size);
+
+    // O_APPEND puts the whole record at the end, the lock keeps other processes from interleaving
+    flock(fd, LOCK_EX);
+    size_t written = 0;
+    while (written < size) {
+        auto result = write(fd, buffer.data() + written, size - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            // the torn record is cut off when the file is opened next
+            debug_print("Can't append to the translation cache: %s\n", strerror(errno));
+            break;
+        }
+        written += result;
+    }
+    flock(fd, LOCK_UN);
+}
+
+bool Cache::get(uint64_t module, uint64_t offset, CacheRecord* record) const {
+    RecordHeader key = { .module = module, .offset = offset };
+    auto found = std::lower_bound(index.begin(), index.end(), (const uint8_t*)&key, before);
+    if (found == index.end() || before((const uint8_t*)&key, *found)) {
+        return false;
+    }
+    *record = viewRecord(*found);
+    return true;
+}
+
+std::vector<uint64_t> Cache::getReplacementPoints(uint64_t module) const {
+    RecordHeader first = { .module = module, .offset = 0 };
+    std::vector<uint64_t> offsets;
+    for (auto it = std::lower_bound(index.begin(), index.end(), (const uint8_t*)&first, before); it != index.end(); ++it) {
+        auto header = (const RecordHeader*)*it;
+        if (header->module != module) {
+            break;
+        }
+        if (offsets.empty() || offsets.back() != header->offset) {
+            offsets.push_back(header->offset);
+        }
+    }
+    return offsets;
+}
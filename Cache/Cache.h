@@ -1,27 +1,85 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <string>
 #include <vector>
 
+// An address a stored chunk holds, relative to the base of the module the site is in
+struct CacheRelocation {
+    enum Kind : uint32_t {
+        // rel32 at offset, relative to chunk offset next
+        Rel32,
+        // absolute 64-bit address at offset
+        Abs64,
+    };
+
+    uint32_t kind;
+    uint32_t offset;
+    uint32_t next;
+    uint32_t reserved;
+    int64_t target;
+};
+
+// A translated site: the bytes it had, the chunk that replaces them and the
+// addresses in the chunk. Records found in the cache point into the mapped file.
 struct CacheRecord {
-    CacheRecord(const uint64_t rip, const uint64_t origLength, const uint8_t* chunk, const uint64_t chunkLength)
-    : rip(rip)
-    , origLength(origLength)
-    , chunk(chunk)
-    , chunkLength(chunkLength)
-    {}
-
-    const uint64_t rip;
-    const uint64_t origLength;
+    // Module::key, and the site relative to Module::base
+    uint64_t module;
+    uint64_t offset;
+    // the CompilationStrategy of the chunk, which decides how the site is patched
+    uint32_t strategy;
+    uint32_t origLength;
+    const uint8_t* originalBytes;
+    uint32_t chunkLength;
     const uint8_t* chunk;
-    const uint64_t chunkLength;
+    uint32_t relocationCount;
+    const CacheRelocation* relocations;
 };
 
+// Hash of what translations depend on besides the code, files made with another one are started over
+uint64_t cacheConfiguration(uint32_t maxBlockInstructions, uint32_t ymmSegment, int32_t ymmOffset);
+// There is a file per program and configuration, all processes of a program share it
+std::string cacheFilePath(std::string const& dir, const char* program, uint64_t configuration);
+
+// Translations kept on disk between runs. The file is mapped read-only when
+// the cache is opened and looked up in place. Records are appended with a
+// single write under a file lock and carry a checksum, so a record torn by a
+// crash is cut off the next time the file is opened instead of read back.
+// Records stored by this process are not found again by it, the sites they
+// come from are patched already.
 class Cache {
-    const uint64_t cacheVersion = 0;
+    static const uint64_t cacheVersion = 2;
+
+    int fd = -1;
+    const uint8_t* mapped = nullptr;
+    size_t mappedSize = 0;
+    // records of the mapped file, sorted by module and offset
+    std::vector<const uint8_t*> index;
+
+    void close();
 
 public:
+    // stores nothing and finds nothing
+    Cache() = default;
+    // configuration tells apart translations made with different settings, a
+    // file written with another one is started over
+    Cache(const char* path, uint64_t configuration);
+    Cache(Cache&& other);
+    Cache& operator=(Cache&& other);
+    Cache(Cache const&) = delete;
+    Cache& operator=(Cache const&) = delete;
+    ~Cache();
+
+    // Modules the records of a cache file are for, whatever configuration it
+    // was made with. The file is only read, nothing else is set up.
+    static std::vector<uint64_t> modules(const char* path);
+
+    bool isOpen() const { return fd >= 0; }
+    size_t size() const { return index.size(); }
+
     void store(CacheRecord const& record);
-    CacheRecord get(const uint64_t rip) const;
-    std::vector<uint64_t> getReplacementPoints() const;
+    bool get(uint64_t module, uint64_t offset, CacheRecord* record) const;
+    // sites of the module that have a record, relative to its base
+    std::vector<uint64_t> getReplacementPoints(uint64_t module) const;
 };
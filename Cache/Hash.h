@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// 64-bit hash to tell modules and cache records apart, not meant to withstand
+// anything crafted against it. Works a word at a time so hashing a whole image
+// takes a fraction of the time reading it did.
+inline uint64_t hash64(const void* data, size_t size, uint64_t seed = 0) {
+    const uint64_t multiplier = 0x9e3779b97f4a7c15ull;
+    auto mix = [](uint64_t h) {
+        h ^= h >> 31;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 29;
+        return h;
+    };
+
+    auto bytes = (const uint8_t*)data;
+    uint64_t h = seed ^ (size * multiplier);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        h = (h ^ mix(word)) * multiplier;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, size - i);
+    h = (h ^ mix(tail ^ (size - i))) * multiplier;
+    return mix(h);
+}
@@ -0,0 +1,140 @@
+#include "Module.h"
+#include "Hash.h"
+#include "../utils.h"
+
+#ifdef __APPLE__
+#include <libproc.h>
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+
+// A file mapping that has been resolved, base is where offset 0 of the file
+// would be, so base-relative addresses are file offsets and need no parsing of
+// the image format to agree between runs and the offline translator.
+struct ModuleRange {
+    uint64_t begin;
+    uint64_t end;
+    uint64_t base;
+    uint64_t key;
+};
+
+struct ModuleFile {
+    uint64_t pathHash;
+    uint64_t key;
+};
+
+static const size_t maxRanges = 1024;
+static ModuleRange ranges[maxRanges];
+static size_t numRanges = 0;
+static ModuleFile files[maxRanges];
+static size_t numFiles = 0;
+static pthread_mutex_t moduleMutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t moduleKey(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    auto contents = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (contents == MAP_FAILED) {
+        return 0;
+    }
+
+    // the name and not the whole path, a game keeps its cache when its directory moves
+    const char* name = strrchr(path, '/');
+    name = name != nullptr ? name + 1 : path;
+    uint64_t key = hash64(contents, st.st_size, hash64(name, strlen(name)));
+    munmap(contents, st.st_size);
+    return key == 0 ? 1 : key;
+}
+
+// The file mapped at address, with the range it is mapped at and where its offset 0 would be
+static bool mappedFile(uint64_t address, char* path, size_t pathSize, ModuleRange* range) {
+#ifdef __APPLE__
+    struct proc_regionwithpathinfo info;
+    if (proc_pidinfo(getpid(), PROC_PIDREGIONPATHINFO, address, &info, sizeof(info)) != sizeof(info)) {
+        return false;
+    }
+    if (info.prp_vip.vip_path[0] != '/' || address < info.prp_prinfo.pri_address) {
+        return false;
+    }
+    snprintf(path, pathSize, "%s", info.prp_vip.vip_path);
+    range->begin = info.prp_prinfo.pri_address;
+    range->end = info.prp_prinfo.pri_address + info.prp_prinfo.pri_size;
+    range->base = info.prp_prinfo.pri_address - info.prp_prinfo.pri_offset;
+    return true;
+#else
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == nullptr) {
+        return false;
+    }
+    bool found = false;
+    char line[4096 + 128];
+    while (!found && fgets(line, sizeof(line), maps) != nullptr) {
+        uint64_t begin, end, offset;
+        int pathStart = 0;
+        if (sscanf(line, "%lx-%lx %*s %lx %*s %*s %n", &begin, &end, &offset, &pathStart) != 3 || address < begin || address >= end) {
+            continue;
+        }
+        if (pathStart == 0 || line[pathStart] != '/') {
+            break;
+        }
+        line[strcspn(line, "\n")] = 0;
+        snprintf(path, pathSize, "%s", line + pathStart);
+        *range = { .begin = begin, .end = end, .base = begin - offset };
+        found = true;
+    }
+    fclose(maps);
+    return found;
+#endif
+}
+
+bool moduleForAddress(uint64_t address, Module* module) {
+    pthread_mutex_lock(&moduleMutex);
+    for (size_t i = 0; i < numRanges; i++) {
+        if (address >= ranges[i].begin && address < ranges[i].end) {
+            *module = { .base = ranges[i].base, .key = ranges[i].key };
+            pthread_mutex_unlock(&moduleMutex);
+            return true;
+        }
+    }
+
+    char path[4096];
+    ModuleRange range;
+    bool found = mappedFile(address, path, sizeof(path), &range);
+    if (found) {
+        uint64_t pathHash = hash64(path, strlen(path));
+        range.key = 0;
+        for (size_t i = 0; i < numFiles && range.key == 0; i++) {
+            if (files[i].pathHash == pathHash) {
+                range.key = files[i].key;
+            }
+        }
+        if (range.key == 0) {
+            range.key = moduleKey(path);
+            if (range.key != 0 && numFiles < maxRanges) {
+                files[numFiles++] = { .pathHash = pathHash, .key = range.key };
+            }
+        }
+        found = range.key != 0;
+    }
+    if (found) {
+        if (numRanges < maxRanges) {
+            ranges[numRanges++] = range;
+        }
+        *module = { .base = range.base, .key = range.key };
+    }
+    pthread_mutex_unlock(&moduleMutex);
+    return found;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+// The image a code address comes from. The key is the same in every run that
+// loads the same file, wherever it is loaded and whatever directory it is in,
+// so addresses relative to base can be stored and found again.
+struct Module {
+    uint64_t base;
+    uint64_t key;
+};
+
+// false for code that isn't mapped from a file, like the output of a JIT
+bool moduleForAddress(uint64_t address, Module* module);
+
+// Hash of the file name and contents, 0 if the file can't be read
+uint64_t moduleKey(const char* path);
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "Cache.h"
+#include "Hash.h"
+
+#include <cstring>
+
+// How a CacheRecord is laid out in the cache file and in the shared cache.
+// The header is followed by the relocations, the original bytes and the
+// chunk, padded to 8 bytes.
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t size;
+    uint64_t module;
+    uint64_t offset;
+    uint32_t strategy;
+    uint32_t origLength;
+    uint32_t chunkLength;
+    uint32_t relocationCount;
+    // of the whole record with this field zeroed
+    uint64_t checksum;
+};
+
+static const uint32_t recordMagic = 0x52585641;
+// anything longer is a corrupted size field
+static const uint64_t maxRecordSize = 1 << 20;
+
+inline uint64_t recordSize(uint64_t relocationCount, uint64_t origLength, uint64_t chunkLength) {
+    uint64_t size = sizeof(RecordHeader) + relocationCount * sizeof(CacheRelocation) + origLength + chunkLength;
+    return (size + 7) & ~7ull;
+}
+
+inline uint64_t recordChecksum(const uint8_t* record, size_t size) {
+    RecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    header.checksum = 0;
+    return hash64(record + sizeof(header), size - sizeof(header), hash64(&header, sizeof(header)));
+}
+
+// Writes the record to size bytes at buffer, size is recordSize of it
+inline void writeRecord(CacheRecord const& record, uint8_t* buffer, uint64_t size) {
+    RecordHeader header = {
+        .magic = recordMagic,
+        .size = (uint32_t)size,
+        .module = record.module,
+        .offset = record.offset,
+        .strategy = record.strategy,
+        .origLength = record.origLength,
+        .chunkLength = record.chunkLength,
+        .relocationCount = record.relocationCount,
+    };
+    memset(buffer, 0, size);
+    auto p = buffer + sizeof(header);
+    memcpy(p, record.relocations, record.relocationCount * sizeof(CacheRelocation));
+    p += record.relocationCount * sizeof(CacheRelocation);
+    memcpy(p, record.originalBytes, record.origLength);
+    p += record.origLength;
+    memcpy(p, record.chunk, record.chunkLength);
+    memcpy(buffer, &header, sizeof(header));
+    header.checksum = recordChecksum(buffer, size);
+    memcpy(buffer, &header, sizeof(header));
+}
+
+inline CacheRecord viewRecord(const uint8_t* record) {
+    auto header = (const RecordHeader*)record;
+    auto relocations = (const CacheRelocation*)(record + sizeof(RecordHeader));
+    auto originalBytes = (const uint8_t*)(relocations + header->relocationCount);
+    return CacheRecord {
+        .module = header->module,
+        .offset = header->offset,
+        .strategy = header->strategy,
+        .origLength = header->origLength,
+        .originalBytes = originalBytes,
+        .chunkLength = header->chunkLength,
+        .chunk = originalBytes + header->origLength,
+        .relocationCount = header->relocationCount,
+        .relocations = relocations,
+    };
+}
@@ -0,0 +1,198 @@
+#include "SharedCache.h"
+#include "Hash.h"
+#include "Record.h"
+#include "../utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum SlotState : uint32_t {
+    Empty = 0,
+    Claimed,
+    Published,
+};
+
+struct SharedSlot {
+    std::atomic<uint32_t> state;
+    uint32_t reserved;
+    uint64_t module;
+    uint64_t offset;
+    // where the record starts in SharedCacheRegion::records
+    uint64_t record;
+};
+
+static const size_t numSlots = 1 << 16;
+static const size_t maxProbes = 256;
+static const size_t recordsSize = 64 << 20;
+
+// Zero is a valid empty region, so a new one needs no setup that others would have to wait for
+struct SharedCacheRegion {
+    std::atomic<uint64_t> used;
+    std::atomic<uint64_t> published;
+    uint64_t reserved[6];
+    SharedSlot slots[numSlots];
+    uint8_t records[recordsSize];
+};
+
+// the region is used by processes that don't share any locks
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free);
+
+static size_t firstSlot(uint64_t module, uint64_t offset) {
+    uint64_t key[2] = { module, offset };
+    return hash64(key, sizeof(key)) & (numSlots - 1);
+}
+
+SharedCache::SharedCache(const char* name) {
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        debug_print("Can't open the shared translation cache %s: %s\n", name, strerror(errno));
+        return;
+    }
+
+    // Whoever gets here first sizes the object. macOS only lets that happen
+    // once, so a process racing with the first one fails and sees its size.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && ftruncate(fd, sizeof(SharedCacheRegion)) != 0) {
+        debug_print("Can't size the shared translation cache %s: %s\n", name, strerror(errno));
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(SharedCacheRegion)) {
+        debug_print("Shared translation cache %s has the wrong size\n", name);
+        ::close(fd);
+        return;
+    }
+
+    auto memory = mmap(nullptr, sizeof(SharedCacheRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        debug_print("Can't map the shared translation cache %s: %s\n", name, strerror(errno));
+        return;
+    }
+    region = (SharedCacheRegion*)memory;
+    debug_print("Shared translation cache %s has %lu records\n", name, size());
+}
+
+SharedCache::SharedCache(SharedCache&& other) {
+    *this = std::move(other);
+}
+
+SharedCache& SharedCache::operator=(SharedCache&& other) {
+    if (this != &other) {
+        close();
+        region = other.region;
+        other.region = nullptr;
+    }
+    return *this;
+}
+
+SharedCache::~SharedCache() {
+    close();
+}
+
+void SharedCache::close() {
+    if (region != nullptr) {
+        munmap(region, sizeof(SharedCacheRegion));
+        region = nullptr;
+    }
+}
+
+std::string SharedCache::name(uint64_t configuration) {
+    // macOS caps the names at 31 characters
+    char name[32];
+    snprintf(name, sizeof(name), "/lavx2-%x-%012llx", (unsigned)getuid(), (unsigned long long)(configuration & 0xffffffffffffull));
+    return name;
+}
+
+void SharedCache::remove(const char* name) {
+    shm_unlink(name);
+}
+
+size_t SharedCache::size() const {
+    return region != nullptr ? region->published.load(std::memory_order_relaxed) : 0;
+}
+
+bool SharedCache::get(uint64_t module, uint64_t offset, CacheRecord* record) const {
+    if (region == nullptr) {
+        return false;
+    }
+    size_t first = firstSlot(module, offset);
+    for (size_t i = 0; i < maxProbes; i++) {
+        auto const& slot = region->slots[(first + i) & (numSlots - 1)];
+        auto state = slot.state.load(std::memory_order_acquire);
+        if (state == SlotState::Empty) {
+            return false;
+        }
+        if (state != SlotState::Published || slot.module != module || slot.offset != offset) {
+            continue;
+        }
+        // written by another process, which may have been anything but careful
+        auto header = (const RecordHeader*)(region->records + slot.record);
+        if (slot.record > recordsSize - sizeof(RecordHeader) || header->magic != recordMagic
+            || header->size > recordsSize - slot.record
+            || header->size != recordSize(header->relocationCount, header->origLength, header->chunkLength)) {
+            return false;
+        }
+        *record = viewRecord((const uint8_t*)header);
+        return true;
+    }
+    return false;
+}
+
+void SharedCache::store(CacheRecord const& record) {
+    CacheRecord existing;
+    if (region == nullptr || get(record.module, record.offset, &existing)) {
+        return;
+    }
+    uint64_t size = recordSize(record.relocationCount, record.origLength, record.chunkLength);
+    if (size > maxRecordSize) {
+        return;
+    }
+
+    // the space of a record that doesn't make it into a slot is lost, nothing is appended often enough to matter
+    uint64_t at = region->used.fetch_add(size, std::memory_order_relaxed);
+    if (at + size > recordsSize) {
+        return;
+    }
+    writeRecord(record, region->records + at, size);
+
+    size_t first = firstSlot(record.module, record.offset);
+    for (size_t i = 0; i < maxProbes; i++) {
+        auto& slot = region->slots[(first + i) & (numSlots - 1)];
+        uint32_t state = SlotState::Empty;
+        if (!slot.state.compare_exchange_strong(state, SlotState::Claimed, std::memory_order_acquire)) {
+            if (state == SlotState::Published && slot.module == record.module && slot.offset == record.offset) {
+                // another process stored the site in the meantime
+                return;
+            }
+            continue;
+        }
+        slot.module = record.module;
+        slot.offset = record.offset;
+        slot.record = at;
+        // readers that see the slot published see the record too
+        slot.state.store(SlotState::Published, std::memory_order_release);
+        region->published.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+}
+
+std::vector<uint64_t> SharedCache::getReplacementPoints(uint64_t module) const {
+    std::vector<uint64_t> offsets;
+    if (region == nullptr) {
+        return offsets;
+    }
+    for (auto const& slot : region->slots) {
+        if (slot.state.load(std::memory_order_acquire) == SlotState::Published && slot.module == module) {
+            offsets.push_back(slot.offset);
+        }
+    }
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    return offsets;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Cache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct SharedCacheRegion;
+
+// Translations shared live between every process of the same configuration,
+// so a site one process translated is installed by the others without
+// translating it again, whatever program they run.
+//
+// The region is a named shared memory object, all zero when it is new, with a
+// table of slots keyed by module and offset and an append-only area of records
+// in the Cache file format. A writer reserves space for its record with an
+// atomic add, claims an empty slot with a compare and swap, fills it in and
+// then marks it published. Readers look at published slots only and never
+// wait, a slot that is still being written is skipped as if it wasn't there.
+// Nothing is ever removed, a full region stores nothing more.
+class SharedCache {
+    SharedCacheRegion* region = nullptr;
+
+    void close();
+
+public:
+    // stores nothing and finds nothing
+    SharedCache() = default;
+    SharedCache(const char* name);
+    SharedCache(SharedCache&& other);
+    SharedCache& operator=(SharedCache&& other);
+    SharedCache(SharedCache const&) = delete;
+    SharedCache& operator=(SharedCache const&) = delete;
+    ~SharedCache();
+
+    // the name of the region for a configuration, see cacheConfiguration
+    static std::string name(uint64_t configuration);
+    static void remove(const char* name);
+
+    bool isOpen() const { return region != nullptr; }
+    // published records
+    size_t size() const;
+
+    void store(CacheRecord const& record);
+    bool get(uint64_t module, uint64_t offset, CacheRecord* record) const;
+    // sites of the module that have a record, relative to its base
+    std::vector<uint64_t> getReplacementPoints(uint64_t module) const;
+};
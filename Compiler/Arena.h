@@ -0,0 +1,119 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "../utils.h"
+
+// Bump allocator for everything a single translation decodes and compiles. An
+// ArenaScope around the translation hands it out and takes it all back at once
+// when the scope ends, so a trap needs no malloc or free. The memory is mapped
+// on the first translation of a thread and reused by every later one.
+class Arena {
+    static const size_t capacity = 4 << 20;
+
+    uint8_t* memory;
+    size_t used;
+    bool active;
+
+public:
+    // the arena of the current thread
+    static Arena& local() {
+        // trivially constructible, so taking it costs no guard or TLS initializer
+        static thread_local Arena arena;
+        return arena;
+    }
+
+    bool isActive() const { return active; }
+
+    // nullptr when the arena is full, the caller falls back to the heap
+    void* allocate(size_t size, size_t alignment) {
+        if (memory == nullptr) {
+            void* mapped = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapped == MAP_FAILED) {
+                debug_print("Failed to map the translation arena\n");
+                exit(1);
+            }
+            memory = (uint8_t*)mapped;
+        }
+
+        size_t start = (used + alignment - 1) & ~(alignment - 1);
+        if (start + size > capacity) {
+            return nullptr;
+        }
+        used = start + size;
+        return memory + start;
+    }
+
+    bool owns(const void* p) const {
+        return memory != nullptr && p >= memory && p < memory + capacity;
+    }
+
+    size_t bytesUsed() const { return used; }
+
+    friend class ArenaScope;
+};
+
+// Allocations made while it lives come from the arena of the thread and are
+// released together when it ends. Nested scopes share the outermost one.
+class ArenaScope {
+    bool outermost;
+
+public:
+    ArenaScope() : outermost(!Arena::local().active) {
+        Arena::local().active = true;
+    }
+
+    ~ArenaScope() {
+        if (outermost) {
+            auto& arena = Arena::local();
+            arena.active = false;
+            arena.used = 0;
+        }
+    }
+
+    ArenaScope(ArenaScope const&) = delete;
+    ArenaScope& operator=(ArenaScope const&) = delete;
+};
+
+// Takes memory from the arena inside an ArenaScope and from the heap outside of
+// one, so containers using it work the same in both. Freeing arena memory is a
+// no-op, it is reclaimed when the scope ends.
+template<class T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    ArenaAllocator() = default;
+    template<class U>
+    ArenaAllocator(ArenaAllocator<U> const&) {}
+
+    T* allocate(size_t n) {
+        auto& arena = Arena::local();
+        if (arena.isActive()) {
+            if (void* p = arena.allocate(n * sizeof(T), alignof(T))) {
+                return (T*)p;
+            }
+        }
+        return (T*)::operator new(n * sizeof(T), std::align_val_t(alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (!Arena::local().owns(p)) {
+            ::operator delete(p, std::align_val_t(alignof(T)));
+        }
+    }
+
+    template<class U>
+    bool operator==(ArenaAllocator<U> const&) const { return true; }
+    template<class U>
+    bool operator!=(ArenaAllocator<U> const&) const { return false; }
+};
+
+template<class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
@@ -1,7 +1,10 @@
 #include "Compiler.h"
+#include "Peephole.h"
+#include "DirectEmitter.h"
 #include "xed/xed-decoded-inst.h"
 #include "xed/xed-iform-enum.h"
 #include "xed/xed-reg-enum.h"
+#include <algorithm>
 #include <cstring>
 #include <memory>
 
@@ -41,8 +44,120 @@ void Compiler::addInstruction(std::shared_ptr<Instruction> const& instr) {
     instructions.push_back(instr);
 }
 
-std::vector<Compiler::instruction> Compiler::compile(CompilationStrategy compilationStrategy, uint64_t returnAddress) {
-    std::vector<instruction> encodedInstructions;
+void Compiler::setLoopBranch(xed_iclass_enum_t iclass, size_t targetInstruction) {
+    loopBranch = iclass;
+    loopTarget = targetInstruction;
+}
+
+void Compiler::setLaneCoalescing(bool enabled) {
+    laneCoalescing = enabled;
+}
+
+void Compiler::setZeroUpperTracking(bool enabled) {
+    zeroUpperTracking = enabled;
+}
+
+void Compiler::setPeephole(bool enabled) {
+    peephole = enabled;
+}
+
+void Compiler::setFlagLiveness(bool enabled) {
+    flagLiveness = enabled;
+}
+
+void Compiler::setRegisterLiveness(bool enabled) {
+    registerLiveness = enabled;
+}
+
+void Compiler::setLiveOut(LiveState const& live) {
+    liveOut = live;
+}
+
+void Compiler::setDirectEmitter(bool enabled) {
+    directEmitter = enabled;
+}
+
+void Compiler::setRipMode(RipMode mode) {
+    ripMode = mode;
+}
+
+// One past the last instruction of the run of lane-local instructions starting at first
+size_t Compiler::laneLocalRunEnd(size_t first) const {
+    if (!laneCoalescing) {
+        return first + 1;
+    }
+
+    bool runReadsMemory = false;
+    bool runWritesMemory = false;
+    size_t end = first;
+    for (; end < instructions.size() && instructions[end]->isLaneLocal(); end++) {
+        // the back edge of a loop must enter at the start of a run
+        if (end != first && loopBranch != XED_ICLASS_INVALID && end == loopTarget) {
+            break;
+        }
+
+        // upper lanes run after every lower lane of the run, so no access may meet a store of another instruction
+        auto xedd = instructions[end]->getDecodedInstr();
+        bool readsMemory = false;
+        bool writesMemory = false;
+        for (uint32_t i = 0; i < xed_decoded_inst_number_of_memory_operands(xedd); i++) {
+            readsMemory = readsMemory || xed_decoded_inst_mem_read(xedd, i);
+            writesMemory = writesMemory || xed_decoded_inst_mem_written(xedd, i);
+        }
+        if ((writesMemory && (runReadsMemory || runWritesMemory)) || (readsMemory && runWritesMemory)) {
+            break;
+        }
+        runReadsMemory = runReadsMemory || readsMemory;
+        runWritesMemory = runWritesMemory || writesMemory;
+    }
+
+    return std::max(end, first + 1);
+}
+
+ArenaVector<LiveState> Compiler::liveAfter() const {
+    ArenaVector<Liveness::Use> uses;
+    uses.reserve(instructions.size());
+    for (auto const& instr : instructions) {
+        uses.push_back(Liveness::use(instr->getDecodedInstr()));
+    }
+
+    // the loop branch reads the flags, and the back edge carries what is live at the loop head
+    ArenaVector<LiveState> live(instructions.size());
+    bool loop = loopBranch != XED_ICLASS_INVALID;
+    LiveState end = liveOut;
+    if (loop) {
+        end.flags = Liveness::arithmeticFlags();
+    }
+    while (true) {
+        LiveState current = end;
+        LiveState head;
+        for (size_t i = instructions.size(); i-- > 0;) {
+            live[i] = current;
+            current = uses[i].liveBefore(current);
+            if (i == loopTarget) {
+                head = current;
+            }
+        }
+        if (!loop || (end | head) == end) {
+            break;
+        }
+        end = end | head;
+    }
+
+    for (auto& state : live) {
+        if (!flagLiveness) {
+            state.flags = Liveness::arithmeticFlags();
+        }
+        if (!registerLiveness) {
+            state.gprs = LiveState::all().gprs;
+            state.xmms = LiveState::all().xmms;
+        }
+    }
+    return live;
+}
+
+ArenaVector<Compiler::instruction> Compiler::compile(CompilationStrategy compilationStrategy, uint64_t returnAddress) {
+    ArenaVector<instruction> encodedInstructions;
 
     const xed_state_t dstate = {.mmode = XED_MACHINE_MODE_LONG_64,
             .stack_addr_width = XED_ADDRESS_WIDTH_64b};
@@ -56,55 +171,178 @@ std::vector<Compiler::instruction> Compiler::compile(CompilationStrategy compila
         encodedInstructions.push_back(instr); // this restore RAX state to pre-jump
     }
 
+    // the lowered requests of every instruction, and where the one the loop branches to starts
+    Requests requests;
+    size_t loopTargetRequest = 0;
+    auto lower = [&](std::shared_ptr<Instruction> const& instr, Requests const& lowered) {
+        debug_print("Compiling %s...\n", xed_iform_enum_t2str(instr->getIform()));
+        requests.insert(requests.end(), lowered.begin(), lowered.end());
+    };
+
+    auto live = liveAfter();
+
+    // nothing is known on entry, and at the loop head the back edge may bring any state
+    BlockContext blockContext;
+    constantPool.clear();
     for (auto& instr : instructions) {
-        auto requests = instr->compile(compilationStrategy);
+        instr->setBlockContext(zeroUpperTracking ? &blockContext : nullptr);
+        instr->setRipMode(ripMode);
+        instr->setConstantPool(&constantPool);
+    }
 
-        debug_print("Compiling %s...\n", xed_iform_enum_t2str(instr->getIform()));
+    for (size_t first = 0; first < instructions.size();) {
+        if (loopBranch != XED_ICLASS_INVALID && first == loopTarget) {
+            blockContext = BlockContext();
+            loopTargetRequest = requests.size();
+        }
 
-        for (uint32_t i = 0; i < requests.size(); i++) {
-            xed_encoder_request_t &req = requests[i];
-            instruction instr2;
-            xed_error_enum_t err = xed_encode(&req, instr2.buffer, 15, &instr2.olen);
-            if (err != XED_ERROR_NONE) {
-                print_instr((xed_decoded_inst_t*)instr->getDecodedInstr());
-                for (uint32_t j = 0; j <= i; j++){
-                    debug_print("%d: Compiled %s\n", j, xed_iclass_enum_t2str(xed_encoder_request_get_iclass(&requests[j])));
-                }
-                debug_print("%d: Encoder error: %s\n", i, xed_error_enum_t2str(err));
-                debug_print("Instruction: %s\n", xed_iclass_enum_t2str(xed_encoder_request_get_iclass(&req)));
-                exit(1);
+        size_t runEnd = laneLocalRunEnd(first);
+        if (runEnd - first < 2) {
+            instructions[first]->setLiveAfter(live[first]);
+            lower(instructions[first], instructions[first]->compile(compilationStrategy));
+            first++;
+            continue;
+        }
+
+        // lanes interleave across the run, so only what none of it touches is dead anywhere inside
+        LiveState runLive = live[runEnd - 1];
+        for (size_t i = first; i < runEnd; i++) {
+            auto use = Liveness::use(instructions[i]->getDecodedInstr());
+            runLive = runLive | use.read | use.written;
+        }
+        for (size_t i = first; i < runEnd; i++) {
+            instructions[i]->setLiveAfter(runLive);
+        }
+
+        // all lower lanes first, then all upper lanes with the union of their registers swapped in once
+        RegSet upperRegs;
+        for (size_t i = first; i < runEnd; i++) {
+            lower(instructions[i], instructions[i]->compileLane(compilationStrategy, false, {}, {}));
+            for (auto reg : instructions[i]->upperLaneRegs()) {
+                upperRegs.insert(reg);
+            }
+        }
+        for (size_t i = first; i < runEnd; i++) {
+            auto const& swapIn = i == first ? upperRegs : RegSet();
+            auto const& swapOut = i + 1 == runEnd ? upperRegs : RegSet();
+            lower(instructions[i], instructions[i]->compileLane(compilationStrategy, true, swapIn, swapOut));
+        }
+        first = runEnd;
+    }
+
+    for (auto& instr : instructions) {
+        instr->setBlockContext(nullptr);
+        instr->setConstantPool(nullptr);
+    }
+
+    // the loop head is a branch target, so nothing may be combined across it
+    if (peephole) {
+        Peephole pass;
+        loopTargetRequest = pass.optimize(requests, 0, loopTargetRequest);
+        pass.optimize(requests, loopTargetRequest, requests.size());
+        debug_print("Peephole removed %lu requests\n", pass.removed());
+    }
+
+    relocatable = ripMode != RipMode::Absolute && ymm_storage_segment() != XED_REG_INVALID;
+    absoluteRelocations.clear();
+
+    // RIP-relative requests carry their absolute target or a constant reference in the displacement,
+    // the rel32 is patched in from the fixups once the chunk or the data after it is placed
+    ripFixups.clear();
+    ArenaVector<std::pair<size_t, RipFixup>> dataLoads;
+
+    uint32_t offset = 0;
+    for (auto const& encoded : encodedInstructions) {
+        offset += encoded.olen;
+    }
+    uint32_t loopTargetOffset = offset;
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (i == loopTargetRequest) {
+            loopTargetOffset = offset;
+        }
+
+        bool ripRelative = xed3_operand_get_base0(&requests[i]) == XED_REG_RIP;
+        bool constant = ripRelative && ConstantPool::isReference(xed3_operand_get_disp(&requests[i]));
+        ripRelative = constant || (ripRelative && ripMode != RipMode::Absolute);
+        uint64_t ripTarget = 0;
+        if (ripRelative) {
+            ripTarget = xed3_operand_get_disp(&requests[i]);
+            xed_encoder_request_set_memory_displacement(&requests[i], 0, 4);
+        }
+
+        instruction instr;
+        xed_error_enum_t err = XED_ERROR_NONE;
+        if (!directEmitter || !DirectEmitter::encode(&requests[i], instr.buffer, &instr.olen)) {
+            err = xed_encode(&requests[i], instr.buffer, 15, &instr.olen);
+        }
+        if (err != XED_ERROR_NONE) {
+            for (auto const& blockInstr : instructions) {
+                print_instr((xed_decoded_inst_t*)blockInstr->getDecodedInstr());
             }
+            debug_print("%zu: Encoder error: %s\n", i, xed_error_enum_t2str(err));
+            debug_print("Instruction: %s\n", xed_iclass_enum_t2str(xed_encoder_request_get_iclass(&requests[i])));
+            exit(1);
+        }
 
-            // xed_decoded_inst_t xedd;
-            // uint32_t olen;
-            // decode_instruction3(instr.buffer, &xedd, &olen);
+        if (ripRelative) {
+            xed_decoded_inst_t encoded;
+            xed_decoded_inst_zero(&encoded);
+            xed_decoded_inst_set_mode(&encoded, dstate.mmode, dstate.stack_addr_width);
+            xed_decode(&encoded, instr.buffer, instr.olen);
+            RipFixup fixup = {
+                .displacement = offset + xed3_operand_get_pos_disp(&encoded),
+                .next = offset + instr.olen,
+                .target = ripTarget,
+            };
+            if (constant || ripMode == RipMode::Pool) {
+                dataLoads.push_back({encodedInstructions.size(), fixup});
+            } else {
+                ripFixups.push_back(fixup);
+            }
+        }
+
+        encodedInstructions.push_back(instr);
+        offset += instr.olen;
+    }
+    if (loopTargetRequest == requests.size()) {
+        loopTargetOffset = offset;
+    }
 
-            encodedInstructions.push_back(instr2);
+    if (loopBranch != XED_ICLASS_INVALID) {
+        // the back edge stays inside the chunk, falling through leaves the loop
+        const uint32_t jccRel32Length = 6;
+        xed_encoder_request_t req;
+        xed_encoder_instruction_t enc_inst;
+        xed_inst1(&enc_inst, dstate, loopBranch, 64, xed_relbr((int32_t)loopTargetOffset - (int32_t)(offset + jccRel32Length), 32));
+        xed_convert_to_encoder_request(&req, &enc_inst);
+        instruction instr;
+        xed_error_enum_t err = xed_encode(&req, instr.buffer, 15, &instr.olen);
+        if (err != XED_ERROR_NONE || instr.olen != jccRel32Length) {
+            debug_print("Encoder error for loop branch %s: %s\n", xed_iclass_enum_t2str(loopBranch), xed_error_enum_t2str(err));
+            exit(1);
         }
+        encodedInstructions.push_back(instr);
+        offset += instr.olen;
     }
 
     if (compilationStrategy == CompilationStrategy::FarJump) {
-        // PUSH RAX
+        // JMP [RIP], the return address follows, so RAX is left as the block left it
         instruction instr = {
-            .buffer = {0x50},
-            .olen = 1,
+            .buffer = {0xff, 0x25, 0x00, 0x00, 0x00, 0x00},
+            .olen = 14,
         };
-        encodedInstructions.push_back(instr); // this save RAX state for later
-
-        // MOV RAX, returnAddress
-        instruction instr2 = {
-            .buffer = {0x48, 0xb8},
-            .olen = 10,
-        };
-        *(uint64_t*)(instr2.buffer + 2) = returnAddress;
-        encodedInstructions.push_back(instr2);
+        *(uint64_t*)(instr.buffer + 6) = returnAddress;
+        encodedInstructions.push_back(instr);
+        absoluteRelocations.push_back({Relocation::Kind::Abs64, offset + 6, 0, returnAddress});
+    }
 
-        // JMP RAX
-        instruction instr3 = {
-            .buffer = {0xff, 0xe0},
-           .olen = 2,
+    if (compilationStrategy == CompilationStrategy::NearJump) {
+        // JMP rel32, the displacement is filled in once the chunk is placed
+        instruction instr = {
+            .buffer = {0xe9},
+            .olen = 5,
         };
-        encodedInstructions.push_back(instr3);
+        encodedInstructions.push_back(instr);
     }
 
     if (compilationStrategy == CompilationStrategy::DirectCall || compilationStrategy == CompilationStrategy::DirectCallPopRax) {
@@ -125,24 +363,142 @@ std::vector<Compiler::instruction> Compiler::compile(CompilationStrategy compila
         encodedInstructions.push_back(instr);
     }
 
+    codeLength = 0;
+    for (auto const& encoded : encodedInstructions) {
+        codeLength += encoded.olen;
+    }
+
+    // the constants follow the code 16-byte aligned, then the literal pool with one entry per distinct address
+    if (!dataLoads.empty()) {
+        uint32_t dataOffset = codeLength;
+        auto emitData = [&](const void* data, uint32_t size) {
+            for (uint32_t done = 0; done < size; done += 8) {
+                instruction instr = { .olen = std::min(size - done, 8u) };
+                memcpy(instr.buffer, (const uint8_t*)data + done, instr.olen);
+                encodedInstructions.push_back(instr);
+            }
+            dataOffset += size;
+        };
+
+        if (dataOffset % 16 != 0) {
+            uint8_t padding[16];
+            memset(padding, 0xcc, sizeof(padding));
+            emitData(padding, 16 - dataOffset % 16);
+        }
+        uint32_t constantsOffset = dataOffset;
+        for (auto const& value : constantPool.entries()) {
+            emitData(&value, sizeof(value));
+        }
+
+        uint32_t poolOffset = dataOffset;
+        ArenaVector<uint64_t> pool;
+        for (auto const& [index, load] : dataLoads) {
+            uint32_t entryOffset;
+            if (ConstantPool::isReference(load.target)) {
+                entryOffset = constantsOffset + ConstantPool::offset(load.target);
+            } else {
+                auto entry = std::find(pool.begin(), pool.end(), load.target);
+                if (entry == pool.end()) {
+                    entry = pool.insert(pool.end(), load.target);
+                    absoluteRelocations.push_back({Relocation::Kind::Abs64, dataOffset, 0, load.target});
+                    emitData(&load.target, 8);
+                }
+                entryOffset = poolOffset + 8 * (entry - pool.begin());
+            }
+
+            uint32_t position = load.displacement - (load.next - encodedInstructions[index].olen);
+            *(int32_t*)(encodedInstructions[index].buffer + position) = (int32_t)(entryOffset - load.next);
+        }
+    }
+
     return encodedInstructions;
 }
 
+bool Relocation::apply(uint8_t* code, uint8_t* chunk) const {
+    if (kind == Kind::Abs64) {
+        *(uint64_t*)(code + offset) = target;
+        return true;
+    }
+    int64_t rel = (int64_t)(target - (uint64_t)(chunk + next));
+    *(int32_t*)(code + offset) = (int32_t)rel;
+    return rel == (int32_t)rel;
+}
+
+// Whether every RIP-relative displacement reaches its target from a chunk placed at stencil
+static bool ripFixupsReach(uint8_t* stencil, ArenaVector<RipFixup> const& fixups) {
+    for (auto const& fixup : fixups) {
+        int64_t rel = (int64_t)(fixup.target - (uint64_t)(stencil + fixup.next));
+        if (rel != (int32_t)rel) {
+            return false;
+        }
+    }
+    return true;
+}
+
 uint8_t* Compiler::encode(CompilationStrategy compilationStrategy, uint32_t *length, uint64_t returnAddress) {
-    auto const& encodedInstructions = compile(compilationStrategy, returnAddress);
+    auto encodedInstructions = compile(compilationStrategy, returnAddress);
 
     uint32_t total_olen = 0;
-    for (auto const &instr : encodedInstructions) {
-        total_olen += instr.olen;
+    auto place = [&]() -> uint8_t* {
+        total_olen = 0;
+        for (auto const &instr : encodedInstructions) {
+            total_olen += instr.olen;
+        }
+
+        if (compilationStrategy == CompilationStrategy::NearJump) {
+            return alloc_executable_near(returnAddress, total_olen);
+        }
+        return alloc_executable(total_olen);
+    };
+
+    uint8_t *stencil = place();
+    if (stencil == nullptr) {
+        return nullptr;
+    }
+    if (!ripFixupsReach(stencil, ripFixups)) {
+        debug_print("RIP-relative operands out of reach of the chunk at %p, using a literal pool\n", stencil);
+        // never written, the next chunk can take it
+        write_protect_memory(stencil, total_olen);
+        free_executable(stencil, total_olen);
+        auto mode = ripMode;
+        ripMode = RipMode::Pool;
+        encodedInstructions = compile(compilationStrategy, returnAddress);
+        ripMode = mode;
+        stencil = place();
+        if (stencil == nullptr) {
+            return nullptr;
+        }
     }
 
-    uint8_t *stencil = alloc_executable(total_olen); // Yes, a memory leak TODO
+    // the same bytes as stencil, but writable when the code cache is dual mapped
+    uint8_t *code = code_cache_writable(stencil);
     uint32_t offset = 0;
     for (auto const &instr : encodedInstructions) {
-        memcpy(stencil + offset, instr.buffer, instr.olen);
+        memcpy(code + offset, instr.buffer, instr.olen);
         offset += instr.olen;
     }
 
+    relocations.clear();
+    for (auto const& fixup : ripFixups) {
+        relocations.push_back({Relocation::Kind::Rel32, fixup.displacement, fixup.next, fixup.target});
+    }
+    if (compilationStrategy == CompilationStrategy::NearJump) {
+        relocations.push_back({Relocation::Kind::Rel32, codeLength - 4, codeLength, returnAddress});
+    }
+    relocations.insert(relocations.end(), absoluteRelocations.begin(), absoluteRelocations.end());
+    for (auto const& relocation : relocations) {
+        relocation.apply(code, stencil);
+    }
+
+    write_protect_memory(stencil, offset);
     *length = offset;
     return stencil;
 }
+
+ArenaVector<Relocation> const& Compiler::getRelocations() const {
+    return relocations;
+}
+
+bool Compiler::isRelocatable() const {
+    return relocatable;
+}
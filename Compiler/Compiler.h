@@ -9,9 +9,62 @@ extern "C"{
 #include <vector>
 #include <memory>
 #include "../Instructions/Instruction.h"
+#include "Liveness.h"
+#include "ConstantPool.h"
+#include "Arena.h"
+
+// A rel32 displacement at chunk offset displacement, relative to chunk offset next, that must reach target
+struct RipFixup {
+    uint32_t displacement;
+    uint32_t next;
+    uint64_t target;
+};
+
+// An address a placed chunk holds, so the chunk can be placed again when the code it translates is loaded elsewhere
+struct Relocation {
+    enum class Kind {
+        // rel32 at offset, relative to chunk offset next
+        Rel32,
+        // absolute 64-bit address at offset
+        Abs64,
+    };
+
+    Kind kind;
+    uint32_t offset;
+    uint32_t next;
+    uint64_t target;
+
+    // Writes target into code, the bytes of a chunk that runs at chunk, false if a Rel32 can't reach it
+    bool apply(uint8_t* code, uint8_t* chunk) const;
+};
 
 class Compiler {
-    std::vector<std::shared_ptr<Instruction>> instructions;
+    ArenaVector<std::shared_ptr<Instruction>> instructions;
+    xed_iclass_enum_t loopBranch = XED_ICLASS_INVALID;
+    size_t loopTarget = 0;
+    bool laneCoalescing = true;
+    bool zeroUpperTracking = true;
+    bool peephole = true;
+    bool flagLiveness = true;
+    bool registerLiveness = true;
+    bool directEmitter = true;
+    LiveState liveOut = LiveState::all();
+    RipMode ripMode = RipMode::Relative;
+
+    // filled by compile in RipMode::Relative, applied by encode once the chunk is placed
+    ArenaVector<RipFixup> ripFixups;
+    ConstantPool constantPool;
+    // where the code ends and the constants and the literal pool start
+    uint32_t codeLength = 0;
+    // the literal pool entries and the return address of a FarJump chunk, filled by compile
+    ArenaVector<Relocation> absoluteRelocations;
+    // every address in the chunk encode placed last
+    ArenaVector<Relocation> relocations;
+    bool relocatable = false;
+
+    size_t laneLocalRunEnd(size_t first) const;
+    // what may be read after every instruction, with the switches applied
+    ArenaVector<LiveState> liveAfter() const;
 public:
     struct instruction {
         uint8_t buffer[15];
@@ -21,8 +74,33 @@ public:
     Compiler();
 
     void addInstruction(std::shared_ptr<Instruction> const& instr);
+    // Closes the instructions into a loop: the chunk ends with a Jcc back to instruction targetInstruction
+    void setLoopBranch(xed_iclass_enum_t iclass, size_t targetInstruction);
+    // Runs the upper lanes of consecutive lane-local instructions between a single swap in and out
+    void setLaneCoalescing(bool enabled);
+    // Skips zeroing upper halves already known to be zero earlier in the block
+    void setZeroUpperTracking(bool enabled);
+    // Removes redundant pushes, pops, moves and stack adjustments where lowering sequences meet
+    void setPeephole(bool enabled);
+    // Leaves out saving the flags around lowerings when nothing reads them before they are overwritten
+    void setFlagLiveness(bool enabled);
+    // Hands out registers dead after an instruction as scratch registers, without spilling them
+    void setRegisterLiveness(bool enabled);
+    // What the code after the block may read, see Liveness::liveAt
+    void setLiveOut(LiveState const& live);
+    // Encodes the common forms with the DirectEmitter instead of xed_encode
+    void setDirectEmitter(bool enabled);
+    // How RIP-relative operands of the original code are addressed, encode falls back from
+    // Relative to Pool when the chunk lands out of rel32 reach of an operand
+    void setRipMode(RipMode mode);
 
-    std::vector<instruction> compile(CompilationStrategy compilationStrategy, uint64_t returnAddress);
+    ArenaVector<instruction> compile(CompilationStrategy compilationStrategy, uint64_t returnAddress);
 
+    // Returns nullptr when a NearJump chunk cannot be placed within rel32 reach of returnAddress
     uint8_t* encode(CompilationStrategy compilationStrategy, uint32_t *length, uint64_t returnAddress);
+
+    // The addresses in the chunk encode returned, and whether they are all there is: the
+    // Absolute RIP mode and calls to get_ymm_storage leave addresses that aren't listed
+    ArenaVector<Relocation> const& getRelocations() const;
+    bool isRelocatable() const;
 };
\ No newline at end of file
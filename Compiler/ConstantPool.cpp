@@ -0,0 +1,21 @@
+#include "ConstantPool.h"
+#include <cstring>
+
+bool ConstantPool::isReference(uint64_t displacement) {
+    return (displacement & referenceTag) == referenceTag;
+}
+
+uint32_t ConstantPool::offset(uint64_t reference) {
+    return reference & ~referenceTag;
+}
+
+uint64_t ConstantPool::reference(__m128i value) {
+    size_t i = 0;
+    while (i < constants.size() && memcmp(&constants[i], &value, sizeof(value)) != 0) {
+        i++;
+    }
+    if (i == constants.size()) {
+        constants.push_back(value);
+    }
+    return referenceTag | (i * sizeof(__m128i));
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <immintrin.h>
+#include <vector>
+#include "Arena.h"
+
+// The 16-byte constants the lowerings of a block load, placed 16-byte aligned after
+// the chunk and addressed RIP-relative. Until the Compiler places them a reference is
+// a RIP-relative displacement with the tag bits set, which no address the original
+// code can reach has.
+class ConstantPool {
+    ArenaVector<__m128i> constants;
+
+public:
+    static const uint64_t referenceTag = 0xfff0000000000000;
+
+    static bool isReference(uint64_t displacement);
+    // offset of the referenced entry from the start of the pool
+    static uint32_t offset(uint64_t reference);
+
+    // Equal values share an entry
+    uint64_t reference(__m128i value);
+
+    ArenaVector<__m128i> const& entries() const { return constants; }
+    void clear() { constants.clear(); }
+};
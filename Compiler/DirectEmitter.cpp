@@ -0,0 +1,340 @@
+#include "DirectEmitter.h"
+
+// Mandatory prefix and opcode after 0F of an SSE form, store is the opcode with
+// the memory operand first or 0 when there is none
+struct SseForm {
+    uint8_t prefix;
+    uint8_t load;
+    uint8_t store;
+};
+
+static bool sseForm(xed_iclass_enum_t iclass, SseForm* form) {
+    switch (iclass) {
+        case XED_ICLASS_MOVUPS: *form = {0x00, 0x10, 0x11}; return true;
+        case XED_ICLASS_MOVUPD: *form = {0x66, 0x10, 0x11}; return true;
+        case XED_ICLASS_MOVAPS: *form = {0x00, 0x28, 0x29}; return true;
+        case XED_ICLASS_MOVAPD: *form = {0x66, 0x28, 0x29}; return true;
+        case XED_ICLASS_MOVDQU: *form = {0xf3, 0x6f, 0x7f}; return true;
+        case XED_ICLASS_MOVDQA: *form = {0x66, 0x6f, 0x7f}; return true;
+        case XED_ICLASS_ANDPS: *form = {0x00, 0x54, 0}; return true;
+        case XED_ICLASS_ANDPD: *form = {0x66, 0x54, 0}; return true;
+        case XED_ICLASS_ANDNPS: *form = {0x00, 0x55, 0}; return true;
+        case XED_ICLASS_ANDNPD: *form = {0x66, 0x55, 0}; return true;
+        case XED_ICLASS_ORPS: *form = {0x00, 0x56, 0}; return true;
+        case XED_ICLASS_ORPD: *form = {0x66, 0x56, 0}; return true;
+        case XED_ICLASS_XORPS: *form = {0x00, 0x57, 0}; return true;
+        case XED_ICLASS_XORPD: *form = {0x66, 0x57, 0}; return true;
+        case XED_ICLASS_ADDPS: *form = {0x00, 0x58, 0}; return true;
+        case XED_ICLASS_ADDPD: *form = {0x66, 0x58, 0}; return true;
+        case XED_ICLASS_ADDSS: *form = {0xf3, 0x58, 0}; return true;
+        case XED_ICLASS_ADDSD: *form = {0xf2, 0x58, 0}; return true;
+        case XED_ICLASS_MULPS: *form = {0x00, 0x59, 0}; return true;
+        case XED_ICLASS_MULPD: *form = {0x66, 0x59, 0}; return true;
+        case XED_ICLASS_MULSS: *form = {0xf3, 0x59, 0}; return true;
+        case XED_ICLASS_MULSD: *form = {0xf2, 0x59, 0}; return true;
+        case XED_ICLASS_SUBPS: *form = {0x00, 0x5c, 0}; return true;
+        case XED_ICLASS_SUBPD: *form = {0x66, 0x5c, 0}; return true;
+        case XED_ICLASS_SUBSS: *form = {0xf3, 0x5c, 0}; return true;
+        case XED_ICLASS_SUBSD: *form = {0xf2, 0x5c, 0}; return true;
+        case XED_ICLASS_DIVSS: *form = {0xf3, 0x5e, 0}; return true;
+        case XED_ICLASS_DIVSD: *form = {0xf2, 0x5e, 0}; return true;
+        case XED_ICLASS_UNPCKLPS: *form = {0x00, 0x14, 0}; return true;
+        case XED_ICLASS_UNPCKHPS: *form = {0x00, 0x15, 0}; return true;
+        case XED_ICLASS_PCMPGTB: *form = {0x66, 0x64, 0}; return true;
+        case XED_ICLASS_PCMPGTW: *form = {0x66, 0x65, 0}; return true;
+        case XED_ICLASS_PCMPGTD: *form = {0x66, 0x66, 0}; return true;
+        case XED_ICLASS_PCMPEQB: *form = {0x66, 0x74, 0}; return true;
+        case XED_ICLASS_PCMPEQW: *form = {0x66, 0x75, 0}; return true;
+        case XED_ICLASS_PCMPEQD: *form = {0x66, 0x76, 0}; return true;
+        case XED_ICLASS_PADDQ: *form = {0x66, 0xd4, 0}; return true;
+        case XED_ICLASS_PAND: *form = {0x66, 0xdb, 0}; return true;
+        case XED_ICLASS_PANDN: *form = {0x66, 0xdf, 0}; return true;
+        case XED_ICLASS_POR: *form = {0x66, 0xeb, 0}; return true;
+        case XED_ICLASS_PXOR: *form = {0x66, 0xef, 0}; return true;
+        case XED_ICLASS_PSUBB: *form = {0x66, 0xf8, 0}; return true;
+        case XED_ICLASS_PSUBW: *form = {0x66, 0xf9, 0}; return true;
+        case XED_ICLASS_PSUBD: *form = {0x66, 0xfa, 0}; return true;
+        case XED_ICLASS_PSUBQ: *form = {0x66, 0xfb, 0}; return true;
+        case XED_ICLASS_PADDB: *form = {0x66, 0xfc, 0}; return true;
+        case XED_ICLASS_PADDW: *form = {0x66, 0xfd, 0}; return true;
+        case XED_ICLASS_PADDD: *form = {0x66, 0xfe, 0}; return true;
+        default: return false;
+    }
+}
+
+// Encoding number of a 64 or 32-bit GPR, or -1
+static int gprNumber(xed_reg_enum_t reg, uint32_t width) {
+    if (width == 64 && reg >= XED_REG_RAX && reg <= XED_REG_R15) {
+        return reg - XED_REG_RAX;
+    }
+    if (width == 32 && reg >= XED_REG_EAX && reg <= XED_REG_R15D) {
+        return reg - XED_REG_EAX;
+    }
+    return -1;
+}
+
+static int xmmNumber(xed_reg_enum_t reg) {
+    if (reg >= XED_REG_XMM0 && reg <= XED_REG_XMM15) {
+        return reg - XED_REG_XMM0;
+    }
+    return -1;
+}
+
+// The instruction up to and including ModRM, SIB and displacement
+class Bytes {
+    uint8_t* buffer;
+    uint32_t length = 0;
+
+public:
+    Bytes(uint8_t* buffer) : buffer(buffer) {}
+
+    void byte(uint8_t value) { buffer[length++] = value; }
+    void bytes(uint64_t value, uint32_t count) {
+        for (uint32_t i = 0; i < count; i++) {
+            byte(value >> (8 * i));
+        }
+    }
+    uint32_t size() const { return length; }
+};
+
+// ModRM with reg in the reg field and a register or the memory operand of the request in rm
+struct RmOperand {
+    bool memory = false;
+    int rm = 0;
+    int base = -1;
+    int index = -1;
+    uint32_t scale = 1;
+    int64_t disp = 0;
+    uint32_t dispBits = 0;
+    bool rip = false;
+};
+
+static bool memoryOperand(xed_encoder_request_t* request, RmOperand* op) {
+    if (xed3_operand_get_seg0(request) != XED_REG_INVALID) {
+        return false;
+    }
+
+    auto base = xed3_operand_get_base0(request);
+    auto index = xed3_operand_get_index(request);
+    op->memory = true;
+    op->rip = base == XED_REG_RIP;
+    op->base = gprNumber(base, 64);
+    op->index = gprNumber(index, 64);
+    op->scale = xed3_operand_get_scale(request);
+    op->disp = xed3_operand_get_disp(request);
+    op->dispBits = xed3_operand_get_disp_width(request);
+
+    if (!op->rip && op->base < 0) {
+        return false;
+    }
+    if (index != XED_REG_INVALID && (op->index < 0 || op->index == 4 || op->rip)) {
+        return false;
+    }
+    if (op->scale == 0) {
+        op->scale = 1;
+    }
+    if (op->dispBits == 0 && op->disp != 0) {
+        return false;
+    }
+    // RBP and R13 as base always take a displacement, XED's choice of its width is left to XED
+    if (op->dispBits == 0 && (op->base & 7) == 5) {
+        return false;
+    }
+    if ((op->dispBits == 8 && op->disp != (int8_t)op->disp) || (op->dispBits == 32 && op->disp != (int32_t)op->disp)) {
+        return false;
+    }
+    if (op->dispBits != 0 && op->dispBits != 8 && op->dispBits != 32) {
+        return false;
+    }
+    if (op->rip && op->dispBits != 32) {
+        return false;
+    }
+    return true;
+}
+
+static void emitRex(Bytes& out, bool w, int reg, RmOperand const& rm) {
+    uint8_t rex = 0x40;
+    rex |= w ? 0x08 : 0;
+    rex |= reg >= 8 ? 0x04 : 0;
+    if (rm.memory) {
+        rex |= rm.index >= 8 ? 0x02 : 0;
+        rex |= rm.base >= 8 ? 0x01 : 0;
+    } else {
+        rex |= rm.rm >= 8 ? 0x01 : 0;
+    }
+    if (rex != 0x40) {
+        out.byte(rex);
+    }
+}
+
+static void emitModRm(Bytes& out, int reg, RmOperand const& rm) {
+    if (!rm.memory) {
+        out.byte(0xc0 | (reg & 7) << 3 | (rm.rm & 7));
+        return;
+    }
+
+    if (rm.rip) {
+        out.byte((reg & 7) << 3 | 5);
+        out.bytes(rm.disp, 4);
+        return;
+    }
+
+    uint8_t mod = rm.dispBits == 0 ? 0 : rm.dispBits == 8 ? 1 : 2;
+    bool sib = rm.index >= 0 || (rm.base & 7) == 4;
+    out.byte(mod << 6 | (reg & 7) << 3 | (sib ? 4 : rm.base & 7));
+    if (sib) {
+        uint8_t ss = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+        int index = rm.index >= 0 ? rm.index & 7 : 4;
+        out.byte(ss << 6 | index << 3 | (rm.base & 7));
+    }
+    out.bytes(rm.disp, rm.dispBits / 8);
+}
+
+static bool encodeSse(xed_encoder_request_t* request, SseForm const& form, Bytes& out) {
+    // whether XED adds a REX.W for a 64-bit operand width is left to XED
+    if (xed_encoder_request_operand_order_entries(request) != 2 || xed3_operand_get_eosz(request) == 3) {
+        return false;
+    }
+    auto first = xed_encoder_request_get_operand_order(request, 0);
+    auto second = xed_encoder_request_get_operand_order(request, 1);
+
+    int reg;
+    RmOperand rm;
+    uint8_t opcode = form.load;
+    if (first == XED_OPERAND_REG0 && second == XED_OPERAND_REG1) {
+        reg = xmmNumber(xed3_operand_get_reg0(request));
+        rm.rm = xmmNumber(xed3_operand_get_reg1(request));
+        if (rm.rm < 0) {
+            return false;
+        }
+    } else if (first == XED_OPERAND_REG0 && second == XED_OPERAND_MEM0) {
+        reg = xmmNumber(xed3_operand_get_reg0(request));
+        if (!memoryOperand(request, &rm)) {
+            return false;
+        }
+    } else if (first == XED_OPERAND_MEM0 && second == XED_OPERAND_REG0 && form.store != 0) {
+        reg = xmmNumber(xed3_operand_get_reg0(request));
+        opcode = form.store;
+        if (!memoryOperand(request, &rm)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    if (reg < 0) {
+        return false;
+    }
+
+    if (form.prefix != 0) {
+        out.byte(form.prefix);
+    }
+    emitRex(out, false, reg, rm);
+    out.byte(0x0f);
+    out.byte(opcode);
+    emitModRm(out, reg, rm);
+    return true;
+}
+
+static bool encodeMov(xed_encoder_request_t* request, Bytes& out) {
+    if (xed_encoder_request_operand_order_entries(request) != 2) {
+        return false;
+    }
+    auto first = xed_encoder_request_get_operand_order(request, 0);
+    auto second = xed_encoder_request_get_operand_order(request, 1);
+    uint32_t width = xed3_operand_get_eosz(request) == 3 ? 64 : xed3_operand_get_eosz(request) == 2 ? 32 : 0;
+    if (width == 0) {
+        return false;
+    }
+
+    // MOV r64, imm64
+    if (first == XED_OPERAND_REG0 && second == XED_OPERAND_IMM0) {
+        int reg = gprNumber(xed3_operand_get_reg0(request), 64);
+        if (width != 64 || reg < 0 || xed3_operand_get_imm_width(request) != 64) {
+            return false;
+        }
+        out.byte(0x48 | (reg >= 8 ? 0x01 : 0));
+        out.byte(0xb8 + (reg & 7));
+        out.bytes(xed3_operand_get_uimm0(request), 8);
+        return true;
+    }
+
+    int reg;
+    RmOperand rm;
+    uint8_t opcode;
+    if (first == XED_OPERAND_REG0 && second == XED_OPERAND_REG1) {
+        // XED picks the 89 form, with the destination in rm
+        reg = gprNumber(xed3_operand_get_reg1(request), width);
+        rm.rm = gprNumber(xed3_operand_get_reg0(request), width);
+        opcode = 0x89;
+        if (rm.rm < 0) {
+            return false;
+        }
+    } else if (first == XED_OPERAND_REG0 && second == XED_OPERAND_MEM0) {
+        reg = gprNumber(xed3_operand_get_reg0(request), width);
+        opcode = 0x8b;
+        if (!memoryOperand(request, &rm)) {
+            return false;
+        }
+    } else if (first == XED_OPERAND_MEM0 && second == XED_OPERAND_REG0) {
+        reg = gprNumber(xed3_operand_get_reg0(request), width);
+        opcode = 0x89;
+        if (!memoryOperand(request, &rm)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    if (reg < 0) {
+        return false;
+    }
+
+    emitRex(out, width == 64, reg, rm);
+    out.byte(opcode);
+    emitModRm(out, reg, rm);
+    return true;
+}
+
+static bool encodePushPop(xed_encoder_request_t* request, uint8_t opcode, Bytes& out) {
+    if (xed_encoder_request_operand_order_entries(request) != 1 || xed_encoder_request_get_operand_order(request, 0) != XED_OPERAND_REG0) {
+        return false;
+    }
+    int reg = gprNumber(xed3_operand_get_reg0(request), 64);
+    if (reg < 0) {
+        return false;
+    }
+    if (reg >= 8) {
+        out.byte(0x41);
+    }
+    out.byte(opcode + (reg & 7));
+    return true;
+}
+
+bool DirectEmitter::encode(xed_encoder_request_t* request, uint8_t* buffer, uint32_t* olen) {
+    // built up aside, a form found uncovered halfway leaves the buffer alone
+    uint8_t bytes[15];
+    Bytes out(bytes);
+
+    auto iclass = xed_encoder_request_get_iclass(request);
+    SseForm form;
+    bool covered;
+    if (sseForm(iclass, &form)) {
+        covered = encodeSse(request, form, out);
+    } else if (iclass == XED_ICLASS_MOV) {
+        covered = encodeMov(request, out);
+    } else if (iclass == XED_ICLASS_PUSH) {
+        covered = encodePushPop(request, 0x50, out);
+    } else if (iclass == XED_ICLASS_POP) {
+        covered = encodePushPop(request, 0x58, out);
+    } else {
+        covered = false;
+    }
+    if (!covered) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < out.size(); i++) {
+        buffer[i] = bytes[i];
+    }
+    *olen = out.size();
+    return true;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+extern "C" {
+#include <xed/xed-interface.h>
+#include <xed/xed-encode.h>
+}
+
+#include <cstdint>
+
+// Encodes the forms the lowerings emit most, the SSE moves and arithmetic, GPR moves
+// and push/pop, straight into bytes without the search of xed_encode. The bytes are
+// the ones XED picks for the same request, everything else is left to XED.
+class DirectEmitter {
+public:
+    // Returns false and writes nothing when the request is not a covered form
+    static bool encode(xed_encoder_request_t* request, uint8_t* buffer, uint32_t* olen);
+};
@@ -2,9 +2,21 @@
 #include "../Instructions/Instructions.h"
 #include "../printinstr.h"
 #include "Compiler.h"
+#include "Liveness.h"
+#include "../Cache/Module.h"
+#ifdef __APPLE__
 #include <mach/mach_init.h>
 #include <mach/vm_map.h>
+#else
+#include <sys/mman.h>
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <optional>
 #include <pthread.h>
+#include <sched.h>
 #include <variant>
 
 void decode_instruction_internal(const uint8_t *inst, xed_decoded_inst_t *xedd, uint8_t *olen) {
@@ -23,15 +35,71 @@ void decode_instruction_internal(const uint8_t *inst, xed_decoded_inst_t *xedd,
     *olen = xed_decoded_inst_get_length(xedd);
 }
 
+// Sites are patched under a lock striped by page, so two threads that decoded
+// overlapping blocks can't install on top of each other.
+static std::mutex patchLocks[64];
+
+class PatchGuard {
+    std::mutex* first;
+    std::mutex* second = nullptr;
+
+    static size_t stripe(uint64_t address) {
+        return (address >> 12) % (sizeof(patchLocks) / sizeof(patchLocks[0]));
+    }
+public:
+    PatchGuard(uint8_t* instructionPointer, uint64_t length) {
+        size_t begin = stripe((uint64_t)instructionPointer);
+        size_t end = stripe((uint64_t)instructionPointer + length - 1);
+        first = &patchLocks[std::min(begin, end)];
+        if (begin != end) {
+            second = &patchLocks[std::max(begin, end)];
+        }
+        first->lock();
+        if (second) {
+            second->lock();
+        }
+    }
+
+    ~PatchGuard() {
+        if (second) {
+            second->unlock();
+        }
+        first->unlock();
+    }
+};
+
 void Encoder::printStats() const {
-    debug_print("PID %d: total instructions recompiled: %llu\n", getpid(), totalInstructionsRecompiled);
+    debug_print("PID %d: total instructions recompiled: %llu, near jump sites: %llu, trap sites: %llu, loops: %llu, cached: %llu (%llu shared), stored: %llu\n", getpid(), totalInstructionsRecompiled.load(), nearJumpSites.load(), trapSites.load(), loopSites.load(), cacheHits.load(), sharedCacheHits.load(), cacheStores.load());
+}
+
+// Jcc rel8/rel32, but not the LOOP and JRCXZ family which can't be encoded with rel32
+static bool is_loop_branch(xed_decoded_inst_t const& xedd) {
+    if (xed_decoded_inst_get_category(&xedd) != XED_CATEGORY_COND_BR) {
+        return false;
+    }
+
+    switch (xed_decoded_inst_get_iclass(&xedd)) {
+        case XED_ICLASS_JRCXZ:
+        case XED_ICLASS_JECXZ:
+        case XED_ICLASS_JCXZ:
+        case XED_ICLASS_LOOP:
+        case XED_ICLASS_LOOPE:
+        case XED_ICLASS_LOOPNE:
+            return false;
+        default:
+            return true;
+    }
 }
 
 std::variant<Encoder::DecodedInstructions, Encoder::DecoderError> Encoder::decodeInstructions(const uint8_t* instructionPointer) const {
     // decoode as many instructions as we can
-    std::vector<std::shared_ptr<Instruction>> decodedInstructions;
+    ArenaVector<std::shared_ptr<Instruction>> decodedInstructions;
+    ArenaVector<uint8_t> originalBytes;
+    ArenaVector<uint64_t> instructionOffsets;
     uint64_t decodedInstructionLength = 0;
-    int encInst = 0;
+    xed_iclass_enum_t loopBranch = XED_ICLASS_INVALID;
+    size_t loopTarget = 0;
+    uint32_t encInst = 0;
     while (1) {
         encInst++;
 
@@ -40,12 +108,42 @@ std::variant<Encoder::DecodedInstructions, Encoder::DecoderError> Encoder::decod
 
         auto currentInstrPointer = instructionPointer + decodedInstructionLength;
 
-        decode_instruction_internal(currentInstrPointer, &xedd, &olen);
+        // decode from a copy so that the bytes compared before patching are the ones we decoded
+        uint8_t bytes[15];
+        memcpy(bytes, currentInstrPointer, sizeof(bytes));
+        decode_instruction_internal(bytes, &xedd, &olen);
         decodedInstructionLength += olen;
 
         xed_iclass_enum_t iclass = xed_decoded_inst_get_iclass(&xedd);
 
-        if (!iclassMapping.contains(iclass)) {
+        std::shared_ptr<Instruction> instr;
+        if (auto factory = iclassMapping.factory(iclass)) {
+            instr = factory((uint64_t)currentInstrPointer, olen, xedd);
+        } else if (!decodedInstructions.empty() && NativeInstruction::canPassThrough(xedd)) {
+            // keep the block going over ordinary instructions instead of ending it here
+            instr = std::allocate_shared<NativeInstruction>(ArenaAllocator<NativeInstruction>(), (uint64_t)currentInstrPointer, olen, xedd);
+        } else if (!decodedInstructions.empty() && is_loop_branch(xedd)) {
+            // a conditional branch back into the block closes a loop that can run entirely inside the chunk
+            uint64_t target = decodedInstructionLength + xed_decoded_inst_get_branch_displacement(&xedd);
+            auto head = std::find(instructionOffsets.begin(), instructionOffsets.end(), target);
+            if (head != instructionOffsets.end()) {
+                loopBranch = iclass;
+                loopTarget = head - instructionOffsets.begin();
+                originalBytes.insert(originalBytes.end(), bytes, bytes + olen);
+                break;
+            }
+            debug_print("Branch target is not an instruction of the block, stopping decoding\n");
+            decodedInstructionLength -= olen;
+            break;
+        } else {
+            // a JMP into the code cache at the trapping address is a patch another thread has just installed
+            if (iclass == XED_ICLASS_JMP && decodedInstructions.size() == 0 && xed_decoded_inst_get_branch_displacement_width(&xedd) != 0) {
+                auto target = currentInstrPointer + olen + xed_decoded_inst_get_branch_displacement(&xedd);
+                if (is_code_cache_address(target)) {
+                    return DecoderError::AlreadyPatched;
+                }
+            }
+            // the NOP in front of a patch, another thread has already patched the site
             if (iclass == XED_ICLASS_NOP && decodedInstructions.size() == 0) {
                 debug_print("Why the hell are we trapping at NOP?\n");
                 // pthread_mutex_unlock(&csMutex);
@@ -63,15 +161,28 @@ std::variant<Encoder::DecodedInstructions, Encoder::DecoderError> Encoder::decod
             break;
         }
 
-        auto instrFactory = iclassMapping.at(iclass);
-        auto instr = instrFactory((uint64_t)currentInstrPointer, olen, xedd);
         decodedInstructions.push_back(instr);
+        instructionOffsets.push_back(decodedInstructionLength - olen);
+        originalBytes.insert(originalBytes.end(), bytes, bytes + olen);
 
         // break;
-        if (encInst == 15) {
+        if (encInst == maxBlockInstructions) {
+            break;
+        }
+    }
+
+    // Native instructions at the end of the block run just as well in place,
+    // keep only as many as the patch needs to fit into the block
+    const uint64_t minimumBlockLength = 5;
+    while (loopBranch == XED_ICLASS_INVALID && !decodedInstructions.empty() && std::dynamic_pointer_cast<NativeInstruction>(decodedInstructions.back())) {
+        auto length = xed_decoded_inst_get_length(decodedInstructions.back()->getDecodedInstr());
+        if (decodedInstructionLength - length < minimumBlockLength) {
             break;
         }
+        decodedInstructions.pop_back();
+        decodedInstructionLength -= length;
     }
+    originalBytes.resize(decodedInstructionLength);
 
     if (decodedInstructions.empty()) {
         printf("No supported instructions found\n");
@@ -91,114 +202,447 @@ std::variant<Encoder::DecodedInstructions, Encoder::DecoderError> Encoder::decod
         return DecoderError::UnsupportedInstruction;
     }
 
-    return DecodedInstructions { .instructions = decodedInstructions, .decodedInstructionLength = decodedInstructionLength };
+    return DecodedInstructions {
+        .instructions = std::move(decodedInstructions),
+        .decodedInstructionLength = decodedInstructionLength,
+        .originalBytes = std::move(originalBytes),
+        .loopBranch = loopBranch,
+        .loopTarget = loopTarget,
+        .branchTarget = loopTarget != 0 ? instructionOffsets[loopTarget] : 0,
+    };
 }
 
-void Encoder::emitInstructions(Encoder::DecodedInstructions const& instructions, uint8_t* instructionPointer) {
-    // compile the instructions
-    Compiler compiler;
-    for (auto & instr : instructions.instructions) {
-        compiler.addInstruction(instr);
-        totalInstructionsRecompiled++;
-    }
-
-    kern_return_t kret = vm_protect(current_task(), (vm_address_t)instructionPointer, instructions.decodedInstructionLength, FALSE, VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE | VM_PROT_ALL);
+static void make_writable(uint8_t* instructionPointer, uint64_t length) {
+#ifdef __APPLE__
+    kern_return_t kret = vm_protect(current_task(), (vm_address_t)instructionPointer, length, FALSE, VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE | VM_PROT_ALL);
     if (kret != KERN_SUCCESS) {
         debug_print("vm_protect failed: %d\n", kret);
         exit(1);
     }
+#else
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t begin = (uint64_t)instructionPointer & ~(pageSize - 1);
+    uint64_t end = ((uint64_t)instructionPointer + length + pageSize - 1) & ~(pageSize - 1);
+    if (mprotect((void*)begin, end - begin, PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+        debug_print("mprotect failed: %d\n", errno);
+        exit(1);
+    }
+#endif
+}
 
-    // if we have enough bytes to encode 
-    // We encode the following
-    // if space permits
-    // JMP REL to the trampoline (5 b)
-    // NOP slide otherwise
-    // PUSH RAX (1b)
-    // MOV RAX imm64 (10b)
-    // JMP RAX (2b) - encode a far call
-    // POP RAX (1b)
-    const uint64_t trampolineSize = 1 + 10 + 2 + 1;
-    if (instructions.decodedInstructionLength > trampolineSize) {
-    // if (false) {
-        uint32_t encodedLength = 0;
-        uint8_t* chunk = compiler.encode(CompilationStrategy::FarJump, &encodedLength, (uint64_t)instructionPointer + instructions.decodedInstructionLength - 1);
-        write_protect_memory(chunk, encodedLength);
-        debug_print("Chunk at %llx, length %d, first bytes: %02x %02x %02x...\n", (uint64_t)chunk, encodedLength, chunk[0], chunk[1], chunk[2]);
-
-        uint32_t i = 0;
-        instructionPointer[i] = 0x90; // fill one NOP to make rosetta happy
-        i++;
-        uint64_t freeSpace = instructions.decodedInstructionLength - trampolineSize - 1;
-        uint64_t nopSlideEnd = instructions.decodedInstructionLength - trampolineSize;
-        if (freeSpace < 127 && freeSpace >= 4) {
-            instructionPointer[i] = 0xeb;
-            i++;
-            instructionPointer[i] = (int8_t)freeSpace-2;
-            i++;
-        } else if (freeSpace < 2147483647 && freeSpace >= 7) {
-            instructionPointer[i] = 0xe9;
-            i++;
-            *((uint32_t*)(instructionPointer + i)) = (uint32_t)(nopSlideEnd-5);
-            i += 4;
+// Swaps in the first two bytes of a site at once. XCHG is locked, so other
+// threads never fetch one of the bytes without the other, even when they
+// straddle a cache line.
+static void exchange_head(uint8_t* instructionPointer, const uint8_t* head) {
+    uint16_t value;
+    memcpy(&value, head, sizeof(value));
+    __atomic_exchange_n((uint16_t*)instructionPointer, value, __ATOMIC_SEQ_CST);
+}
+
+// Writes the patch so other threads running the site see the original code or
+// the whole patch. A longer patch first parks them on a JMP to itself while
+// the rest of it is written, then replaces that with its first two bytes.
+static void write_patch(uint8_t* instructionPointer, const uint8_t* patch, uint32_t length) {
+    if (length > 2) {
+        static const uint8_t jumpToSelf[] = { 0xeb, 0xfe };
+        exchange_head(instructionPointer, jumpToSelf);
+        memcpy(instructionPointer + 2, patch + 2, length - 2);
+    }
+    exchange_head(instructionPointer, patch);
+}
+
+static const uint64_t nearJumpSize = 5;
+// NOP, INT3
+static const uint64_t trapPatchSize = 2;
+
+// How many bytes at the start of a block of length bytes the patch takes
+uint64_t Encoder::patchLength(CompilationStrategy strategy, uint64_t length) {
+    switch (strategy) {
+        case CompilationStrategy::NearJump: return length > nearJumpSize ? nearJumpSize + 1 : nearJumpSize;
+        case CompilationStrategy::FarJump: return trampolineSize;
+        default: return trapPatchSize;
+    }
+}
+
+// Whether patching the start of a block of length bytes with the strategy leaves
+// the return points of other blocks alone. A block starting inside another one
+// starts at least a VEX instruction before its end, so a trap patch always fits.
+bool Encoder::patchFits(CompilationStrategy strategy, uint8_t* instructionPointer, uint64_t length) const {
+    uint64_t patchLength = Encoder::patchLength(strategy, length);
+    if (patchLength <= trapPatchSize) {
+        return true;
+    }
+    if (returnPointsFull) {
+        return false;
+    }
+    for (uint64_t i = 1; i < patchLength; i++) {
+        if (returnPoints.get((uint64_t)instructionPointer + i) != 0) {
+            return false;
         }
-        // fill nops
-        for (; i < nopSlideEnd; i++) {
-            instructionPointer[i] = 0x90;
+    }
+    return true;
+}
+
+// Patches the start of the block to enter the chunk, false without patching if
+// the block no longer has originalBytes, the patch would cover where another
+// block returns to or the jump table can't take the chunk, and then the chunk
+// is freed
+bool Encoder::installChunk(CompilationStrategy strategy, uint8_t* chunk, uint32_t chunkLength, uint8_t* instructionPointer, uint64_t length, const uint8_t* originalBytes) {
+    // Compilation runs in parallel, only installing the patch is serialized
+    PatchGuard guard(instructionPointer, length);
+    if (memcmp(instructionPointer, originalBytes, length) != 0) {
+        debug_print("Block at %llx was patched by another thread\n", (uint64_t)instructionPointer);
+        free_executable(chunk, chunkLength);
+        return false;
+    }
+    if (!patchFits(strategy, instructionPointer, length)) {
+        debug_print("Block at %llx would patch over the end of another block\n", (uint64_t)instructionPointer);
+        free_executable(chunk, chunkLength);
+        return false;
+    }
+    make_writable(instructionPointer, length);
+
+    uint8_t patch[trampolineSize];
+    uint32_t i = 0;
+    if (strategy == CompilationStrategy::NearJump) {
+        if (length > nearJumpSize) {
+            patch[i] = 0x90; // fill one NOP to make rosetta happy
+            i++;
         }
-        debug_print("Written %d nops, will emit trampoline at %llx\n", i, (uint64_t)instructionPointer + i);
 
+        // JMP rel32, the chunk returns past the end of the block
+        patch[i] = 0xe9;
+        i++;
+        *((int32_t*)(patch + i)) = (int32_t)((uint64_t)chunk - (uint64_t)(instructionPointer + i + 4));
+        i += 4;
+
+        nearJumpSites++;
+    } else if (strategy == CompilationStrategy::FarJump) {
+        // NOP to make rosetta happy, then
+        // PUSH RAX (1b)
+        // MOV RAX imm64 (10b)
+        // JMP RAX (2b)
+        // the chunk pops RAX and jumps back past the end of the block
+        patch[i] = 0x90;
+        i++;
 
         // PUSH RAX
-        instructionPointer[i] = 0x50;
+        patch[i] = 0x50;
         i++;
 
         // MOV RAX imm64
-        instructionPointer[i] = 0x48;
+        patch[i] = 0x48;
         i++;
-        instructionPointer[i] = 0xb8;
+        patch[i] = 0xb8;
         i++;
-        *((uint64_t*)(instructionPointer + i)) = (uint64_t)chunk;
+        *((uint64_t*)(patch + i)) = (uint64_t)chunk;
         i += 8;
 
         // JMP RAX
-        instructionPointer[i] = 0xff;
+        patch[i] = 0xff;
         i++;
-        instructionPointer[i] = 0xe0;
+        patch[i] = 0xe0;
         i++;
+    } else {
+        // the chunk has to be registered before the INT3 becomes visible to other threads
+        if (!jumptable_add_chunk((uint64_t)instructionPointer + 1, chunk, (uint64_t)instructionPointer + length)) {
+            debug_print("Can't add %llx to the jump table\n", (uint64_t)instructionPointer);
+            free_executable(chunk, chunkLength);
+            return false;
+        }
 
-        // POP RAX
-        instructionPointer[i] = 0x58;
+        // a NOP to make rosetta happy and an INT3, sigtrap_handler calls the chunk
+        patch[i] = 0x90;
         i++;
-    } else {
-        uint32_t encodedLength = 0;
-        uint8_t* chunk = compiler.encode(CompilationStrategy::DirectCall, &encodedLength, -1);
-        debug_print("Writing chunk at 0x%llx\n", (uint64_t)chunk);
+        patch[i] = 0xcc;
+        i++;
+        trapSites++;
+    }
+    write_patch(instructionPointer, patch, i);
+
+    if (!returnPoints.set((uint64_t)instructionPointer + length, 1) && !returnPointsFull.exchange(true)) {
+        debug_print("Return point table is full, blocks are entered through INT3 from now on\n");
+    }
+    return true;
+}
 
-        // otherwise emit INT3 at the end of the block from where we taken the instructions
-        // fill nops
-        for (uint32_t i = 0; i < instructions.decodedInstructionLength - 1; i++) {
-            instructionPointer[i] = 0x90;
+// Returns false without patching if the block was changed after it was decoded
+bool Encoder::emitInstructions(Encoder::DecodedInstructions const& instructions, uint8_t* instructionPointer) {
+    // compile the instructions
+    Compiler compiler;
+    for (auto & instr : instructions.instructions) {
+        compiler.addInstruction(instr);
+    }
+    if (instructions.loopBranch != XED_ICLASS_INVALID) {
+        compiler.setLoopBranch(instructions.loopBranch, instructions.loopTarget);
+    }
+    // only the page the block ends on is known to be mapped
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    auto blockEnd = instructionPointer + instructions.decodedInstructionLength;
+    auto codeEnd = (const uint8_t*)((((uint64_t)blockEnd - 1) | (pageSize - 1)) + 1);
+    compiler.setLiveOut(Liveness::liveAt(blockEnd, codeEnd));
+
+    uint64_t length = instructions.decodedInstructionLength;
+    uint32_t encodedLength = 0;
+    uint8_t* chunk = nullptr;
+    CompilationStrategy strategy = CompilationStrategy::NearJump;
+
+    // a patch covering a branch target would send the branch into the middle of it
+    auto fits = [&](CompilationStrategy strategy) {
+        return patchFits(strategy, instructionPointer, length)
+            && (instructions.branchTarget == 0 || patchLength(strategy, length) <= instructions.branchTarget);
+    };
+
+    // If the block is at least as long as JMP rel32 and the chunk can be placed
+    // within its reach, jump there directly; the chunk jumps back by itself.
+    if (length >= nearJumpSize && fits(strategy)) {
+        chunk = compiler.encode(strategy, &encodedLength, (uint64_t)instructionPointer + length);
+        if (chunk != nullptr) {
+            debug_print("Near chunk at %llx, length %d\n", (uint64_t)chunk, encodedLength);
+        } else {
+            debug_print("No near code arena for %llx, falling back\n", (uint64_t)instructionPointer);
+        }
+    }
+
+    if (chunk == nullptr && length >= trampolineSize && fits(CompilationStrategy::FarJump)) {
+        strategy = CompilationStrategy::FarJump;
+        chunk = compiler.encode(strategy, &encodedLength, (uint64_t)instructionPointer + length);
+        if (chunk != nullptr) {
+            debug_print("Chunk at %llx, length %d, first bytes: %02x %02x %02x...\n", (uint64_t)chunk, encodedLength, chunk[0], chunk[1], chunk[2]);
+        }
+    }
+    if (chunk == nullptr) {
+        strategy = CompilationStrategy::DirectCall;
+        chunk = compiler.encode(strategy, &encodedLength, -1);
+        if (chunk == nullptr) {
+            // the site is left alone and translated again when it traps next
+            debug_print("Can't allocate a chunk for %llx\n", (uint64_t)instructionPointer);
+            return false;
         }
+        debug_print("Writing chunk at 0x%llx\n", (uint64_t)chunk);
+    }
 
-        instructionPointer[instructions.decodedInstructionLength - 1] = 0xcc;
-        jumptable_add_chunk((uint64_t)instructionPointer + (instructions.decodedInstructionLength - 1), chunk);
+    if (!installChunk(strategy, chunk, encodedLength, instructionPointer, length, instructions.originalBytes.data())) {
+        return false;
+    }
+    totalInstructionsRecompiled += instructions.instructions.size();
+    if (instructions.loopBranch != XED_ICLASS_INVALID) {
+        loopSites++;
+    }
+
+    if ((cache.isOpen() || sharedCache.isOpen()) && compiler.isRelocatable()) {
+        storeTranslation(compiler, strategy, chunk, encodedLength, instructionPointer, instructions);
     }
     printStats();
+    return true;
 }
 
-int Encoder::reencodeInstruction(void* instructionPointer) {
-    pthread_mutex_lock(&csMutex);
-    std::shared_ptr<void> _(nullptr, std::bind([&]() { pthread_mutex_unlock(&csMutex); }));
+// Stores the chunk with its addresses made relative to the module of the site
+void Encoder::storeTranslation(Compiler const& compiler, CompilationStrategy strategy, const uint8_t* chunk, uint32_t chunkLength, const uint8_t* instructionPointer, DecodedInstructions const& instructions) {
+    Module module;
+    if (!moduleForAddress((uint64_t)instructionPointer, &module)) {
+        return;
+    }
 
-    auto decodedInstructions = decodeInstructions((uint8_t*)instructionPointer);
+    ArenaVector<CacheRelocation> relocations;
+    for (auto const& relocation : compiler.getRelocations()) {
+        relocations.push_back({
+            .kind = relocation.kind == Relocation::Kind::Rel32 ? CacheRelocation::Rel32 : CacheRelocation::Abs64,
+            .offset = relocation.offset,
+            .next = relocation.next,
+            .target = (int64_t)(relocation.target - module.base),
+        });
+    }
+
+    CacheRecord record = {
+        .module = module.key,
+        .offset = (uint64_t)instructionPointer - module.base,
+        .strategy = (uint32_t)strategy,
+        .origLength = (uint32_t)instructions.decodedInstructionLength,
+        .originalBytes = instructions.originalBytes.data(),
+        .chunkLength = chunkLength,
+        .chunk = chunk,
+        .relocationCount = (uint32_t)relocations.size(),
+        .relocations = relocations.data(),
+    };
+    cache.store(record);
+    sharedCache.store(record);
+    cacheStores++;
+}
+
+// Places and installs the chunk a previous run stored for the site, false if
+// there is none or it doesn't fit the site as it is now
+bool Encoder::findCached(uint64_t module, uint64_t offset, CacheRecord* record) {
+    if (cache.get(module, offset, record)) {
+        return true;
+    }
+    if (sharedCache.get(module, offset, record)) {
+        sharedCacheHits++;
+        return true;
+    }
+    return false;
+}
+
+bool Encoder::installCached(uint8_t* instructionPointer) {
+    Module module;
+    CacheRecord record;
+    if (!moduleForAddress((uint64_t)instructionPointer, &module) || !findCached(module.key, (uint64_t)instructionPointer - module.base, &record)) {
+        return false;
+    }
+    if (memcmp(instructionPointer, record.originalBytes, record.origLength) != 0) {
+        debug_print("Cached translation of %llx doesn't match the code there\n", (uint64_t)instructionPointer);
+        return false;
+    }
+
+    auto strategy = (CompilationStrategy)record.strategy;
+    uint8_t* chunk = strategy == CompilationStrategy::NearJump
+        ? alloc_executable_near((uint64_t)instructionPointer + record.origLength, record.chunkLength)
+        : alloc_executable(record.chunkLength);
+    if (chunk == nullptr) {
+        return false;
+    }
+
+    uint8_t* code = code_cache_writable(chunk);
+    memcpy(code, record.chunk, record.chunkLength);
+    bool reaches = true;
+    for (uint32_t i = 0; i < record.relocationCount; i++) {
+        auto const& stored = record.relocations[i];
+        Relocation relocation = {
+            .kind = stored.kind == CacheRelocation::Rel32 ? Relocation::Kind::Rel32 : Relocation::Kind::Abs64,
+            .offset = stored.offset,
+            .next = stored.next,
+            .target = module.base + stored.target,
+        };
+        reaches = relocation.apply(code, chunk) && reaches;
+    }
+    write_protect_memory(chunk, record.chunkLength);
+    if (!reaches) {
+        debug_print("Cached translation of %llx is out of reach of its chunk\n", (uint64_t)instructionPointer);
+        free_executable(chunk, record.chunkLength);
+        return false;
+    }
+
+    if (!installChunk(strategy, chunk, record.chunkLength, instructionPointer, record.origLength, record.originalBytes)) {
+        return false;
+    }
+    cacheHits++;
+    printStats();
+    return true;
+}
+
+Encoder::TranslationResult Encoder::translate(uint8_t* instructionPointer) {
+    // everything decoded and compiled below is released together on return
+    ArenaScope arena;
+    if ((cache.size() != 0 || sharedCache.size() != 0) && installCached(instructionPointer)) {
+        return TranslationResult::Installed;
+    }
+    auto decodedInstructions = decodeInstructions(instructionPointer);
     if (std::holds_alternative<Encoder::DecoderError>(decodedInstructions)) {
         switch (std::get<Encoder::DecoderError>(decodedInstructions)) {
-            case Encoder::DecoderError::NopTrap: return 1;
-            case Encoder::DecoderError::UnsupportedInstruction: return -1;
+            case Encoder::DecoderError::NopTrap: return TranslationResult::NopTrap;
+            case Encoder::DecoderError::AlreadyPatched: return TranslationResult::PatchedElsewhere;
+            case Encoder::DecoderError::UnsupportedInstruction: return TranslationResult::Unsupported;
+        }
+    }
+
+    auto const& instructions = std::get<Encoder::DecodedInstructions>(decodedInstructions);
+    if (!emitInstructions(instructions, instructionPointer)) {
+        // lost the race to an overlapping block or out of memory, either way
+        // the site is run again and traps once more if it's still unpatched
+        return TranslationResult::PatchedElsewhere;
+    }
+    return TranslationResult::Installed;
+}
+
+// How far the trapping thread moves RIP: the leading NOP of a patch is
+// stepped over as before, anything else another thread patched runs again
+// from the start so the thread goes through the patch
+int Encoder::resumeOffset(TranslationResult result) {
+    switch (result) {
+        case TranslationResult::NopTrap: return 1;
+        case TranslationResult::Unsupported: return -1;
+        default: return 0;
+    }
+}
+
+int Encoder::reencodeInstruction(void* instructionPointer) {
+    auto state = siteStates.insert((uint64_t)instructionPointer);
+    if (state == nullptr) {
+        // without a state threads trapping on the site together translate it
+        // each, installing the patch still lets only one of them through
+        static std::atomic<bool> reported = false;
+        if (!reported.exchange(true)) {
+            debug_print("Site state table is full, translating without claiming sites\n");
+        }
+        return resumeOffset(translate((uint8_t*)instructionPointer));
+    }
+
+    bool waited = false;
+    uint64_t current = state->load(std::memory_order_acquire);
+    while (true) {
+        if (current == SiteState::Translating) {
+            waited = true;
+            sched_yield();
+            current = state->load(std::memory_order_acquire);
+            continue;
+        }
+
+        if (waited) {
+            // another thread translated this site while we were waiting
+            switch (current) {
+                case SiteState::Failed: return -1;
+                default: return 0;
+            }
+        }
+
+        // a finished site trapping again is translated anew, the decoder notices if it is already patched
+        if (state->compare_exchange_weak(current, SiteState::Translating, std::memory_order_acq_rel)) {
+            break;
         }
     }
 
-    auto instructions = std::get<Encoder::DecodedInstructions>(decodedInstructions);
-    emitInstructions(instructions, (uint8_t*)instructionPointer);
-    return 0;
-}
\ No newline at end of file
+    auto result = translate((uint8_t*)instructionPointer);
+    switch (result) {
+        case TranslationResult::Installed: state->store(SiteState::Installed, std::memory_order_release); break;
+        case TranslationResult::Unsupported: state->store(SiteState::Failed, std::memory_order_release); break;
+        default: state->store(SiteState::Retry, std::memory_order_release); break;
+    }
+    return resumeOffset(result);
+}
+
+std::vector<uint8_t*> Encoder::cachedSites(uint8_t* begin, uint8_t* end) const {
+    std::vector<uint8_t*> sites;
+    Module module;
+    if ((cache.size() == 0 && sharedCache.size() == 0) || !moduleForAddress((uint64_t)begin, &module)) {
+        return sites;
+    }
+    auto offsets = cache.getReplacementPoints(module.key);
+    auto shared = sharedCache.getReplacementPoints(module.key);
+    offsets.insert(offsets.end(), shared.begin(), shared.end());
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    for (auto offset : offsets) {
+        auto site = (uint8_t*)(module.base + offset);
+        if (site >= begin && site < end) {
+            sites.push_back(site);
+        }
+    }
+    return sites;
+}
+
+bool Encoder::installCachedSite(uint8_t* instructionPointer) {
+    auto state = siteStates.insert((uint64_t)instructionPointer);
+    if (state == nullptr) {
+        return false;
+    }
+    uint64_t current = SiteState::Unclaimed;
+    if (!state->compare_exchange_strong(current, SiteState::Translating, std::memory_order_acq_rel)) {
+        // trapped already, the trap takes care of it
+        return false;
+    }
+
+    ArenaScope arena;
+    bool installed = installCached(instructionPointer);
+    state->store(installed ? SiteState::Installed : SiteState::Unclaimed, std::memory_order_release);
+    return installed;
+}
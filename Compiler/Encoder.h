@@ -1,31 +1,105 @@
 #pragma once
 
 #include "../Cache/Cache.h"
+#include "../Cache/SharedCache.h"
 #include "../Instructions/Instruction.h"
+#include "../addresstable.h"
+#include "Arena.h"
+#include "Compiler.h"
+#include <atomic>
+#include <variant>
 
 class Encoder {
     Cache cache;
+    // translations of the other processes running now
+    SharedCache sharedCache;
 
-    uint64_t totalInstructionsRecompiled = 0;
-    pthread_mutex_t csMutex =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
+    // longest block, in instructions, translated from a single trap
+    const uint32_t maxBlockInstructions;
+
+    std::atomic<uint64_t> totalInstructionsRecompiled = 0;
+    std::atomic<uint64_t> nearJumpSites = 0;
+    std::atomic<uint64_t> trapSites = 0;
+    std::atomic<uint64_t> loopSites = 0;
+    // sites installed from the cache, and translations stored to it
+    std::atomic<uint64_t> cacheHits = 0;
+    std::atomic<uint64_t> sharedCacheHits = 0;
+    std::atomic<uint64_t> cacheStores = 0;
+
+    // NOP, PUSH RAX, MOV RAX imm64, JMP RAX at the start of a FarJump site
+    static const uint64_t trampolineSize = 1 + 1 + 10 + 2;
+
+    // Translation of a trapping site is claimed by the first thread that gets
+    // there, other threads trapping on the same site wait for its result.
+    enum SiteState : uint64_t {
+        Unclaimed = 0,
+        Translating,
+        Installed,
+        Retry,
+        Failed,
+    };
+    AddressTable<1 << 16> siteStates;
+
+    // Only the start of a block is patched, the rest keeps its original code
+    // for branches into the middle of the block. The ends of installed blocks,
+    // where their chunks return to, must not be patched over by a block that
+    // starts inside another one.
+    AddressTable<1 << 16> returnPoints;
+    std::atomic<bool> returnPointsFull = false;
+    static uint64_t patchLength(CompilationStrategy strategy, uint64_t length);
+    bool patchFits(CompilationStrategy strategy, uint8_t* instructionPointer, uint64_t length) const;
 
     enum class DecoderError {
         NopTrap,
+        // the site holds a jump into the code cache, another thread installed a chunk there
+        AlreadyPatched,
         UnsupportedInstruction,
     };
 
+    enum class TranslationResult {
+        Installed,
+        // another thread patched the site or a block overlapping it first
+        PatchedElsewhere,
+        NopTrap,
+        Unsupported,
+    };
+
     struct DecodedInstructions {
-        const std::vector<std::shared_ptr<Instruction>> instructions;
+        const ArenaVector<std::shared_ptr<Instruction>> instructions;
         const uint64_t decodedInstructionLength;
+        // the bytes the instructions were decoded from, checked again before patching
+        const ArenaVector<uint8_t> originalBytes;
+        // conditional branch that closes the block into a loop, and the instruction it jumps back to
+        const xed_iclass_enum_t loopBranch = XED_ICLASS_INVALID;
+        const size_t loopTarget = 0;
+        // offset of the first instruction after the start that a branch is known
+        // to jump to, the patch has to end before it, 0 if there is none. Only
+        // the loop head is known, branches from outside the block to the other
+        // instructions the patch covers land inside the patch.
+        const uint64_t branchTarget = 0;
     };
 
     std::variant<DecodedInstructions, DecoderError> decodeInstructions(const uint8_t* instructionPointer) const;
-    void emitInstructions(DecodedInstructions const& instructions, uint8_t* instructionPointer);
+    bool emitInstructions(DecodedInstructions const& instructions, uint8_t* instructionPointer);
+    bool installChunk(CompilationStrategy strategy, uint8_t* chunk, uint32_t chunkLength, uint8_t* instructionPointer, uint64_t length, const uint8_t* originalBytes);
+    void storeTranslation(Compiler const& compiler, CompilationStrategy strategy, const uint8_t* chunk, uint32_t chunkLength, const uint8_t* instructionPointer, DecodedInstructions const& instructions);
+    bool findCached(uint64_t module, uint64_t offset, CacheRecord* record);
+    bool installCached(uint8_t* instructionPointer);
+    TranslationResult translate(uint8_t* instructionPointer);
+    static int resumeOffset(TranslationResult result);
     void printStats() const;
 public:
-    Encoder(Cache && cache) 
-    : cache(cache)
+    Encoder(Cache && cache, uint32_t maxBlockInstructions = 64, SharedCache && sharedCache = SharedCache())
+    : cache(std::move(cache))
+    , sharedCache(std::move(sharedCache))
+    , maxBlockInstructions(maxBlockInstructions)
     {}
 
     int reencodeInstruction(void* instructionPointer);
+
+    // Sites in [begin, end) the cache has translations for
+    std::vector<uint8_t*> cachedSites(uint8_t* begin, uint8_t* end) const;
+    // Installs the cached translation of a site that hasn't trapped yet, without
+    // ever decoding it, false if the site doesn't have the bytes it was stored with
+    bool installCachedSite(uint8_t* instructionPointer);
 };
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "Liveness.h"
+#include <algorithm>
+#include <cstring>
+
+static const uint32_t registerCount = 16;
+
+static int gprIndex(xed_reg_enum_t reg) {
+    if (xed_reg_class(reg) != XED_REG_CLASS_GPR) {
+        return -1;
+    }
+    auto largest = xed_get_largest_enclosing_register(reg);
+    if (largest < XED_REG_RAX || largest > XED_REG_R15) {
+        return -1;
+    }
+    return largest - XED_REG_RAX;
+}
+
+static int xmmIndex(xed_reg_enum_t reg) {
+    if (reg >= XED_REG_XMM0 && reg < XED_REG_XMM0 + registerCount) {
+        return reg - XED_REG_XMM0;
+    }
+    if (reg >= XED_REG_YMM0 && reg < XED_REG_YMM0 + registerCount) {
+        return reg - XED_REG_YMM0;
+    }
+    return -1;
+}
+
+LiveState LiveState::all() {
+    return LiveState {
+        .flags = Liveness::arithmeticFlags(),
+        .gprs = (1u << registerCount) - 1,
+        .xmms = (1u << registerCount) - 1,
+    };
+}
+
+void LiveState::insert(xed_reg_enum_t reg) {
+    if (int i = gprIndex(reg); i >= 0) {
+        gprs |= 1u << i;
+    }
+    if (int i = xmmIndex(reg); i >= 0) {
+        xmms |= 1u << i;
+    }
+}
+
+bool LiveState::contains(xed_reg_enum_t reg) const {
+    if (int i = gprIndex(reg); i >= 0) {
+        return gprs & (1u << i);
+    }
+    if (int i = xmmIndex(reg); i >= 0) {
+        return xmms & (1u << i);
+    }
+    return true;
+}
+
+LiveState LiveState::operator|(LiveState const& other) const {
+    return LiveState { .flags = flags | other.flags, .gprs = gprs | other.gprs, .xmms = xmms | other.xmms };
+}
+
+LiveState LiveState::operator&(LiveState const& other) const {
+    return LiveState { .flags = flags & other.flags, .gprs = gprs & other.gprs, .xmms = xmms & other.xmms };
+}
+
+LiveState LiveState::operator~() const {
+    return LiveState { .flags = ~flags, .gprs = ~gprs, .xmms = ~xmms } & all();
+}
+
+LiveState Liveness::Use::liveBefore(LiveState const& liveAfter) const {
+    return (liveAfter & ~overwritten) | read;
+}
+
+uint32_t Liveness::arithmeticFlags() {
+    xed_flag_set_t flags;
+    flags.flat = 0;
+    flags.s.of = 1;
+    flags.s.sf = 1;
+    flags.s.zf = 1;
+    flags.s.af = 1;
+    flags.s.pf = 1;
+    flags.s.cf = 1;
+    return flags.flat;
+}
+
+Liveness::Use Liveness::use(xed_decoded_inst_t const* xedd) {
+    Use use;
+
+    auto rflags = xed_decoded_inst_get_rflags_info(xedd);
+    if (rflags != nullptr) {
+        if (xed_simple_flag_reads_flags(rflags)) {
+            use.read.flags = xed_simple_flag_get_read_flag_set(rflags)->flat & arithmeticFlags();
+        }
+        if (xed_simple_flag_writes_flags(rflags)) {
+            use.written.flags = xed_simple_flag_get_written_flag_set(rflags)->flat & arithmeticFlags();
+            // may-write flags are left alone on some paths
+            if (xed_simple_flag_get_must_write(rflags)) {
+                use.overwritten.flags = use.written.flags;
+            }
+        }
+    }
+
+    auto xi = xed_decoded_inst_inst(xedd);
+    for (uint32_t i = 0; i < xed_inst_noperands(xi); i++) {
+        auto op = xed_inst_operand(xi, i);
+        auto name = xed_operand_name(op);
+
+        if (name == XED_OPERAND_MEM0 || name == XED_OPERAND_MEM1 || name == XED_OPERAND_AGEN) {
+            uint32_t mem = name == XED_OPERAND_MEM1 ? 1 : 0;
+            use.read.insert(xed_decoded_inst_get_base_reg(xedd, mem));
+            use.read.insert(xed_decoded_inst_get_index_reg(xedd, mem));
+            continue;
+        }
+        if (!xed_operand_is_register(name)) {
+            continue;
+        }
+
+        auto reg = xed_decoded_inst_get_reg(xedd, name);
+        if (xed_operand_read(op)) {
+            use.read.insert(reg);
+        }
+        if (xed_operand_written(op)) {
+            use.written.insert(reg);
+            // 8 and 16 bit writes keep the rest of the register, and so do scalar XMM writes
+            uint32_t bits = xed_decoded_inst_operand_length_bits(xedd, i);
+            bool whole = gprIndex(reg) >= 0 ? bits >= 32 : bits >= 128;
+            if (xed_operand_written_only(op) && whole) {
+                use.overwritten.insert(reg);
+            }
+        }
+    }
+
+    return use;
+}
+
+// Branches, calls, returns, traps and state saves lead where the scan can't follow
+static bool fallsThrough(xed_decoded_inst_t const* xedd) {
+    switch (xed_decoded_inst_get_category(xedd)) {
+        case XED_CATEGORY_COND_BR:
+        case XED_CATEGORY_UNCOND_BR:
+        case XED_CATEGORY_CALL:
+        case XED_CATEGORY_RET:
+        case XED_CATEGORY_SYSCALL:
+        case XED_CATEGORY_SYSRET:
+        case XED_CATEGORY_INTERRUPT:
+        case XED_CATEGORY_SYSTEM:
+        case XED_CATEGORY_XSAVE:
+        case XED_CATEGORY_XSAVEOPT:
+            return false;
+        default:
+            return true;
+    }
+}
+
+LiveState Liveness::liveAt(const uint8_t* address, const uint8_t* end) {
+    LiveState undecided = LiveState::all();
+    LiveState live;
+    for (uint32_t i = 0; i < maxScanInstructions && !(undecided == LiveState()) && address < end; i++) {
+        // decode from a copy, the code may be patched by another thread meanwhile
+        uint8_t bytes[15];
+        uint32_t length = std::min<uint64_t>(sizeof(bytes), end - address);
+        memcpy(bytes, address, length);
+
+        xed_decoded_inst_t xedd;
+        xed_decoded_inst_zero(&xedd);
+        xed_decoded_inst_set_mode(&xedd, XED_MACHINE_MODE_LONG_64, XED_ADDRESS_WIDTH_64b);
+        if (xed_decode(&xedd, bytes, length) != XED_ERROR_NONE) {
+            break;
+        }
+
+        auto use = Liveness::use(&xedd);
+        LiveState read = use.read & undecided;
+        live = live | read;
+        undecided = undecided & ~(read | use.overwritten);
+
+        if (!fallsThrough(&xedd)) {
+            break;
+        }
+        address += xed_decoded_inst_get_length(&xedd);
+    }
+    return live | undecided;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+extern "C" {
+#include <xed/xed-interface.h>
+}
+
+#include <cstdint>
+
+// The state an emulated sequence may clobber: flags as a mask of xed_flag_set_t bits,
+// bit n of gprs for RAX+n and bit n of xmms for XMMn. The upper half of YMMn lives
+// in the YMM storage, so only the lower half counts for xmms.
+struct LiveState {
+    uint32_t flags = 0;
+    uint32_t gprs = 0;
+    uint32_t xmms = 0;
+
+    static LiveState all();
+
+    void insert(xed_reg_enum_t reg);
+    bool contains(xed_reg_enum_t reg) const;
+
+    LiveState operator|(LiveState const& other) const;
+    LiveState operator&(LiveState const& other) const;
+    LiveState operator~() const;
+    bool operator==(LiveState const& other) const = default;
+};
+
+// Which of that state is still needed after an instruction
+class Liveness {
+    // how far past a block the original code is followed
+    static const uint32_t maxScanInstructions = 32;
+
+public:
+    struct Use {
+        LiveState read;
+        // written in part or in whole
+        LiveState written;
+        // written in whole on every path through the instruction
+        LiveState overwritten;
+
+        LiveState liveBefore(LiveState const& liveAfter) const;
+    };
+
+    // OF, SF, ZF, AF, PF and CF, the flags the lowerings clobber
+    static uint32_t arithmeticFlags();
+    static Use use(xed_decoded_inst_t const* xedd);
+
+    // What the original code at address may read before overwriting it.
+    // Scanning stops at any control flow, everything not yet overwritten is live there.
+    // Nothing at or past end is read, it may not be mapped.
+    static LiveState liveAt(const uint8_t* address, const uint8_t* end);
+};
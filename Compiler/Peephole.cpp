@@ -0,0 +1,232 @@
+#include "Peephole.h"
+
+static const xed_state_t dstate = {.mmode = XED_MACHINE_MODE_LONG_64,
+                                   .stack_addr_width = XED_ADDRESS_WIDTH_64b};
+
+// Just enough of an operand to tell whether two requests name the same place
+struct Location {
+    enum class Kind { None, Reg, Mem, Imm };
+
+    Kind kind = Kind::None;
+    xed_reg_enum_t reg = XED_REG_INVALID;
+    xed_reg_enum_t seg = XED_REG_INVALID;
+    xed_reg_enum_t base = XED_REG_INVALID;
+    xed_reg_enum_t index = XED_REG_INVALID;
+    uint32_t scale = 0;
+    int64_t disp = 0;
+    uint64_t imm = 0;
+
+    bool operator==(Location const& other) const = default;
+
+    bool reads(xed_reg_enum_t r) const {
+        if (kind == Kind::Reg) {
+            return reg == r;
+        }
+        if (kind == Kind::Mem) {
+            return (base != XED_REG_INVALID && xed_get_largest_enclosing_register(base) == r)
+                || (index != XED_REG_INVALID && xed_get_largest_enclosing_register(index) == r);
+        }
+        return false;
+    }
+};
+
+static Location location(xed_encoder_request_t& req, uint32_t i) {
+    Location loc;
+    if (i >= xed_encoder_request_operand_order_entries(&req)) {
+        return loc;
+    }
+
+    switch (xed_encoder_request_get_operand_order(&req, i)) {
+        case XED_OPERAND_REG0:
+            loc.kind = Location::Kind::Reg;
+            loc.reg = xed3_operand_get_reg0(&req);
+            break;
+        case XED_OPERAND_REG1:
+            loc.kind = Location::Kind::Reg;
+            loc.reg = xed3_operand_get_reg1(&req);
+            break;
+        case XED_OPERAND_MEM0:
+            loc.kind = Location::Kind::Mem;
+            loc.seg = xed3_operand_get_seg0(&req);
+            loc.base = xed3_operand_get_base0(&req);
+            loc.index = xed3_operand_get_index(&req);
+            loc.scale = xed3_operand_get_scale(&req);
+            loc.disp = xed3_operand_get_disp(&req);
+            break;
+        case XED_OPERAND_IMM0:
+            loc.kind = Location::Kind::Imm;
+            loc.imm = xed3_operand_get_uimm0(&req);
+            break;
+        default:
+            break;
+    }
+    return loc;
+}
+
+// A whole-register copy that touches nothing else, flags included. Returns its width, 0 if not a copy.
+static uint32_t moveWidth(xed_encoder_request_t& req, Location& dst, Location& src) {
+    if (xed_encoder_request_operand_order_entries(&req) != 2) {
+        return 0;
+    }
+    dst = location(req, 0);
+    src = location(req, 1);
+
+    switch (xed_encoder_request_get_iclass(&req)) {
+        case XED_ICLASS_MOVUPS:
+        case XED_ICLASS_MOVUPD:
+        case XED_ICLASS_MOVAPS:
+        case XED_ICLASS_MOVAPD:
+        case XED_ICLASS_MOVDQU:
+        case XED_ICLASS_MOVDQA:
+            for (auto const& loc : { dst, src }) {
+                if (loc.kind == Location::Kind::Imm || (loc.kind == Location::Kind::Reg && xed_reg_class(loc.reg) != XED_REG_CLASS_XMM)) {
+                    return 0;
+                }
+            }
+            return 128;
+        case XED_ICLASS_MOV:
+            // narrower moves keep part of the old value, wider ones are not spilled by the lowering
+            if (dst.kind != Location::Kind::Reg && src.kind != Location::Kind::Reg) {
+                return 0;
+            }
+            for (auto const& loc : { dst, src }) {
+                if (loc.kind == Location::Kind::Reg && xed_gpr_reg_class(loc.reg) != XED_REG_CLASS_GPR64) {
+                    return 0;
+                }
+            }
+            return dst.kind == Location::Kind::Imm ? 0 : 64;
+        default:
+            return 0;
+    }
+}
+
+static bool isPushOrPop(xed_encoder_request_t& req, xed_iclass_enum_t iclass, xed_reg_enum_t& reg) {
+    if (xed_encoder_request_get_iclass(&req) != iclass) {
+        return false;
+    }
+    auto loc = location(req, 0);
+    reg = loc.reg;
+    return loc.kind == Location::Kind::Reg;
+}
+
+static bool isFlagsPush(xed_encoder_request_t& req) {
+    auto iclass = xed_encoder_request_get_iclass(&req);
+    return iclass == XED_ICLASS_PUSHF || iclass == XED_ICLASS_PUSHFQ;
+}
+
+static bool isFlagsPop(xed_encoder_request_t& req) {
+    auto iclass = xed_encoder_request_get_iclass(&req);
+    return iclass == XED_ICLASS_POPF || iclass == XED_ICLASS_POPFQ;
+}
+
+// ADD/SUB RSP, imm as a signed change of RSP
+static bool rspAdjustment(xed_encoder_request_t& req, int64_t& delta) {
+    auto iclass = xed_encoder_request_get_iclass(&req);
+    if ((iclass != XED_ICLASS_ADD && iclass != XED_ICLASS_SUB) || xed_encoder_request_operand_order_entries(&req) != 2) {
+        return false;
+    }
+    auto dst = location(req, 0);
+    auto src = location(req, 1);
+    if (dst.kind != Location::Kind::Reg || dst.reg != XED_REG_RSP || src.kind != Location::Kind::Imm) {
+        return false;
+    }
+
+    uint32_t bits = xed3_operand_get_imm_width(&req);
+    int64_t imm = bits < 64 ? (int64_t)(src.imm << (64 - bits)) >> (64 - bits) : (int64_t)src.imm;
+    delta = iclass == XED_ICLASS_ADD ? imm : -imm;
+    return true;
+}
+
+static xed_encoder_request_t request(xed_iclass_enum_t iclass, xed_encoder_operand_t op0, xed_encoder_operand_t op1) {
+    xed_encoder_request_t req;
+    xed_encoder_instruction_t enc_inst;
+    xed_inst2(&enc_inst, dstate, iclass, 64, op0, op1);
+    xed_convert_to_encoder_request(&req, &enc_inst);
+    return req;
+}
+
+static xed_encoder_request_t adjustRsp(int64_t delta) {
+    auto iclass = delta > 0 ? XED_ICLASS_ADD : XED_ICLASS_SUB;
+    int64_t imm = delta > 0 ? delta : -delta;
+    return request(iclass, xed_reg(XED_REG_RSP), xed_imm0(imm, imm <= INT8_MAX ? 8 : 32));
+}
+
+bool Peephole::combineLast(ArenaVector<xed_encoder_request_t>& requests) {
+    auto dropLast = [&](size_t count) {
+        requests.resize(requests.size() - count);
+        removedRequests += count;
+        return true;
+    };
+    auto replaceLastTwo = [&](xed_encoder_request_t const& req) {
+        requests.pop_back();
+        requests.back() = req;
+        removedRequests++;
+        return true;
+    };
+
+    auto& last = requests.back();
+    Location dst, src;
+    uint32_t width = moveWidth(last, dst, src);
+    if (width != 0 && dst == src) {
+        return dropLast(1);
+    }
+
+    if (requests.size() < 2) {
+        return false;
+    }
+    auto& prev = requests[requests.size() - 2];
+
+    xed_reg_enum_t pushed, popped;
+    if (isPushOrPop(prev, XED_ICLASS_PUSH, pushed) && isPushOrPop(last, XED_ICLASS_POP, popped)) {
+        if (pushed == popped) {
+            return dropLast(2);
+        }
+        return replaceLastTwo(request(XED_ICLASS_MOV, xed_reg(popped), xed_reg(pushed)));
+    }
+
+    // the register is reloaded from the slot it was just popped from
+    if (isPushOrPop(prev, XED_ICLASS_POP, popped) && isPushOrPop(last, XED_ICLASS_PUSH, pushed) && pushed == popped) {
+        return replaceLastTwo(request(XED_ICLASS_MOV, xed_reg(popped), xed_mem_b(XED_REG_RSP, 64)));
+    }
+
+    if (isFlagsPush(prev) && isFlagsPop(last)) {
+        return dropLast(2);
+    }
+
+    int64_t prevDelta, lastDelta;
+    if (rspAdjustment(prev, prevDelta) && rspAdjustment(last, lastDelta)) {
+        if (prevDelta + lastDelta == 0) {
+            return dropLast(2);
+        }
+        return replaceLastTwo(adjustRsp(prevDelta + lastDelta));
+    }
+
+    Location prevDst, prevSrc;
+    if (width != 0 && moveWidth(prev, prevDst, prevSrc) == width) {
+        // copying back what was just copied, unless the first copy moved the address
+        if (dst == prevSrc && src == prevDst && !(prevDst.kind == Location::Kind::Reg && prevSrc.reads(prevDst.reg))) {
+            return dropLast(1);
+        }
+        // the first copy is overwritten before anything reads it
+        if (dst == prevDst && !(dst.kind == Location::Kind::Reg && src.reads(dst.reg))) {
+            requests.erase(requests.end() - 2);
+            removedRequests++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t Peephole::optimize(ArenaVector<xed_encoder_request_t>& requests, size_t begin, size_t end) {
+    ArenaVector<xed_encoder_request_t> optimized;
+    optimized.reserve(end - begin);
+    for (size_t i = begin; i < end; i++) {
+        optimized.push_back(requests[i]);
+        while (!optimized.empty() && combineLast(optimized)) {}
+    }
+
+    requests.erase(requests.begin() + begin, requests.begin() + end);
+    requests.insert(requests.begin() + begin, optimized.begin(), optimized.end());
+    return begin + optimized.size();
+}
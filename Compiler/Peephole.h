@@ -0,0 +1,28 @@
+#pragma once
+
+extern "C" {
+#include <xed/xed-interface.h>
+#include <xed/xed-encode.h>
+}
+
+#include <cstdint>
+#include <vector>
+#include "Arena.h"
+
+// Removes the redundancy left where the lowering sequences of neighbouring
+// instructions meet: pushes popped right away, spills reloaded from where they
+// were just stored, moves overwritten before use and stack adjustments that cancel.
+// Every request that stays sees the same RSP as before, so displacements
+// computed from rspOffset during lowering remain valid.
+class Peephole {
+    uint64_t removedRequests = 0;
+
+    bool combineLast(ArenaVector<xed_encoder_request_t>& requests);
+
+public:
+    // Optimizes requests[begin, end) in place, nothing moves across begin or end.
+    // Returns the new end.
+    size_t optimize(ArenaVector<xed_encoder_request_t>& requests, size_t begin, size_t end);
+
+    uint64_t removed() const { return removedRequests; }
+};
@@ -3,7 +3,7 @@
 
 class AND : public CompilableInstruction<AND> {
 public:
-    AND(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    AND(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_AND,
@@ -2,7 +2,7 @@
 
 class BLSR : public CompilableInstruction<BLSR> {
 public:
-    BLSR(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {
+    BLSR(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {
     }
 
     static const inline InstructionMetadata Metadata = {
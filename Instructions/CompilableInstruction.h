@@ -7,11 +7,12 @@
 template<class T>
 class CompilableInstruction : public Instruction {
 protected:
-    CompilableInstruction(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : Instruction(rip, ilen, xedd) {}
+    CompilableInstruction(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : Instruction(rip, ilen, xedd) {}
 
     virtual ~CompilableInstruction() = default;
 
-    void map3opto2op(bool upper, std::function<void(xed_encoder_operand_t const&, xed_encoder_operand_t const&)> instr) {
+    template<typename F>
+    void map3opto2op(bool upper, F instr) {
         if (operands[0].reg() == operands[1].reg()) {
             instr(operands[0].toEncoderOperand(upper), operands[2].toEncoderOperand(upper));
         } else if (operands[0].reg() == operands[2].reg()) {
@@ -29,12 +30,56 @@ protected:
         return (xed_reg_enum_t)(reg - XED_REG_RAX + XED_REG_EAX);
     }
 
-    std::vector<xed_encoder_request_t> const& compile(CompilationStrategy compilationStrategy, uint64_t returnAddr = 0) {
-        internal_requests.clear();
-
+    void resetRspOffset(CompilationStrategy compilationStrategy) {
         if (compilationStrategy == CompilationStrategy::DirectCall || compilationStrategy == CompilationStrategy::DirectCallPopRax) {
             rspOffset = -8;
+        } else {
+            rspOffset = 0;
         }
+    }
+
+public:
+    // Set by instructions that move data between lanes or combine them
+    static const bool crossesLanes = false;
+
+    bool isLaneLocal() const {
+        if (T::crossesLanes || !usesYmm()) {
+            return false;
+        }
+
+        // XMM and GPR operands are not swapped, the upper lane would see them while YMMs are
+        for (uint32_t i = 0; i < xed_inst_noperands(xi); i++) {
+            auto op = xed_inst_operand(xi, i);
+            if (xed_operand_operand_visibility(op) == XED_OPVIS_SUPPRESSED) {
+                continue;
+            }
+            auto name = xed_operand_name(op);
+            if (xed_operand_is_register(name) && xed_reg_class(xed_decoded_inst_get_reg(&xedd, name)) != XED_REG_CLASS_YMM) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Requests const& compileLane(CompilationStrategy compilationStrategy, bool upper,
+        RegSet const& swapIn, RegSet const& swapOut) {
+        internal_requests.clear();
+        resetRspOffset(compilationStrategy);
+
+        if (!swapIn.empty()) {
+            swap_in_upper_ymm(swapIn);
+        }
+        implementation(upper, compilationStrategy == CompilationStrategy::Inline);
+        if (!swapOut.empty()) {
+            swap_out_upper_ymm(swapOut);
+        }
+
+        return internal_requests;
+    }
+
+    Requests const& compile(CompilationStrategy compilationStrategy, uint64_t returnAddr = 0) {
+        internal_requests.clear();
+        resetRspOffset(compilationStrategy);
 
         implementation(false, compilationStrategy == CompilationStrategy::Inline);
 
@@ -47,5 +92,6 @@ protected:
         return internal_requests;
     }
 
+protected:
     virtual void implementation(bool upper, bool compile_inline) = 0;
 };
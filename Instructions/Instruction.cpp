@@ -14,7 +14,7 @@
 const xed_state_t dstate = {.mmode = XED_MACHINE_MODE_LONG_64,
                             .stack_addr_width = XED_ADDRESS_WIDTH_64b};
 
-Instruction::Instruction(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd)
+Instruction::Instruction(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd)
 :opWidth(xed_decoded_inst_get_operand_width(&xedd))
 ,vl(xed3_operand_get_vl(&xedd))
 ,rip(rip)
@@ -23,6 +23,7 @@ Instruction::Instruction(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd)
 ,xedd(xedd)
 {
     auto n_operands = xed_inst_noperands(xi);
+    operands.reserve(n_operands);
     for (uint32_t i = 0; i < n_operands; i++) {
         operands.emplace_back(Operand(&this->xedd, i));
     }
@@ -119,6 +120,18 @@ void Instruction::pushf() {
     rspOffset -= pointerWidthBytes;
 }
 
+void Instruction::saveFlags() {
+    if (liveAfter.flags != 0) {
+        pushf();
+    }
+}
+
+void Instruction::restoreFlags() {
+    if (liveAfter.flags != 0) {
+        popf();
+    }
+}
+
 void Instruction::shl(xed_encoder_operand_t op0, xed_encoder_operand_t op1) {
     op2(XED_ICLASS_SHL, op0, op1);
 }
@@ -148,7 +161,7 @@ void Instruction::not_i(xed_encoder_operand_t op0) {
 }
 
 void Instruction::mov(xed_encoder_operand_t op0, xed_encoder_operand_t op1) {
-    withRipSubstitution([=] (std::function<xed_encoder_operand_t(xed_encoder_operand_t)> subst) {
+    withRipSubstitution([=, this](auto subst) {
         xed_encoder_request_t req;
         xed_encoder_instruction_t enc_inst;
 
@@ -178,7 +191,7 @@ void Instruction::mov(xed_reg_enum_t reg, uint64_t immediate) {
 }
 
 void Instruction::op1(xed_iclass_enum_t instr, xed_encoder_operand_t op0) {
-    withRipSubstitution([=] (std::function<xed_encoder_operand_t(xed_encoder_operand_t)> subst) {
+    withRipSubstitution([=, this](auto subst) {
         xed_encoder_request_t req;
         xed_encoder_instruction_t enc_inst;
 
@@ -191,7 +204,7 @@ void Instruction::op1(xed_iclass_enum_t instr, xed_encoder_operand_t op0) {
 }
 
 void Instruction::op2(xed_iclass_enum_t instr, xed_encoder_operand_t op0, xed_encoder_operand_t op1) {
-    withRipSubstitution([=] (std::function<xed_encoder_operand_t(xed_encoder_operand_t)> subst) {
+    withRipSubstitution([=, this](auto subst) {
         xed_encoder_request_t req;
         xed_encoder_instruction_t enc_inst;
 
@@ -215,7 +228,7 @@ void Instruction::op2_raw(xed_iclass_enum_t instr, xed_encoder_operand_t op0, xe
 }
 
 void Instruction::op3(xed_iclass_enum_t instr, xed_encoder_operand_t op0, xed_encoder_operand_t op1, xed_encoder_operand_t op2) {
-    withRipSubstitution([=] (std::function<xed_encoder_operand_t(xed_encoder_operand_t)> subst) {
+    withRipSubstitution([=, this](auto subst) {
         xed_encoder_request_t req;
         xed_encoder_instruction_t enc_inst;
 
@@ -247,6 +260,16 @@ void Instruction::movups_raw(xed_encoder_operand_t op0, xed_encoder_operand_t op
     op2_raw(XED_ICLASS_MOVUPS, op0, op1);
 }
 
+void Instruction::mov_raw(xed_encoder_operand_t op0, xed_encoder_operand_t op1) {
+    xed_encoder_request_t req;
+    xed_encoder_instruction_t enc_inst;
+
+    xed_inst2(&enc_inst, dstate, XED_ICLASS_MOV, std::max(op0.width_bits, op1.width_bits), op0, op1);
+    xed_convert_to_encoder_request(&req, &enc_inst);
+
+    internal_requests.push_back(req);
+}
+
 void Instruction::movaps(xed_encoder_operand_t op0, xed_encoder_operand_t op1) {
     op2(XED_ICLASS_MOVAPS, op0, op1);
 }
@@ -734,124 +757,82 @@ void Instruction::call(xed_encoder_operand_t op) {
     internal_requests.push_back(req);
 }
 
-void Instruction::swap_in_upper_ymm(std::unordered_set<xed_reg_enum_t> registers) {
-    void* getYmmAddr = (void*)&get_ymm_storage;
-    withReg(XED_REG_RBX, [=]() {
-        mov(XED_REG_RBX, (uint64_t)getYmmAddr);
-        withReg(XED_REG_RAX, [=]() {
-            call(xed_reg(XED_REG_RBX));
-            // RAX now will contain the ymm pointer
+void Instruction::forgetZeroUpper(uint32_t regnum) {
+    if (blockContext != nullptr) {
+        blockContext->zeroUpper &= ~(1u << regnum);
+    }
+}
 
-            std::unordered_set<xed_reg_enum_t> usedRegs;
+void Instruction::swap_in_upper_ymm(RegSet const& registers) {
+    withYmmStorage([&](auto ymmSlot) {
+        for (auto reg : registers) {
+            uint32_t regnum = reg - XED_REG_XMM0;
+            movups_raw(ymmSlot(regnum), xed_reg(reg));
+            movups_raw(xed_reg(reg), ymmSlot(regnum + 16));
+        }
+    });
+}
 
-            for (auto reg : registers) {
+void Instruction::swap_out_upper_ymm(RegSet const& registers) {
+    withYmmStorage([&](auto ymmSlot) {
+        for (auto reg : registers) {
+            uint32_t regnum = reg - XED_REG_XMM0;
+            forgetZeroUpper(regnum);
+            movups_raw(ymmSlot(regnum + 16), xed_reg(reg));
+            movups_raw(xed_reg(reg), ymmSlot(regnum));
+        }
+    });
+}
+
+void Instruction::swap_in_upper_ymm(bool force) {
+    withYmmStorage([&](auto ymmSlot) {
+        RegSet usedRegs;
+
+        for (auto& op : operands) {
+            if (op.isYmm() || (op.isXmm() && force)) {
+                auto reg = op.toXmmReg();
                 if (usedRegs.contains(reg)) {
                     continue;
                 }
                 usedRegs.insert(reg);
                 uint32_t regnum = reg - XED_REG_XMM0;
 
-                auto disp = xed_disp(regnum*sizeof(__m128), 32);
-                movups_raw(xed_mem_bd(XED_REG_RAX, disp, 128), xed_reg(reg));
-
-                disp = xed_disp((regnum + 16)*sizeof(__m128), 32);
-                movups_raw(xed_reg(reg), xed_mem_bd(XED_REG_RAX, disp, 128));
+                movups_raw(ymmSlot(regnum), xed_reg(reg));
+                movups_raw(xed_reg(reg), ymmSlot(regnum + 16));
             }
-        });
+        }
     });
 }
 
-void Instruction::swap_out_upper_ymm(std::unordered_set<xed_reg_enum_t> registers) {
-    void* getYmmAddr = (void*)&get_ymm_storage;
-    withReg(XED_REG_RBX, [=]() {
-        mov(XED_REG_RBX, (uint64_t)getYmmAddr);
-        withReg(XED_REG_RAX, [=]() {
-            call(xed_reg(XED_REG_RBX));
-            // RAX now will contain the ymm pointer
-
-            std::unordered_set<xed_reg_enum_t> usedRegs;
+void Instruction::swap_out_upper_ymm(bool force) {
+    withYmmStorage([&](auto ymmSlot) {
+        RegSet usedRegs;
 
-            for (auto reg : registers) {
+        for (auto& op : operands) {
+            if (op.isYmm() || (op.isXmm() && force)) {
+                auto reg = op.toXmmReg();
                 if (usedRegs.contains(reg)) {
                     continue;
                 }
                 usedRegs.insert(reg);
                 uint32_t regnum = reg - XED_REG_XMM0;
+                forgetZeroUpper(regnum);
 
-                auto disp = xed_disp((regnum+16)*sizeof(__m128), 32);
-                movups_raw(xed_mem_bd(XED_REG_RAX, disp, 128), xed_reg(reg));
-
-                disp = xed_disp(regnum*sizeof(__m128), 32);
-                movups_raw(xed_reg(reg), xed_mem_bd(XED_REG_RAX, disp, 128));
+                movups_raw(ymmSlot(regnum + 16), xed_reg(reg));
+                movups_raw(xed_reg(reg), ymmSlot(regnum));
             }
-        });
-    });
-}
-
-void Instruction::swap_in_upper_ymm(bool force) {
-    void* getYmmAddr = (void*)&get_ymm_storage;
-    withReg(XED_REG_RBX, [&]() {
-        mov(XED_REG_RBX, (uint64_t)getYmmAddr);
-        withReg(XED_REG_RAX, [&]() {
-            call(xed_reg(XED_REG_RBX));
-            // RAX now will contain the ymm pointer
-
-            std::unordered_set<xed_reg_enum_t> usedRegs;
-
-            for (auto& op : operands) {
-                if (op.isYmm() || (op.isXmm() && force)) {
-                    auto reg = op.toXmmReg();
-                    if (usedRegs.contains(reg)) {
-                        continue;
-                    }
-                    usedRegs.insert(reg);
-                    uint32_t regnum = reg - XED_REG_XMM0;
-
-                    auto disp = xed_disp(regnum*sizeof(__m128), 32);
-                    movups_raw(xed_mem_bd(XED_REG_RAX, disp, 128), xed_reg(reg));
-
-                    disp = xed_disp((regnum + 16)*sizeof(__m128), 32);
-                    movups_raw(xed_reg(reg), xed_mem_bd(XED_REG_RAX, disp, 128));
-                }
-            }
-        });
-    });
-}
-
-void Instruction::swap_out_upper_ymm(bool force) {
-    void* getYmmAddr = (void*)&get_ymm_storage;
-    withReg(XED_REG_RBX, [=]() {
-        mov(XED_REG_RBX, (uint64_t)getYmmAddr);
-        withReg(XED_REG_RAX, [=]() {
-            call(xed_reg(XED_REG_RBX));
-            // RAX now will contain the ymm pointer
-
-            std::unordered_set<xed_reg_enum_t> usedRegs;
-
-            for (auto& op : operands) {
-                if (op.isYmm() || (op.isXmm() && force)) {
-                    auto reg = op.toXmmReg();
-                    if (usedRegs.contains(reg)) {
-                        continue;
-                    }
-                    usedRegs.insert(reg);
-                    uint32_t regnum = reg - XED_REG_XMM0;
-
-                    auto disp = xed_disp((regnum+16)*sizeof(__m128), 32);
-                    movups_raw(xed_mem_bd(XED_REG_RAX, disp, 128), xed_reg(reg));
-
-                    disp = xed_disp(regnum*sizeof(__m128), 32);
-                    movups_raw(xed_reg(reg), xed_mem_bd(XED_REG_RAX, disp, 128));
-                }
-            }
-        });
+        }
     });
 }
 
-void Instruction::with_upper_ymm(std::function<void()> instr) {
-    swap_in_upper_ymm();
-    instr();
-    swap_out_upper_ymm();
+RegSet Instruction::upperLaneRegs() const {
+    RegSet regs;
+    for (auto const& op : operands) {
+        if (op.isYmm()) {
+            regs.insert(op.toXmmReg());
+        }
+    }
+    return regs;
 }
 
 bool Instruction::usesYmm() const {
@@ -864,32 +845,22 @@ bool Instruction::usesYmm() const {
 }
 
 void Instruction::zeroupperInternal(Operand const& op) {
-    void* getYmmAddr = (void*)&get_ymm_storage;
-    withReg(XED_REG_RBX, [=]() {
-        mov(XED_REG_RBX, (uint64_t)getYmmAddr);
-        withReg(XED_REG_RAX, [=]() {
-            call(xed_reg(XED_REG_RBX));
-            // RAX now will contain the ymm pointer
-
-            auto reg = op.toXmmReg();
-            uint32_t regnum = reg - XED_REG_XMM0;
-
-            // swap in the reg
-            auto disp = xed_disp(regnum*sizeof(__m128), 32);
-            movups_raw(xed_mem_bd(XED_REG_RAX, disp, 128), xed_reg(reg));
-
-            disp = xed_disp((regnum + 16)*sizeof(__m128), 32);
-            movups_raw(xed_reg(reg), xed_mem_bd(XED_REG_RAX, disp, 128));
-
-            xorps_raw(xed_reg(reg), xed_reg(reg));
-
-            // swap it out
-            disp = xed_disp((regnum + 16)*sizeof(__m128), 32);
-            movups_raw(xed_mem_bd(XED_REG_RAX, disp, 128), xed_reg(reg));
+    uint32_t regnum = op.toXmmReg() - XED_REG_XMM0;
+    if (blockContext != nullptr) {
+        if (blockContext->zeroUpper & (1u << regnum)) {
+            return;
+        }
+        blockContext->zeroUpper |= 1u << regnum;
+    }
 
-            disp = xed_disp(regnum*sizeof(__m128), 32);
-            movups_raw(xed_reg(reg), xed_mem_bd(XED_REG_RAX, disp, 128));
-        });
+    // store zeroes straight into the slot, MOV with an immediate leaves registers and flags alone
+    withYmmStorage([&](auto ymmSlot) {
+        auto low = ymmSlot(regnum + 16);
+        low.width_bits = 64;
+        auto high = low;
+        high.u.mem.disp.displacement += 8;
+        mov_raw(low, xed_imm0(0, 32));
+        mov_raw(high, xed_imm0(0, 32));
     });
 }
 
@@ -912,6 +883,14 @@ bool Instruction::usesRspAddressing() const {
 }
 
 xed_reg_enum_t Instruction::getUnusedReg() {
+    // dead registers first, they don't have to be spilled
+    for (auto reg : gprs) {
+        if (usedRegs.count(reg) == 0 && !liveAfter.contains(reg)) {
+            usedRegs.insert(reg);
+            return reg;
+        }
+    }
+
     for (auto reg : gprs) {
         if (usedRegs.count(reg) == 0) {
             usedRegs.insert(reg);
@@ -930,6 +909,13 @@ xed_reg_enum_t xmmToYmm(xed_reg_enum_t reg) {
 }
 
 xed_reg_enum_t Instruction::getUnusedXmmReg() {
+    for (auto reg : xmmRegs) {
+        if (!usedRegs.contains(reg) && !usedRegs.contains(xmmToYmm(reg)) && !liveAfter.contains(reg)) {
+            usedRegs.insert(reg);
+            return reg;
+        }
+    }
+
     for (auto reg : xmmRegs) {
         if (!usedRegs.contains(reg) && !usedRegs.contains(xmmToYmm(reg))) {
             usedRegs.insert(reg);
@@ -944,50 +930,54 @@ void Instruction::returnReg(xed_reg_enum_t reg) {
     usedRegs.erase(reg);
 }
 
-void Instruction::withFreeReg(std::function<void(xed_reg_enum_t)> instr) {
-    auto reg = getUnusedReg();
-    push(reg);
-    instr(reg);
-    pop(reg);
-    returnReg(reg);
-}
-
-void Instruction::withReg(xed_reg_enum_t reg, std::function<void()> instr) {
-    usedRegs.insert(reg);
-    push(reg);
-    instr();
-    pop(reg);
-    returnReg(reg);
-}
-
-void Instruction::withRipSubstitution(std::function<void(std::function<xed_encoder_operand_t(xed_encoder_operand_t subst)>)> instr) {
-    // TODO: do not replace RIP if we are compiling inline
-    if (usesRipAddressing()) {
-        withFreeReg([=](xed_reg_enum_t tempReg) {
-            mov(tempReg, rip+ilen);
-
-            instr([=](xed_encoder_operand_t op) { return substRip(op, tempReg); });
-        });
-    } else if (usesRspAddressing()) {
-        instr([=](xed_encoder_operand_t op) { return offsetRsp(op, rspOffset); });
-    } else
-    if (usesRipAddressing() && usesRspAddressing()) {
-        withFreeReg([=](xed_reg_enum_t tempRipReg) {
-            mov(tempRipReg, rip+ilen);
-            instr([=](xed_encoder_operand_t op) {
-                if (op.type == XED_ENCODER_OPERAND_TYPE_MEM) {
-                    if (op.u.mem.base == XED_REG_RSP || op.u.mem.base == XED_REG_ESP) {
-                        return offsetRsp(substRip(op, tempRipReg), rspOffset);
-                    } else {
-                        return substRip(op, tempRipReg);
-                    }
-                }
-                return op;
-            });
-        });
+bool Instruction::isOperandReg(xed_reg_enum_t reg) const {
+    for (auto const& op : operands) {
+        for (auto used : op.getUsedReg()) {
+            if (used != XED_REG_INVALID && xed_get_largest_enclosing_register(used) == xed_get_largest_enclosing_register(reg)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// RIP-relative operand with the absolute address in its displacement, for RipMode::Relative
+static xed_encoder_operand_t absoluteRip(xed_encoder_operand_t op, uint64_t ripBase) {
+    if (op.type == XED_ENCODER_OPERAND_TYPE_MEM && op.u.mem.base == XED_REG_RIP) {
+        op.u.mem.disp.displacement += ripBase;
+        op.u.mem.disp.displacement_bits = 32;
+    }
+    return op;
+}
+
+xed_encoder_operand_t OperandSubstitution::operator()(xed_encoder_operand_t op) const {
+    switch (kind) {
+        case Kind::AbsoluteRip:
+            return absoluteRip(op, ripBase);
+        case Kind::RipRegister:
+            return substRip(op, ripReg);
+        case Kind::Rsp:
+            return offsetRsp(op, *rspOffset);
+        case Kind::None:
+            break;
+    }
+    return op;
+}
+
+void Instruction::movRipBase(xed_reg_enum_t reg) {
+    if (ripMode == RipMode::Pool) {
+        mov_raw(xed_reg(reg), xed_mem_bd(XED_REG_RIP, xed_disp(rip + ilen, 32), 64));
     } else {
-        instr([](xed_encoder_operand_t op) { return op; });
+        mov(reg, rip + ilen);
+    }
+}
+
+xed_encoder_operand_t Instruction::constant(__m128i value) {
+    if (constantPool == nullptr) {
+        debug_print("Constant used outside of a Compiler\n");
+        exit(1);
     }
+    return xed_mem_bd(XED_REG_RIP, xed_disp(constantPool->reference(value), 32), 128);
 }
 
 void Instruction::sub(xed_reg_enum_t reg, int8_t immediate) {
@@ -1025,20 +1015,6 @@ void Instruction::add(xed_reg_enum_t reg, int8_t immediate) {
     }
 }
 
-void Instruction::withPreserveXmmReg(Operand const& op, std::function<void()> instr) {
-    withPreserveXmmReg(op.toXmmReg(), instr);
-}
-
-void Instruction::withPreserveXmmReg(xed_reg_enum_t reg, std::function<void()> instr) {
-    sub(XED_REG_RSP, 16);
-    movdqu_raw(xed_mem_b(XED_REG_RSP, 128), xed_reg(reg));
-
-    instr();
-
-    movdqu_raw(xed_reg(reg), xed_mem_b(XED_REG_RSP, 128));
-    add(XED_REG_RSP, 16);
-}
-
 xed_iform_enum_t Instruction::getIform() const {
     return xed_decoded_inst_get_iform_enum(&xedd);
 }
\ No newline at end of file
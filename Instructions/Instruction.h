@@ -1,6 +1,5 @@
 #pragma once
 
-#include <unordered_set>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -15,48 +14,99 @@ extern "C" {
 }
 #endif
 
-#include <functional>
 #include <vector>
 #include "Operand.h"
+#include "RegSet.h"
+#include "../Compiler/Arena.h"
 #include "../memmanager.h"
+#include "../Compiler/Liveness.h"
+#include "../Compiler/ConstantPool.h"
 #include "../utils.h"
 
 enum class CompilationStrategy {
     DirectCall,
     DirectCallPopRax,
     Inline,
-    FarJump
+    FarJump,
+    NearJump
+};
+
+// How a chunk reaches the memory RIP-relative operands of the original code address
+enum class RipMode {
+    // the address is materialized in a scratch register
+    Absolute,
+    // the operand stays RIP-relative with the absolute address in its displacement,
+    // the Compiler rebases it once the chunk is placed
+    Relative,
+    // a scratch register is loaded from a literal pool at the end of the chunk, the
+    // RIP-relative load has the address it wants loaded in its displacement
+    Pool,
+};
+
+// What the Compiler knows about the state between the instructions of a block
+struct BlockContext {
+    // bit n is set while the upper half of YMMn is known to be zero
+    uint32_t zeroUpper = 0;
+};
+
+// A lowering's requests, from the arena while a translation runs
+using Requests = ArenaVector<xed_encoder_request_t>;
+
+// Rewrites a memory operand of the original instruction for where the lowering runs,
+// see Instruction::withRipSubstitution
+struct OperandSubstitution {
+    enum class Kind {
+        None,
+        // RIP-relative with the absolute address in the displacement
+        AbsoluteRip,
+        // RIP replaced by ripReg holding the end of the instruction
+        RipRegister,
+        // RSP-based displacements corrected by what the lowering pushed so far
+        Rsp,
+    };
+
+    Kind kind = Kind::None;
+    uint64_t ripBase = 0;
+    xed_reg_enum_t ripReg = XED_REG_INVALID;
+    const int64_t* rspOffset = nullptr;
+
+    xed_encoder_operand_t operator()(xed_encoder_operand_t op) const;
 };
 
 class Instruction {
-    const std::vector<xed_reg_enum_t> gprs = {
+    static constexpr xed_reg_enum_t gprs[] = {
         XED_REG_RAX, XED_REG_RBX, XED_REG_RCX, XED_REG_RDX, XED_REG_RSI, XED_REG_RDI, XED_REG_R8, XED_REG_R9,
         XED_REG_R10, XED_REG_R11, XED_REG_R12, XED_REG_R13, XED_REG_R14, XED_REG_R15
     };
 
-    const std::vector<xed_reg_enum_t> xmmRegs = {
+    static constexpr xed_reg_enum_t xmmRegs[] = {
         XED_REG_XMM0, XED_REG_XMM1, XED_REG_XMM2, XED_REG_XMM3, XED_REG_XMM4, XED_REG_XMM5, XED_REG_XMM6, XED_REG_XMM7,
         XED_REG_XMM8, XED_REG_XMM9, XED_REG_XMM10, XED_REG_XMM11, XED_REG_XMM12, XED_REG_XMM13, XED_REG_XMM14,
         XED_REG_XMM15
     };
 
-    const uint64_t pointerWidthBytes = 8;
+    static const uint64_t pointerWidthBytes = 8;
 
 
 protected:
     /*const*/ uint32_t opWidth;
     /*const*/ xed_bits_t vl;
-    std::unordered_set<xed_reg_enum_t> usedRegs;
+    RegSet usedRegs;
     int64_t rspOffset = 0;
     const uint64_t rip;
     const uint8_t ilen;
 
     const xed_inst_t *xi;
     const xed_decoded_inst_t xedd;
-    std::vector<xed_encoder_request_t> internal_requests;
-    std::vector<Operand> operands;
+    Requests internal_requests;
+    ArenaVector<Operand> operands;
+    BlockContext* blockContext = nullptr;
+    // what the code after this instruction may still read, scratch registers outside it need no spill
+    LiveState liveAfter = LiveState::all();
+    RipMode ripMode = RipMode::Absolute;
+    ConstantPool* constantPool = nullptr;
 
-    Instruction(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd);
+    Instruction(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd);
     virtual ~Instruction() = default;
 
     bool usesYmm() const;
@@ -66,6 +116,9 @@ protected:
     void pop(xed_reg_enum_t reg);
     void popf();
     void pushf();
+    // pushf and popf around a sequence clobbering the flags, left out when nothing reads them afterwards
+    void saveFlags();
+    void restoreFlags();
     void ret();
     void sub(xed_reg_enum_t reg, int8_t immediate);
     void add(xed_reg_enum_t reg, int8_t immediate);
@@ -76,6 +129,7 @@ protected:
     void movups(xed_encoder_operand_t op0, xed_encoder_operand_t op1);
     void movupd(xed_encoder_operand_t op0, xed_encoder_operand_t op1);
     void movups_raw(xed_encoder_operand_t op0, xed_encoder_operand_t op1);
+    void mov_raw(xed_encoder_operand_t op0, xed_encoder_operand_t op1);
     void movaps(xed_encoder_operand_t op0, xed_encoder_operand_t op1);
     void movapd(xed_encoder_operand_t op0, xed_encoder_operand_t op1);
     void movss(xed_encoder_operand_t op0, xed_encoder_operand_t op1);
@@ -207,12 +261,19 @@ protected:
     void op2_raw(xed_iclass_enum_t instr, xed_encoder_operand_t op0, xed_encoder_operand_t op1);
     void op1(xed_iclass_enum_t instr, xed_encoder_operand_t op0);
 
-    void swap_in_upper_ymm(std::unordered_set<xed_reg_enum_t> registers);
-    void swap_out_upper_ymm(std::unordered_set<xed_reg_enum_t> registers);
+    void swap_in_upper_ymm(RegSet const& registers);
+    void swap_out_upper_ymm(RegSet const& registers);
     void swap_in_upper_ymm(bool force = false);
     void swap_out_upper_ymm(bool force = false);
-    void with_upper_ymm(std::function<void()> instr);
+    template<typename F>
+    void with_upper_ymm(F instr) {
+        swap_in_upper_ymm();
+        instr();
+        swap_out_upper_ymm();
+    }
     void zeroupperInternal(Operand const& op);
+    // the upper half of YMMn is written from a register, it is no longer known to be zero
+    void forgetZeroUpper(uint32_t regnum);
 
     bool usesRipAddressing() const;
     bool usesRspAddressing() const;
@@ -220,16 +281,136 @@ protected:
     xed_reg_enum_t getUnusedReg();
     xed_reg_enum_t getUnusedXmmReg();
     void returnReg(xed_reg_enum_t reg);
+    bool isOperandReg(xed_reg_enum_t reg) const;
+
+    // The helpers taking a lowering take it as a template parameter, a lambda runs inline without a std::function
+    template<typename F>
+    void withFreeReg(F instr) {
+        auto reg = getUnusedReg();
+        bool spill = liveAfter.contains(reg);
+        if (spill) {
+            push(reg);
+        }
+        instr(reg);
+        if (spill) {
+            pop(reg);
+        }
+        returnReg(reg);
+    }
+
+    template<typename F>
+    void withReg(xed_reg_enum_t reg, F instr) {
+        // an operand or a scratch register taken further out holds a value
+        bool inUse = usedRegs.contains(reg);
+        bool spill = inUse || liveAfter.contains(reg);
+        usedRegs.insert(reg);
+        if (spill) {
+            push(reg);
+        }
+        instr();
+        if (spill) {
+            pop(reg);
+        }
+        if (!inUse) {
+            returnReg(reg);
+        }
+    }
 
-    void withFreeReg(std::function<void(xed_reg_enum_t)> instr);
-    void withReg(xed_reg_enum_t reg, std::function<void()> instr);
-    void withRipSubstitution(std::function<void(std::function<xed_encoder_operand_t(xed_encoder_operand_t)>)> instr);
+    // puts the address RIP-relative operands are based on, the end of this instruction, into reg
+    void movRipBase(xed_reg_enum_t reg);
 
-    void withPreserveXmmReg(Operand const& op, std::function<void()> instr);
-    void withPreserveXmmReg(xed_reg_enum_t reg, std::function<void()> instr);
+    // instr gets an OperandSubstitution to pass the memory operands of the original instruction through
+    template<typename F>
+    void withRipSubstitution(F instr) {
+        // TODO: do not replace RIP if we are compiling inline
+        if (usesRipAddressing() && ripMode == RipMode::Relative) {
+            instr(OperandSubstitution{.kind = OperandSubstitution::Kind::AbsoluteRip, .ripBase = rip + ilen});
+        } else if (usesRipAddressing()) {
+            withFreeReg([&](xed_reg_enum_t tempReg) {
+                movRipBase(tempReg);
+                instr(OperandSubstitution{.kind = OperandSubstitution::Kind::RipRegister, .ripReg = tempReg});
+            });
+        } else if (usesRspAddressing()) {
+            instr(OperandSubstitution{.kind = OperandSubstitution::Kind::Rsp, .rspOffset = &rspOffset});
+        } else {
+            instr(OperandSubstitution{});
+        }
+    }
+
+    // value as a 128-bit memory operand in the constant pool of the chunk, it takes no register
+    xed_encoder_operand_t constant(__m128i value);
+
+    // slot n of the YMM storage of the current thread as a 128-bit memory operand
+    struct YmmSlot {
+        xed_reg_enum_t segment;
+        xed_reg_enum_t base;
+        int64_t offset;
+
+        xed_encoder_operand_t operator()(uint32_t slot) const {
+            return xed_mem_gbd(segment, base, xed_disp(offset + slot*(int64_t)sizeof(__m128), 32), 128);
+        }
+    };
+
+    template<typename F>
+    void withYmmStorage(F instr) {
+        auto segment = ymm_storage_segment();
+        if (segment != XED_REG_INVALID) {
+            // reachable through FS/GS, no call and no scratch registers
+            instr(YmmSlot{segment, XED_REG_INVALID, ymm_storage_offset()});
+            return;
+        }
+
+        void* getYmmAddr = (void*)&get_ymm_storage;
+        withReg(XED_REG_RBX, [&]() {
+            mov(XED_REG_RBX, (uint64_t)getYmmAddr);
+            withReg(XED_REG_RAX, [&]() {
+                call(xed_reg(XED_REG_RBX));
+                // RAX now will contain the ymm pointer
+                instr(YmmSlot{XED_REG_INVALID, XED_REG_RAX, 0});
+            });
+        });
+    }
+
+    template<typename F>
+    void withPreserveXmmReg(Operand const& op, F instr) {
+        withPreserveXmmReg(op.toXmmReg(), instr);
+    }
+
+    template<typename F>
+    void withPreserveXmmReg(xed_reg_enum_t reg, F instr) {
+        // an operand may still be read by the rest of the lowering, only scratch registers are left unsaved
+        if (!liveAfter.contains(reg) && !isOperandReg(reg)) {
+            instr();
+            return;
+        }
+
+        sub(XED_REG_RSP, 16);
+        movdqu_raw(xed_mem_b(XED_REG_RSP, 128), xed_reg(reg));
+
+        instr();
+
+        movdqu_raw(xed_reg(reg), xed_mem_b(XED_REG_RSP, 128));
+        add(XED_REG_RSP, 16);
+    }
     public:
-    virtual std::vector<xed_encoder_request_t> const& compile(CompilationStrategy compilationStrategy, uint64_t returnAddr = 0) = 0;
+    virtual Requests const& compile(CompilationStrategy compilationStrategy, uint64_t returnAddr = 0) = 0;
     xed_iform_enum_t getIform() const;
 
+    // The upper lane depends only on the upper lanes of the operands, so the Compiler may run
+    // it after other instructions' lower lanes, between one swap in and out for the whole run.
+    virtual bool isLaneLocal() const { return false; }
+    // One lane of a lane-local instruction, the upper lane swaps swapIn in before and swapOut out after it
+    virtual Requests const& compileLane(CompilationStrategy compilationStrategy, bool upper,
+        RegSet const& swapIn, RegSet const& swapOut) {
+        internal_requests.clear();
+        return internal_requests;
+    }
+    void setBlockContext(BlockContext* context) { blockContext = context; }
+    void setLiveAfter(LiveState const& live) { liveAfter = live; }
+    void setRipMode(RipMode mode) { ripMode = mode; }
+    void setConstantPool(ConstantPool* pool) { constantPool = pool; }
+    // XMM halves of the YMM operands
+    RegSet upperLaneRegs() const;
+
     const xed_decoded_inst_t* getDecodedInstr() const { return &xedd; }
 };
@@ -129,7 +129,10 @@
 #include "VPTEST.h"
 #include "VCMPSD.h"
 #include "AND.h"
-#include <map>
+#include "NativeInstruction.h"
+#include <cstdint>
+#include <initializer_list>
+#include <utility>
 
 #ifdef __cplusplus
 extern "C" {
@@ -140,14 +143,42 @@ extern "C" {
 }
 #endif
 
-typedef std::function<std::shared_ptr<Instruction>(uint64_t, uint8_t, xed_decoded_inst_t)> instrFactory;
+// Instructions are allocated from the translation arena when there is one
+typedef std::shared_ptr<Instruction> (*instrFactory)(uint64_t, uint8_t, xed_decoded_inst_t const&);
 
 #define ICLASSMAP(_instr) {\
     XED_ICLASS_##_instr,  \
-    [](uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) -> std::shared_ptr<Instruction> { return std::make_shared<_instr>(rip, ilen, xedd); } \
+    [](uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) -> std::shared_ptr<Instruction> { return std::allocate_shared<_instr>(ArenaAllocator<_instr>(), rip, ilen, xedd); } \
 }
 
-const std::map<xed_iclass_enum_t, instrFactory> iclassMapping = {
+// The factories indexed by iclass and a bitmask of the supported iclasses, both
+// built at compile time, so loading the library runs no initializer for them and
+// the decoder and the scanners look an iclass up with a single load.
+class IclassMapping {
+    static const uint32_t wordBits = 64;
+
+    instrFactory factories[XED_ICLASS_LAST] = {};
+    uint64_t supported[(XED_ICLASS_LAST + wordBits - 1) / wordBits] = {};
+
+public:
+    constexpr IclassMapping(std::initializer_list<std::pair<xed_iclass_enum_t, instrFactory>> entries) {
+        for (auto const& [iclass, factory] : entries) {
+            factories[iclass] = factory;
+            supported[iclass / wordBits] |= 1ull << (iclass % wordBits);
+        }
+    }
+
+    constexpr bool contains(xed_iclass_enum_t iclass) const {
+        return iclass < XED_ICLASS_LAST && (supported[iclass / wordBits] >> (iclass % wordBits)) & 1;
+    }
+
+    // nullptr when the iclass is not supported
+    constexpr instrFactory factory(xed_iclass_enum_t iclass) const {
+        return iclass < XED_ICLASS_LAST ? factories[iclass] : nullptr;
+    }
+};
+
+constexpr IclassMapping iclassMapping = {
     ICLASSMAP(VMOVSS),
     ICLASSMAP(VXORPS),
     ICLASSMAP(VMOVUPS),
@@ -278,8 +309,14 @@ const std::map<xed_iclass_enum_t, instrFactory> iclassMapping = {
     ICLASSMAP(AND),
 };
 
+// constant-initialized, no static initializer builds the table
+static_assert(iclassMapping.contains(XED_ICLASS_VMOVUPS) && !iclassMapping.contains(XED_ICLASS_NOP));
+
 inline void printSupportedInstructions() {
-    for (auto const& [iclass, factory] : iclassMapping) {
-        debug_print("%s (%d)\n", xed_iclass_enum_t2str(iclass), iclass);
+    for (uint32_t i = 0; i < XED_ICLASS_LAST; i++) {
+        auto iclass = (xed_iclass_enum_t)i;
+        if (iclassMapping.contains(iclass)) {
+            debug_print("%s (%d)\n", xed_iclass_enum_t2str(iclass), iclass);
+        }
     }
 }
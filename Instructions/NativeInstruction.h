@@ -0,0 +1,100 @@
+#include "Instruction.h"
+
+// An ordinary non-AVX instruction inside a translated block. It is copied into
+// the chunk as is, only RIP-relative addressing is rebased on the chunk or a scratch register.
+class NativeInstruction : public Instruction {
+public:
+    NativeInstruction(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : Instruction(rip, ilen, xedd) {
+        // operands may name a part of a register, the scratch register must avoid all of it
+        for (auto const& op : operands) {
+            for (auto reg : op.getUsedReg()) {
+                if (reg != XED_REG_INVALID) {
+                    usedRegs.insert(xed_get_largest_enclosing_register(reg));
+                }
+            }
+        }
+    }
+
+    static bool canPassThrough(xed_decoded_inst_t const& xedd) {
+        if (!xed_decoded_inst_valid(&xedd)) {
+            return false;
+        }
+
+        auto extension = xed_decoded_inst_get_extension(&xedd);
+        if (extension != XED_EXTENSION_BASE && extension != XED_EXTENSION_LONGMODE) {
+            return false;
+        }
+
+        // control flow, stack and system instructions end the block, and so do NOPs
+        // because compilers use them to align branch targets
+        switch (xed_decoded_inst_get_category(&xedd)) {
+            case XED_CATEGORY_BINARY:
+            case XED_CATEGORY_LOGICAL:
+            case XED_CATEGORY_DATAXFER:
+            case XED_CATEGORY_SHIFT:
+            case XED_CATEGORY_ROTATE:
+            case XED_CATEGORY_BITBYTE:
+            case XED_CATEGORY_CMOV:
+            case XED_CATEGORY_SETCC:
+            case XED_CATEGORY_CONVERT:
+                break;
+            case XED_CATEGORY_MISC:
+                if (xed_decoded_inst_get_iclass(&xedd) != XED_ICLASS_LEA) {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+
+        // the stack pointer is off by our return address or spilled registers inside a chunk
+        auto xi = xed_decoded_inst_inst(&xedd);
+        for (uint32_t i = 0; i < xed_inst_noperands(xi); i++) {
+            auto name = xed_operand_name(xed_inst_operand(xi, i));
+            if (xed_operand_is_register(name)) {
+                auto reg = xed_decoded_inst_get_reg(&xedd, name);
+                if (xed_get_largest_enclosing_register(reg) == XED_REG_RSP) {
+                    return false;
+                }
+            }
+        }
+        for (uint32_t i = 0; i < xed_decoded_inst_number_of_memory_operands(&xedd); i++) {
+            auto base = xed_decoded_inst_get_base_reg(&xedd, i);
+            auto index = xed_decoded_inst_get_index_reg(&xedd, i);
+            if (xed_get_largest_enclosing_register(base) == XED_REG_RSP || xed_get_largest_enclosing_register(index) == XED_REG_RSP) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    Requests const& compile(CompilationStrategy compilationStrategy, uint64_t returnAddr = 0) {
+        internal_requests.clear();
+
+        if (usesRipAddressing() && ripMode == RipMode::Relative) {
+            xed_encoder_request_t req = reencode(XED_REG_INVALID);
+            xed_encoder_request_set_memory_displacement(&req, rip + ilen + xed_decoded_inst_get_memory_displacement(&xedd, 0), 4);
+            internal_requests.push_back(req);
+        } else if (usesRipAddressing()) {
+            withFreeReg([=, this](xed_reg_enum_t tempReg) {
+                movRipBase(tempReg);
+                internal_requests.push_back(reencode(tempReg));
+            });
+        } else {
+            internal_requests.push_back(reencode(XED_REG_INVALID));
+        }
+
+        return internal_requests;
+    }
+
+private:
+    xed_encoder_request_t reencode(xed_reg_enum_t ripSubstReg) const {
+        xed_encoder_request_t req = xedd;
+        xed_encoder_request_init_from_decode(&req);
+        if (ripSubstReg != XED_REG_INVALID) {
+            xed_encoder_request_set_base0(&req, ripSubstReg);
+        }
+        return req;
+    }
+};
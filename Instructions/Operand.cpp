@@ -79,7 +79,7 @@ bool Operand::hasRspBase() const {
     return base == XED_REG_RSP || index == XED_REG_RSP;
 }
 
-std::vector<xed_reg_enum_t> Operand::getUsedReg() const {
+RegSet Operand::getUsedReg() const {
     if (isMemoryOperand()) {
         auto baseReg = xed_decoded_inst_get_base_reg(xedd, 0);
         auto indexReg = xed_decoded_inst_get_index_reg(xedd, 0);
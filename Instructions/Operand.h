@@ -18,6 +18,7 @@ extern "C" {
 }
 #endif
 #include <cassert>
+#include "RegSet.h"
 
 class Operand {
     const xed_decoded_inst_t *xedd;
@@ -51,5 +52,5 @@ public:
     xed_encoder_operand_t toEncoderOperand(bool upper) const;
     bool hasRipBase() const;
     bool hasRspBase() const;
-    std::vector<xed_reg_enum_t> getUsedReg() const;
+    RegSet getUsedReg() const;
 };
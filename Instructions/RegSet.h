@@ -0,0 +1,79 @@
+#pragma once
+
+extern "C" {
+#include <xed/xed-reg-enum.h>
+}
+
+#include <cstdint>
+#include <initializer_list>
+
+// A set of registers as a bitmask over xed_reg_enum_t, iterated in enum order.
+// It lives inline in whatever holds it, so building one never allocates.
+class RegSet {
+    static const uint32_t wordBits = 64;
+    static const uint32_t words = (XED_REG_LAST + wordBits - 1) / wordBits;
+
+    uint64_t bits[words] = {};
+
+public:
+    class iterator {
+        RegSet const* set;
+        uint32_t reg;
+
+    public:
+        iterator(RegSet const* set, uint32_t reg) : set(set), reg(reg) {}
+
+        xed_reg_enum_t operator*() const { return (xed_reg_enum_t)reg; }
+        iterator& operator++() {
+            reg = set->next(reg + 1);
+            return *this;
+        }
+        bool operator==(iterator const& other) const { return reg == other.reg; }
+        bool operator!=(iterator const& other) const { return reg != other.reg; }
+    };
+
+    RegSet() = default;
+    RegSet(std::initializer_list<xed_reg_enum_t> regs) {
+        for (auto reg : regs) {
+            insert(reg);
+        }
+    }
+
+    void insert(xed_reg_enum_t reg) { bits[reg / wordBits] |= 1ull << (reg % wordBits); }
+    void erase(xed_reg_enum_t reg) { bits[reg / wordBits] &= ~(1ull << (reg % wordBits)); }
+    bool contains(xed_reg_enum_t reg) const { return (bits[reg / wordBits] >> (reg % wordBits)) & 1; }
+    uint32_t count(xed_reg_enum_t reg) const { return contains(reg); }
+
+    bool empty() const {
+        for (auto word : bits) {
+            if (word != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint32_t size() const {
+        uint32_t n = 0;
+        for (auto word : bits) {
+            n += __builtin_popcountll(word);
+        }
+        return n;
+    }
+
+    iterator begin() const { return iterator(this, next(0)); }
+    iterator end() const { return iterator(this, words * wordBits); }
+
+private:
+    // the first member at or after reg, words * wordBits past the last one
+    uint32_t next(uint32_t reg) const {
+        while (reg < words * wordBits) {
+            uint64_t word = bits[reg / wordBits] >> (reg % wordBits);
+            if (word != 0) {
+                return reg + __builtin_ctzll(word);
+            }
+            reg = (reg / wordBits + 1) * wordBits;
+        }
+        return words * wordBits;
+    }
+};
@@ -4,7 +4,7 @@
 
 class SHLX : public CompilableInstruction<SHLX> {
 public:
-    SHLX(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {
+    SHLX(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {
         usedRegs.insert(XED_REG_RCX);
     }
 
@@ -70,7 +70,7 @@ private:
     }
 
     void implementation(bool upper, bool compile_inline) {
-        pushf();
+        saveFlags();
         std::optional<xed_reg_enum_t> rcxSubst;
         std::optional<xed_reg_enum_t> original;
         for (auto & op : operands) {
@@ -132,6 +132,6 @@ private:
             pop(*rcxSubst);
             returnReg(*rcxSubst);
         }
-        popf();
+        restoreFlags();
     }
 };
\ No newline at end of file
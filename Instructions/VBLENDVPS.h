@@ -6,7 +6,7 @@
 
 class VBLENDVPS : public CompilableInstruction<VBLENDVPS> {
 public:
-    VBLENDVPS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VBLENDVPS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VBLENDVPS,
@@ -64,7 +64,7 @@ private:
             withPreserveXmmReg(tempXmmReg, [=]() {
                 movups(tempXmmReg, operands[xmm0operand].toEncoderOperand(upper));
 
-                std::vector<xed_encoder_operand_t> tempOperands;
+                ArenaVector<xed_encoder_operand_t> tempOperands;
                 for (int i = 0; i < operands.size(); i++) {
                     if (i == xmm0operand) {
                         tempOperands.push_back(xed_reg(tempXmmReg));
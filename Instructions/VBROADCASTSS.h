@@ -5,7 +5,7 @@
 
 class VBROADCASTSS : public CompilableInstruction<VBROADCASTSS> {
 public:
-    VBROADCASTSS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VBROADCASTSS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VBROADCASTSS,
@@ -8,12 +8,8 @@ class VCVTPS2PH : public CompilableInstruction<VCVTPS2PH> {
     const uint32_t exp_s_mask = (0b1 << 30);
     const uint32_t fra_mask = (0b1111111111 << 13);
 
-    const __m128 sign_mask_v = _mm_set1_ps(*(float*)&sign_mask);
-    const __m128 exp_mask_v = _mm_set1_ps(*(float*)&exp_mask);
-    const __m128 exp_s_mask_v = _mm_set1_ps(*(float*)&exp_s_mask);
-    const __m128 fra_mask_v = _mm_set1_ps(*(float*)&fra_mask);
 public:
-    VCVTPS2PH(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {
+    VCVTPS2PH(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {
     }
 
     static const inline InstructionMetadata Metadata = {
@@ -103,46 +99,39 @@ __asm__ volatile("movups %1, %%xmm0;\n" // move input into xmm0
             auto outputReg = operands[0].toEncoderOperand(upper);
             auto tempReg = getUnusedXmmReg();
 
-            withFreeReg([&](xed_reg_enum_t tempGpr) {
-                movups(xed_reg(inputReg), input);
-                xorps(outputReg, outputReg);
-
-                // get sign
-                movups(xed_reg(tempReg), xed_reg(inputReg));
-                mov(tempGpr, (uint64_t)&sign_mask_v);
-                pand(xed_reg(tempReg), xed_mem_b(tempGpr, 128));
-                psrld(xed_reg(tempReg), xed_imm0(16, 8));
-                por(outputReg, xed_reg(tempReg));
-
-                // get exponent
-                movups(xed_reg(tempReg), xed_reg(inputReg));
-                mov(tempGpr, (uint64_t)&exp_mask_v);
-                pand(xed_reg(tempReg), xed_mem_b(tempGpr, 128));
-                psrld(xed_reg(tempReg), xed_imm0(13, 8));
-                por(outputReg, xed_reg(tempReg));
-
-                // get exponent sign
-                movups(xed_reg(tempReg), xed_reg(inputReg));
-                mov(tempGpr, (uint64_t)&exp_s_mask_v);
-                pand(xed_reg(tempReg), xed_mem_b(tempGpr, 128));
-                psrld(xed_reg(tempReg), xed_imm0(16, 8));
-                por(outputReg, xed_reg(tempReg));
-
-                // get fraction
-                movups(xed_reg(tempReg), xed_reg(inputReg));
-                mov(tempGpr, (uint64_t)&fra_mask_v);
-                pand(xed_reg(tempReg), xed_mem_b(tempGpr, 128));
-                psrld(xed_reg(tempReg), xed_imm0(13, 8));
-                por(outputReg, xed_reg(tempReg));
-
-                // Compact everything into lower quadword
-                pshufhw(outputReg, outputReg, xed_imm0(0xf8, 8));
-                pshuflw(outputReg, outputReg, xed_imm0(0xf8, 8));
-
-                xorps(xed_reg(tempReg), xed_reg(tempReg));
-                shufps(outputReg, xed_reg(tempReg), xed_imm0(0x08, 8));
-            });
-            
+            movups(xed_reg(inputReg), input);
+            xorps(outputReg, outputReg);
+
+            // get sign
+            movups(xed_reg(tempReg), xed_reg(inputReg));
+            pand(xed_reg(tempReg), constant(_mm_set1_epi32(sign_mask)));
+            psrld(xed_reg(tempReg), xed_imm0(16, 8));
+            por(outputReg, xed_reg(tempReg));
+
+            // get exponent
+            movups(xed_reg(tempReg), xed_reg(inputReg));
+            pand(xed_reg(tempReg), constant(_mm_set1_epi32(exp_mask)));
+            psrld(xed_reg(tempReg), xed_imm0(13, 8));
+            por(outputReg, xed_reg(tempReg));
+
+            // get exponent sign
+            movups(xed_reg(tempReg), xed_reg(inputReg));
+            pand(xed_reg(tempReg), constant(_mm_set1_epi32(exp_s_mask)));
+            psrld(xed_reg(tempReg), xed_imm0(16, 8));
+            por(outputReg, xed_reg(tempReg));
+
+            // get fraction
+            movups(xed_reg(tempReg), xed_reg(inputReg));
+            pand(xed_reg(tempReg), constant(_mm_set1_epi32(fra_mask)));
+            psrld(xed_reg(tempReg), xed_imm0(13, 8));
+            por(outputReg, xed_reg(tempReg));
+
+            // Compact everything into lower quadword
+            pshufhw(outputReg, outputReg, xed_imm0(0xf8, 8));
+            pshuflw(outputReg, outputReg, xed_imm0(0xf8, 8));
+
+            xorps(xed_reg(tempReg), xed_reg(tempReg));
+            shufps(outputReg, xed_reg(tempReg), xed_imm0(0x08, 8));
 
             returnReg(tempReg);
             returnReg(inputReg); 
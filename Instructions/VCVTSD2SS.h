@@ -2,7 +2,7 @@
 
 class VCVTSD2SS : public CompilableInstruction<VCVTSD2SS> {
 public:
-    VCVTSD2SS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VCVTSD2SS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VCVTSD2SS,
@@ -2,7 +2,7 @@
 
 class VCVTSI2SD : public CompilableInstruction<VCVTSI2SD> {
 public:
-    VCVTSI2SD(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VCVTSI2SD(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VCVTSI2SD,
@@ -2,7 +2,7 @@
 
 class VCVTSI2SS : public CompilableInstruction<VCVTSI2SS> {
 public:
-    VCVTSI2SS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VCVTSI2SS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VCVTSI2SD,
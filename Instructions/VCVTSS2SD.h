@@ -2,7 +2,7 @@
 
 class VCVTSS2SD : public CompilableInstruction<VCVTSS2SD> {
 public:
-    VCVTSS2SD(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VCVTSS2SD(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VCVTSS2SD,
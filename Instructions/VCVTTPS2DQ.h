@@ -2,7 +2,7 @@
 
 class VCVTTPS2DQ : public CompilableInstruction<VCVTTPS2DQ> {
 public:
-    VCVTTPS2DQ(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VCVTTPS2DQ(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VCVTTPS2DQ,
@@ -2,7 +2,7 @@
 
 class VCVTTSD2SI : public CompilableInstruction<VCVTTSD2SI> {
 public:
-    VCVTTSD2SI(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VCVTTSD2SI(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VCVTTSD2SI,
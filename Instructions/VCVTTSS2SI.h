@@ -2,7 +2,7 @@
 
 class VCVTTSS2SI : public CompilableInstruction<VCVTTSS2SI> {
 public:
-    VCVTTSS2SI(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VCVTTSS2SI(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VCVTTSS2SI,
@@ -3,7 +3,8 @@
 
 class VEXTRACTF128 : public CompilableInstruction<VEXTRACTF128> {
 public:
-    VEXTRACTF128(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VEXTRACTF128(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    static const bool crossesLanes = true;
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VEXTRACTF128,
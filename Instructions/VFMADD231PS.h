@@ -3,7 +3,7 @@
 
 class VFMADD231PS : public CompilableInstruction<VFMADD231PS> {
 public:
-    VFMADD231PS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VFMADD231PS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VFMADD231PS,
@@ -4,7 +4,7 @@
 
 class VFMSUB231PS : public CompilableInstruction<VFMSUB231PS> {
 public:
-    VFMSUB231PS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VFMSUB231PS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VFMSUB231PS,
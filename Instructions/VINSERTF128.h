@@ -3,7 +3,8 @@
 
 class VINSERTF128 : public CompilableInstruction<VINSERTF128> {
 public:
-    VINSERTF128(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VINSERTF128(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    static const bool crossesLanes = true;
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VINSERTF128,
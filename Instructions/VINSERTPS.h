@@ -4,7 +4,7 @@
 
 class VINSERTPS : public CompilableInstruction<VINSERTPS> {
 public:
-    VINSERTPS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VINSERTPS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VINSERTPS,
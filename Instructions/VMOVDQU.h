@@ -5,7 +5,7 @@
 
 class VMOVDQU : public CompilableInstruction<VMOVDQU> {
 public:
-    VMOVDQU(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VMOVDQU(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VMOVDQU,
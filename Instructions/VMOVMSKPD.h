@@ -2,7 +2,7 @@
 
 class VMOVMSKPD : public CompilableInstruction<VMOVMSKPD> {
 public:
-    VMOVMSKPD(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VMOVMSKPD(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VMOVMSKPD,
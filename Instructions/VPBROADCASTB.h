@@ -5,9 +5,7 @@
 
 class VPBROADCASTB : public CompilableInstruction<VPBROADCASTB> {
 public:
-    const uint32_t shufConst32 = 0x0;
-    const __m128 shufConst = _mm_set1_ps(*(float*)&shufConst32);
-    VPBROADCASTB(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VPBROADCASTB(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VPBROADCASTB,
@@ -43,10 +41,8 @@ private:
         } else {
             movq(operands[0].toEncoderOperand(upper), operands[1].toEncoderOperand(false));
         }
-        withFreeReg([&](xed_reg_enum_t tempReg) {
-            mov(tempReg, (uint64_t)&shufConst);
-            pshufb(operands[0].toEncoderOperand(upper), xed_mem_b(tempReg, 128));
-        });
+        // byte 0 to every byte
+        pshufb(operands[0].toEncoderOperand(upper), constant(_mm_setzero_si128()));
 
         if (operands[0].isXmm()) {
             zeroupperInternal(operands[0]);
@@ -1,10 +1,9 @@
 #include "Instruction.h"
 #include "Metadata.h"
-#include <unordered_set>
 
 class VPERM2F128 : public Instruction {
 public:
-    VPERM2F128(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : Instruction(rip, ilen, xedd) {}
+    VPERM2F128(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : Instruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VPERM2F128,
@@ -50,11 +49,13 @@ private:
         DEST[MAXVL-1:128] := 0
     FI
     */
-    std::vector<xed_encoder_request_t> const& compile(CompilationStrategy compilationStrategy, uint64_t returnAddr = 0) {
+    Requests const& compile(CompilationStrategy compilationStrategy, uint64_t returnAddr = 0) {
         internal_requests.clear();
 
         if (compilationStrategy == CompilationStrategy::DirectCall || compilationStrategy == CompilationStrategy::DirectCallPopRax) {
             rspOffset = -8;
+        } else {
+            rspOffset = 0;
         }
 
         uint8_t imm8 = operands[3].immValue();
@@ -79,7 +80,7 @@ private:
                     }
                     case 1:
                     {
-                        std::unordered_set<xed_reg_enum_t> regs = { operands[1].toXmmReg() };
+                        RegSet regs = { operands[1].toXmmReg() };
                         swap_in_upper_ymm(regs);
                         movups(xed_reg(tempReg), operands[1].toXmmReg());
                         swap_out_upper_ymm(regs);
@@ -99,7 +100,7 @@ private:
                         if (operands[2].isMemoryOperand()) {
                             movups(xed_reg(tempReg), operands[2].toEncoderOperand(true));
                         } else {
-                            std::unordered_set<xed_reg_enum_t> regs = { operands[2].toXmmReg() };
+                            RegSet regs = { operands[2].toXmmReg() };
                             swap_in_upper_ymm(regs);
                             movups(xed_reg(tempReg), operands[2].toXmmReg());
                             swap_out_upper_ymm(regs);
@@ -111,7 +112,7 @@ private:
 
             movups(operands[0].toXmmReg(), xed_reg(tempReg));
 
-            std::unordered_set<xed_reg_enum_t> tempRegs = { operands[0].toXmmReg(), tempReg };
+            RegSet tempRegs = { operands[0].toXmmReg(), tempReg };
             swap_in_upper_ymm(tempRegs);
             if (d) {
                 xorps(xed_reg(tempReg), xed_reg(tempReg));
@@ -124,7 +125,7 @@ private:
                     }
                     case 1:
                     {
-                        std::unordered_set<xed_reg_enum_t> regs = { operands[1].toXmmReg() };
+                        RegSet regs = { operands[1].toXmmReg() };
                         swap_in_upper_ymm(regs);
                         movups(xed_reg(tempReg), operands[1].toXmmReg());
                         swap_out_upper_ymm(regs);
@@ -144,7 +145,7 @@ private:
                         if (operands[2].isMemoryOperand()) {
                             movups(xed_reg(tempReg), operands[2].toEncoderOperand(true));
                         } else {
-                            std::unordered_set<xed_reg_enum_t> regs = { operands[2].toXmmReg() };
+                            RegSet regs = { operands[2].toXmmReg() };
                             swap_in_upper_ymm(regs);
                             movups(xed_reg(tempReg), operands[2].toXmmReg());
                             swap_out_upper_ymm(regs);
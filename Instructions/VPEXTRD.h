@@ -4,7 +4,7 @@
 
 class VPEXTRD : public CompilableInstruction<VPEXTRD> {
 public:
-    VPEXTRD(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VPEXTRD(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VPEXTRD,
@@ -4,7 +4,7 @@
 
 class VPEXTRQ : public CompilableInstruction<VPEXTRQ> {
 public:
-    VPEXTRQ(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VPEXTRQ(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VPEXTRQ,
@@ -5,7 +5,7 @@
 
 class VPMOVMSKB : public CompilableInstruction<VPMOVMSKB> {
 public:
-    VPMOVMSKB(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VPMOVMSKB(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VPMOVMSKB,
@@ -30,10 +30,10 @@ private:
             withFreeReg([&](xed_reg_enum_t tempReg) {
                 auto temp32 = to32bitGpr(tempReg);
                 pmovmskb(xed_reg(temp32), operands[1].toEncoderOperand(upper));
-                pushf();
+                saveFlags();
                 shl(xed_reg(temp32), xed_imm0(16, 8));
                 or_i(operands[0].toEncoderOperand(upper), xed_reg(temp32));
-                popf();
+                restoreFlags();
             });
         }
     }
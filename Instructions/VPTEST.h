@@ -2,7 +2,8 @@
 
 class VPTEST : public CompilableInstruction<VPTEST> {
 public:
-    VPTEST(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VPTEST(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    static const bool crossesLanes = true; // flags come from both lanes
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VPTEST,
@@ -2,7 +2,7 @@
 
 class VRSQRTSS : public CompilableInstruction<VRSQRTSS> {
 public:
-    VRSQRTSS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VRSQRTSS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VRSQRTSS,
@@ -3,7 +3,7 @@
 
 class VSQRTPS : public CompilableInstruction<VSQRTPS> {
 public:
-    VSQRTPS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VSQRTPS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VSQRTPS,
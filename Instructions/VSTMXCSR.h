@@ -3,7 +3,7 @@
 
 class VSTMXCSR : public CompilableInstruction<VSTMXCSR> {
 public:
-    VSTMXCSR(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VSTMXCSR(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VSTMXCSR,
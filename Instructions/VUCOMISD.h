@@ -3,7 +3,7 @@
 
 class VUCOMISD : public CompilableInstruction<VUCOMISD> {
 public:
-    VUCOMISD(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VUCOMISD(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VUCOMISD,
@@ -2,7 +2,7 @@
 
 class VUNPCKLPS : public CompilableInstruction<VUNPCKLPS> {
 public:
-    VUNPCKLPS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t xedd) : CompilableInstruction(rip, ilen, xedd) {}
+    VUNPCKLPS(uint64_t rip, uint8_t ilen, xed_decoded_inst_t const& xedd) : CompilableInstruction(rip, ilen, xedd) {}
 
     static const inline InstructionMetadata Metadata = {
         .iclass = XED_ICLASS_VUNPCKLPS,
@@ -0,0 +1,77 @@
+#include "FunctionStarts.h"
+
+#include <cstring>
+
+// DWARF pointer encodings used by .eh_frame_hdr
+static const uint8_t dwEhPeOmit = 0xff;
+static const uint8_t dwEhPeUdata4 = 0x03;
+static const uint8_t dwEhPeSdata4 = 0x0b;
+static const uint8_t dwEhPeUdata8 = 0x04;
+static const uint8_t dwEhPeSdata8 = 0x0c;
+static const uint8_t dwEhPeDatarel = 0x30;
+
+static size_t encoded_size(uint8_t encoding) {
+    switch (encoding & 0x0f) {
+        case dwEhPeUdata4:
+        case dwEhPeSdata4:
+            return 4;
+        case dwEhPeUdata8:
+        case dwEhPeSdata8:
+            return 8;
+    }
+    return 0;
+}
+
+bool ehFrameHdrFunctionStarts(const uint8_t* hdr, size_t size, std::vector<int64_t>& starts) {
+    if (size < 4 || hdr[0] != 1) {
+        return false;
+    }
+    uint8_t framePointerEncoding = hdr[1];
+    uint8_t countEncoding = hdr[2];
+    uint8_t tableEncoding = hdr[3];
+    if (framePointerEncoding == dwEhPeOmit || countEncoding == dwEhPeOmit || tableEncoding != (dwEhPeDatarel | dwEhPeSdata4)) {
+        return false;
+    }
+    size_t framePointerSize = encoded_size(framePointerEncoding);
+    size_t countSize = encoded_size(countEncoding);
+    if (framePointerSize == 0 || countSize == 0 || size < 4 + framePointerSize + countSize) {
+        return false;
+    }
+
+    uint64_t count = 0;
+    memcpy(&count, hdr + 4 + framePointerSize, countSize);
+    size_t table = 4 + framePointerSize + countSize;
+    // pairs of the function start and its FDE
+    if (count > (size - table) / 8) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        int32_t start;
+        memcpy(&start, hdr + table + i * 8, sizeof(start));
+        starts.push_back(start);
+    }
+    return true;
+}
+
+void machOFunctionStarts(const uint8_t* data, size_t size, std::vector<uint64_t>& starts) {
+    uint64_t address = 0;
+    size_t offset = 0;
+    while (offset < size) {
+        // ULEB128 deltas from the previous start, zero ends the list
+        uint64_t delta = 0;
+        int shift = 0;
+        while (offset < size && shift < 64) {
+            uint8_t byte = data[offset++];
+            delta |= (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        if (delta == 0) {
+            break;
+        }
+        address += delta;
+        starts.push_back(address);
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Function starts are known instruction starts the VEX scanner decodes from.
+// Both readers only look at the bytes they are given, so they work on loaded
+// images and on files alike.
+
+// Appends the start of every function in the binary search table of an
+// .eh_frame_hdr section, relative to the start of the section. False if the
+// table is missing or in an encoding other than the one linkers write.
+bool ehFrameHdrFunctionStarts(const uint8_t* hdr, size_t size, std::vector<int64_t>& starts);
+
+// Appends the start of every function in the data of an LC_FUNCTION_STARTS
+// load command, relative to the start of the __TEXT segment
+void machOFunctionStarts(const uint8_t* data, size_t size, std::vector<uint64_t>& starts);
@@ -0,0 +1,221 @@
+#include "ImageScanner.h"
+#include "FunctionStarts.h"
+#include "../Instructions/Instructions.h"
+#include "../utils.h"
+#include <chrono>
+#include <cstring>
+#include <dlfcn.h>
+#include <vector>
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#include <mach-o/loader.h>
+#else
+#include <link.h>
+#endif
+
+#ifndef MH_DYLIB_IN_CACHE
+#define MH_DYLIB_IN_CACHE 0x80000000
+#endif
+
+ScanStats& ScanStats::operator+=(ScanStats const& other) {
+    images += other.images;
+    bytesScanned += other.bytesScanned;
+    sitesFound += other.sitesFound;
+    sitesPatched += other.sitesPatched;
+    sitesSkipped += other.sitesSkipped;
+    sitesUnconfirmed += other.sitesUnconfirmed;
+    milliseconds += other.milliseconds;
+    return *this;
+}
+
+void ScanStats::print(const char* what) const {
+    debug_print("PID %d: %s: %llu images, %llu KB of code, %llu sites found, %llu patched, %llu skipped, %llu unconfirmed in %.2f ms\n",
+        getpid(), what, images, bytesScanned / 1024, sitesFound, sitesPatched, sitesSkipped, sitesUnconfirmed, milliseconds);
+}
+
+static void scanner_marker() {}
+
+// Our own code is never translated
+static bool is_own_code(CodeRange const& range) {
+    auto self = (uint8_t*)&scanner_marker;
+    return self >= range.begin && self < range.end;
+}
+
+#ifdef __APPLE__
+static void collect_image_code(const struct mach_header* header, intptr_t slide, ImageCode& image) {
+    // system libraries in the shared cache are not compiled for AVX and are mapped read-only
+    if (header->magic != MH_MAGIC_64 || (header->flags & MH_DYLIB_IN_CACHE)) {
+        return;
+    }
+
+    const struct segment_command_64* text = nullptr;
+    const struct segment_command_64* linkedit = nullptr;
+    const struct linkedit_data_command* functionStarts = nullptr;
+    auto cmd = (const struct load_command*)((const struct mach_header_64*)header + 1);
+    for (uint32_t i = 0; i < header->ncmds; i++) {
+        if (cmd->cmd == LC_FUNCTION_STARTS) {
+            functionStarts = (const struct linkedit_data_command*)cmd;
+        }
+        if (cmd->cmd == LC_SEGMENT_64) {
+            auto segment = (const struct segment_command_64*)cmd;
+            if (strcmp(segment->segname, SEG_TEXT) == 0) {
+                text = segment;
+            } else if (strcmp(segment->segname, SEG_LINKEDIT) == 0) {
+                linkedit = segment;
+            }
+            auto sections = (const struct section_64*)(segment + 1);
+            for (uint32_t j = 0; j < segment->nsects; j++) {
+                // __TEXT also holds constants and strings, only sweep sections with code
+                if (sections[j].flags & (S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS)) {
+                    auto begin = (uint8_t*)(sections[j].addr + slide);
+                    image.ranges.push_back({ begin, begin + sections[j].size });
+                }
+            }
+        }
+        cmd = (const struct load_command*)((const uint8_t*)cmd + cmd->cmdsize);
+    }
+
+    if (text != nullptr && linkedit != nullptr && functionStarts != nullptr && functionStarts->dataoff >= linkedit->fileoff) {
+        auto data = (const uint8_t*)(linkedit->vmaddr + slide + (functionStarts->dataoff - linkedit->fileoff));
+        std::vector<uint64_t> starts;
+        machOFunctionStarts(data, functionStarts->datasize, starts);
+        for (auto start : starts) {
+            image.functionStarts.push_back((uint8_t*)(text->vmaddr + slide + start));
+        }
+    }
+}
+
+static std::vector<ImageCode> loaded_images() {
+    std::vector<ImageCode> images;
+    for (uint32_t i = 0; i < _dyld_image_count(); i++) {
+        images.emplace_back();
+        collect_image_code(_dyld_get_image_header(i), _dyld_get_image_vmaddr_slide(i), images.back());
+    }
+    return images;
+}
+#else
+static int collect_image_code(struct dl_phdr_info* info, size_t size, void* data) {
+    auto images = (std::vector<ImageCode>*)data;
+    auto image = &images->emplace_back();
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        auto const& phdr = info->dlpi_phdr[i];
+        // without section headers in memory the whole executable segment is swept
+        if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X)) {
+            auto begin = (uint8_t*)(info->dlpi_addr + phdr.p_vaddr);
+            image->ranges.push_back({ begin, begin + phdr.p_memsz });
+        }
+        // the unwind table lists every function with unwind info, which is nearly all of them
+        if (phdr.p_type == PT_GNU_EH_FRAME) {
+            auto hdr = (const uint8_t*)(info->dlpi_addr + phdr.p_vaddr);
+            std::vector<int64_t> starts;
+            if (ehFrameHdrFunctionStarts(hdr, phdr.p_memsz, starts)) {
+                for (auto start : starts) {
+                    image->functionStarts.push_back((uint8_t*)hdr + start);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static std::vector<ImageCode> loaded_images() {
+    std::vector<ImageCode> images;
+    dl_iterate_phdr(&collect_image_code, &images);
+    return images;
+}
+#endif
+
+bool ImageScanner::claimRange(CodeRange const& range) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return scannedRanges.insert({ (uint64_t)range.begin, (uint64_t)range.end }).second;
+}
+
+ScanStats ImageScanner::scanRange(uint8_t* begin, uint8_t* end, std::vector<uint8_t*> const& functionStarts) {
+    ScanStats stats;
+    auto start = std::chrono::steady_clock::now();
+
+    auto handle = [&](uint8_t* site) {
+        stats.sitesFound++;
+        if (handler(site)) {
+            stats.sitesPatched++;
+        } else {
+            stats.sitesSkipped++;
+        }
+    };
+
+    if (finder) {
+        for (auto site : finder(begin, end)) {
+            handle(site);
+        }
+    } else {
+        vexScanner.scan(begin, end, [&](uint8_t* site, xed_decoded_inst_t const& xedd, bool confirmed) {
+            if (!iclassMapping.contains(xed_decoded_inst_get_iclass(&xedd))) {
+                return;
+            }
+            if (confirmed) {
+                handle(site);
+            } else {
+                stats.sitesUnconfirmed++;
+            }
+        }, functionStarts);
+    }
+
+    stats.bytesScanned = end - begin;
+    stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+ScanStats ImageScanner::scanImage(ImageCode const& image) {
+    ScanStats stats;
+    for (auto const& range : image.ranges) {
+        if (is_own_code(range) || !claimRange(range)) {
+            continue;
+        }
+        stats += scanRange(range.begin, range.end, image.functionStarts);
+        stats.images = 1;
+    }
+    return stats;
+}
+
+ScanStats ImageScanner::scanLoadedImages() {
+    ScanStats stats;
+    for (auto const& image : loaded_images()) {
+        stats += scanImage(image);
+    }
+    return stats;
+}
+
+static ImageScanner* watchingScanner = nullptr;
+
+#ifdef __APPLE__
+static void on_image_added(const struct mach_header* header, intptr_t slide) {
+    ImageCode image;
+    collect_image_code(header, slide, image);
+    auto stats = watchingScanner->scanImage(image);
+    if (stats.images > 0) {
+        stats.print("Eager scan of a new image");
+    }
+}
+
+void ImageScanner::watchNewImages() {
+    watchingScanner = this;
+    // dyld calls back for every image that is already loaded as well
+    _dyld_register_func_for_add_image(&on_image_added);
+}
+#else
+void ImageScanner::watchNewImages() {
+    scanLoadedImages().print("Eager scan of loaded images");
+    watchingScanner = this;
+}
+
+// There is no image load notification on Linux, so dlopen is interposed instead
+extern "C" void* dlopen(const char* filename, int flags) {
+    static auto real_dlopen = (void* (*)(const char*, int))dlsym(RTLD_NEXT, "dlopen");
+    void* handle = real_dlopen(filename, flags);
+    if (handle != nullptr && watchingScanner != nullptr) {
+        watchingScanner->scanLoadedImages().print("Eager scan of new images");
+    }
+    return handle;
+}
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "VexScanner.h"
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+struct ScanStats {
+    uint64_t images = 0;
+    uint64_t bytesScanned = 0;
+    uint64_t sitesFound = 0;
+    uint64_t sitesPatched = 0;
+    uint64_t sitesSkipped = 0;
+    // sites whose instruction boundary couldn't be confirmed, left to trap
+    uint64_t sitesUnconfirmed = 0;
+    double milliseconds = 0;
+
+    ScanStats& operator+=(ScanStats const& other);
+    void print(const char* what) const;
+};
+
+struct CodeRange {
+    uint8_t* begin;
+    uint8_t* end;
+};
+
+struct ImageCode {
+    std::vector<CodeRange> ranges;
+    // sorted, from the unwind info or the function starts of the image
+    std::vector<uint8_t*> functionStarts;
+};
+
+// Walks the code of loaded images and hands every VEX-encoded instruction
+// we know how to translate to a site handler, which returns true if it patched the site.
+// Only sites the VEX scanner confirmed from a function start are handed over,
+// a byte sequence that merely looks like an instruction is never patched.
+class ImageScanner {
+public:
+    using SiteHandler = std::function<bool(uint8_t* site)>;
+    // Lists the sites of a code range instead of sweeping it for VEX instructions
+    using SiteFinder = std::function<std::vector<uint8_t*>(uint8_t* begin, uint8_t* end)>;
+
+private:
+    SiteHandler handler;
+    SiteFinder finder;
+    VexScanner vexScanner;
+    // code ranges scanned so far
+    std::set<std::pair<uint64_t, uint64_t>> scannedRanges;
+    std::mutex mutex;
+
+    bool claimRange(CodeRange const& range);
+
+public:
+    ImageScanner(SiteHandler handler, SiteFinder finder = nullptr)
+    : handler(handler)
+    , finder(finder)
+    {}
+
+    // Calls the handler for every supported VEX instruction in [begin, end) reached from
+    // one of the function starts, or every site the finder lists
+    ScanStats scanRange(uint8_t* begin, uint8_t* end, std::vector<uint8_t*> const& functionStarts = {});
+    // Scans the code of one image, skipping ranges that were scanned before
+    ScanStats scanImage(ImageCode const& image);
+    // Scans the images that are loaded right now and were not scanned before
+    ScanStats scanLoadedImages();
+    // Scans loaded images and keeps scanning images as they are loaded later
+    void watchNewImages();
+};
@@ -0,0 +1,186 @@
+#include "VexScanner.h"
+#include <algorithm>
+#include <cstring>
+#include <immintrin.h>
+
+VexScanStats& VexScanStats::operator+=(VexScanStats const& other) {
+    bytesScanned += other.bytesScanned;
+    candidates += other.candidates;
+    confirmed += other.confirmed;
+    hints += other.hints;
+    return *this;
+}
+
+VexScanner::Kernel VexScanner::bestKernel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return Kernel::AVX2;
+    }
+    return Kernel::SSE2;
+}
+
+const char* VexScanner::kernelName(Kernel kernel) {
+    switch (kernel) {
+        case Kernel::Scalar: return "scalar";
+        case Kernel::SSE2: return "SSE2";
+        case Kernel::AVX2: return "AVX2";
+    }
+    return "unknown";
+}
+
+// C4 and C5 differ only in the lowest bit
+static bool is_vex_escape(uint8_t byte) {
+    return (byte & 0xfe) == 0xc4;
+}
+
+static const uint8_t* find_candidates_scalar(const uint8_t* begin, const uint8_t* p, const uint8_t* end, std::vector<uint32_t>& offsets) {
+    for (; p < end; p++) {
+        if (is_vex_escape(*p)) {
+            offsets.push_back(p - begin);
+        }
+    }
+    return p;
+}
+
+static void push_mask(uint32_t mask, uint32_t offset, std::vector<uint32_t>& offsets) {
+    while (mask != 0) {
+        offsets.push_back(offset + __builtin_ctz(mask));
+        mask &= mask - 1;
+    }
+}
+
+static const uint8_t* find_candidates_sse2(const uint8_t* begin, const uint8_t* p, const uint8_t* end, std::vector<uint32_t>& offsets) {
+    const __m128i escape = _mm_set1_epi8((char)0xc4);
+    const __m128i lowBit = _mm_set1_epi8((char)0xfe);
+    for (; p + 16 <= end; p += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+        __m128i match = _mm_cmpeq_epi8(_mm_and_si128(bytes, lowBit), escape);
+        push_mask(_mm_movemask_epi8(match), p - begin, offsets);
+    }
+    return p;
+}
+
+__attribute__((target("avx2")))
+static const uint8_t* find_candidates_avx2(const uint8_t* begin, const uint8_t* p, const uint8_t* end, std::vector<uint32_t>& offsets) {
+    const __m256i escape = _mm256_set1_epi8((char)0xc4);
+    const __m256i lowBit = _mm256_set1_epi8((char)0xfe);
+    for (; p + 32 <= end; p += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)p);
+        __m256i match = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, lowBit), escape);
+        push_mask(_mm256_movemask_epi8(match), p - begin, offsets);
+    }
+    return p;
+}
+
+void VexScanner::findCandidates(const uint8_t* begin, const uint8_t* end, std::vector<uint32_t>& offsets) const {
+    const uint8_t* p = begin;
+    switch (kernel) {
+        case Kernel::AVX2: p = find_candidates_avx2(begin, p, end, offsets); break;
+        case Kernel::SSE2: p = find_candidates_sse2(begin, p, end, offsets); break;
+        case Kernel::Scalar: break;
+    }
+    find_candidates_scalar(begin, p, end, offsets);
+}
+
+static bool decode(const uint8_t* p, const uint8_t* end, xed_decoded_inst_t* xedd) {
+    xed_decoded_inst_zero(xedd);
+    xed_decoded_inst_set_mode(xedd, XED_MACHINE_MODE_LONG_64, XED_ADDRESS_WIDTH_64b);
+    uint32_t length = std::min<uint64_t>(15, end - p);
+    return xed_decode(xedd, p, length) == XED_ERROR_NONE;
+}
+
+// Candidates are searched a block at a time so the offsets stay small
+static const uint64_t candidateBlockSize = 64 << 10;
+// How far before a candidate decoding starts when nothing near it was decoded yet.
+// Instruction boundaries resynchronize within a few instructions, usually.
+static const uint64_t syncWindow = 32;
+
+struct FoundSite {
+    uint8_t* site;
+    uint8_t length;
+    bool confirmed;
+    uint8_t bytes[15];
+};
+
+VexScanStats VexScanner::scan(uint8_t* begin, uint8_t* end, SiteHandler const& handler, std::vector<uint8_t*> const& anchors) const {
+    VexScanStats stats;
+    stats.bytesScanned = end - begin;
+
+    // the handler patches code, so boundaries are all found before it runs
+    std::vector<FoundSite> sites;
+    std::vector<uint32_t> offsets;
+    // everything below this was decoded already, instruction by instruction
+    uint8_t* decodedUntil = begin;
+    // decodedUntil was reached from an anchor without a decode error
+    bool synced = false;
+    auto anchor = std::lower_bound(anchors.begin(), anchors.end(), begin);
+    for (uint8_t* block = begin; block < end; block += std::min<uint64_t>(candidateBlockSize, end - block)) {
+        uint8_t* blockEnd = block + std::min<uint64_t>(candidateBlockSize, end - block);
+        offsets.clear();
+        findCandidates(block, blockEnd, offsets);
+        stats.candidates += offsets.size();
+
+        for (auto offset : offsets) {
+            uint8_t* candidate = block + offset;
+            if (candidate < decodedUntil) {
+                // inside an instruction we already decoded
+                continue;
+            }
+
+            uint8_t* known = nullptr;
+            while (anchor != anchors.end() && *anchor <= candidate) {
+                known = *anchor++;
+            }
+
+            // walk up to the candidate to make sure it starts an instruction
+            uint8_t* p;
+            if (known != nullptr && known >= decodedUntil) {
+                p = known;
+                synced = true;
+            } else if (synced) {
+                p = decodedUntil;
+            } else {
+                p = candidate - std::min<uint64_t>(syncWindow, candidate - decodedUntil);
+            }
+            xed_decoded_inst_t xedd;
+            while (p < candidate) {
+                if (decode(p, end, &xedd)) {
+                    p += xed_decoded_inst_get_length(&xedd);
+                } else {
+                    p++;
+                    synced = false;
+                }
+            }
+            decodedUntil = p;
+            if (p != candidate) {
+                continue;
+            }
+            if (!decode(candidate, end, &xedd)) {
+                synced = false;
+                continue;
+            }
+
+            FoundSite found = { candidate, (uint8_t)xed_decoded_inst_get_length(&xedd), synced };
+            memcpy(found.bytes, candidate, found.length);
+            sites.push_back(found);
+            if (synced) {
+                stats.confirmed++;
+            } else {
+                stats.hints++;
+            }
+            decodedUntil = candidate + found.length;
+        }
+    }
+
+    for (auto const& found : sites) {
+        // patched over by the handler of an earlier site
+        if (memcmp(found.site, found.bytes, found.length) != 0) {
+            continue;
+        }
+        xed_decoded_inst_t xedd;
+        decode(found.site, end, &xedd);
+        handler(found.site, xedd, found.confirmed);
+    }
+
+    return stats;
+}
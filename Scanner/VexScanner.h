@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+extern "C" {
+#include <xed/xed-interface.h>
+}
+
+struct VexScanStats {
+    uint64_t bytesScanned = 0;
+    uint64_t candidates = 0;
+    // sites decoded linearly from a known instruction start
+    uint64_t confirmed = 0;
+    // sites found by decoding a few bytes before the candidate only
+    uint64_t hints = 0;
+
+    VexScanStats& operator+=(VexScanStats const& other);
+};
+
+// Finds VEX-encoded instructions in code without decoding at every offset.
+// C4/C5 bytes are located with SIMD compares, then each candidate is confirmed
+// with a single decode and rejected if it lies inside an instruction that
+// was already decoded.
+//
+// Decoding from a few bytes before a candidate usually lands on the right
+// instruction boundary, but not always: a C4/C5 inside an immediate or a
+// displacement can decode as a VEX instruction of its own. A site is only
+// confirmed when it was reached by decoding instruction by instruction from
+// a known instruction start, like a function start from the symbols or the
+// unwind info, anything else is a hint.
+class VexScanner {
+public:
+    enum class Kernel {
+        Scalar,
+        SSE2,
+        AVX2,
+    };
+
+    using SiteHandler = std::function<void(uint8_t* site, xed_decoded_inst_t const& xedd, bool confirmed)>;
+
+private:
+    Kernel kernel;
+
+public:
+    VexScanner(Kernel kernel = bestKernel())
+    : kernel(kernel)
+    {}
+
+    // The widest kernel the host CPU supports
+    static Kernel bestKernel();
+    static const char* kernelName(Kernel kernel);
+
+    // Appends the offsets from begin of every C4/C5 byte in [begin, end)
+    void findCandidates(const uint8_t* begin, const uint8_t* end, std::vector<uint32_t>& offsets) const;
+
+    // Calls the handler for every VEX instruction in address order. Anchors are
+    // known instruction starts, sorted. Every site is found before the first
+    // handler call, so the handler may patch it; sites whose bytes changed by
+    // then are skipped.
+    VexScanStats scan(uint8_t* begin, uint8_t* end, SiteHandler const& handler, std::vector<uint8_t*> const& anchors = {}) const;
+};
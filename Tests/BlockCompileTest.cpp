@@ -0,0 +1,166 @@
+#include "Harness.h"
+#include "TestCompiler.h"
+
+#include <cstdio>
+#include <functional>
+#include <memory>
+
+#include "TestMetadata.h"
+#include "../Compiler/Compiler.h"
+#include "../memmanager.h"
+#include "xed/xed-iform-enum.h"
+
+// Reports what the block-level passes of the Compiler save and checks blocks compiled
+// with them against native execution:
+// - blocks of blockLength copies of every YMM form in the test metadata, with every
+//   instruction lowered on its own and with the block-level passes over the whole block
+// - a block mixing all lane-local register forms
+// - a block mixing scalar register forms, with and without known-zero upper tracking
+// Block level, only the registers the harness compares are live after the block, so
+// the rest are scratch registers that need no spill.
+
+static const size_t blockLength = 8;
+static const uint32_t iterations = 10000;
+
+InstructionMetadata scalarBlock[] = {
+    VADDSS::Metadata,
+    VMULSD::Metadata,
+    VCVTSI2SD::Metadata,
+    VSUBSS::Metadata,
+    VDIVSD::Metadata,
+    VCVTSS2SD::Metadata,
+    VMAXSS::Metadata,
+    VMINSD::Metadata,
+    VCVTSD2SS::Metadata,
+    VADDSD::Metadata,
+    VMULSS::Metadata,
+    VCVTSI2SS::Metadata,
+};
+
+// The options get what the harness compares after the block
+using CompilerOptions = std::function<void(Compiler&, LiveState const&)>;
+
+static std::shared_ptr<Instruction> translate(ThunkRequest const& request) {
+    auto xedd = populateDecodedInst(request.instructionRequest);
+    return iclassMapping.factory(request.iclass)(0, 0, xedd);
+}
+
+static bool isRegisterForm(ThunkRequest const& request) {
+    auto xedd = populateDecodedInst(request.instructionRequest);
+    return xed_decoded_inst_number_of_memory_operands(&xedd) == 0;
+}
+
+static LiveState comparedState(std::vector<ThunkRequest> const& block) {
+    LiveState compared;
+    compared.flags = Liveness::arithmeticFlags();
+    for (auto const& request : block) {
+        for (auto reg : request.usedRegisters) {
+            compared.insert(reg);
+        }
+    }
+    return compared;
+}
+
+static size_t emittedInstructions(std::vector<ThunkRequest> const& block, CompilerOptions const& options) {
+    Compiler compiler;
+    options(compiler, comparedState(block));
+    for (auto const& request : block) {
+        compiler.addInstruction(translate(request));
+    }
+    return compiler.compile(CompilationStrategy::DirectCall, 0).size();
+}
+
+// The register forms all allocate from the first free register up, so they read each other's results
+static TestThunk compileBlock(std::vector<ThunkRequest> const& block, CompilerOptions const& options) {
+    std::vector<xed_encoder_request_t> nativeRequests;
+    std::unordered_set<xed_reg_enum_t> usedRegisters;
+    Compiler translated;
+    options(translated, comparedState(block));
+    for (auto const& request : block) {
+        nativeRequests.push_back(request.instructionRequest);
+        usedRegisters.insert(request.usedRegisters.begin(), request.usedRegisters.end());
+        translated.addInstruction(translate(request));
+    }
+    nativeRequests.push_back(inst0(XED_ICLASS_RET_NEAR, 64));
+    uint32_t olen;
+    auto translatedThunk = translated.encode(CompilationStrategy::DirectCall, &olen, 0);
+
+    auto xedd = populateDecodedInst(block[0].instructionRequest);
+    return TestThunk(xed_decoded_inst_get_iform_enum(&xedd), usedRegisters, TempMemory(XED_REG_INVALID),
+        TestCompiler::compileRequests(nativeRequests), translatedThunk);
+}
+
+static bool checkBlock(const char* name, std::vector<ThunkRequest> const& block, CompilerOptions const& options) {
+    printf("%s: %zu instructions, ", name, block.size());
+    auto thunk = compileBlock(block, options);
+    Harness harness(thunk);
+    printf("%zu emitted, %lu cycles\n", emittedInstructions(block, options),
+        harness.measureCycles(thunk.compiledTranslatedThunk, true, iterations));
+    if (harness.runTests().printResult()) {
+        printf("%s differs from native execution\n", name);
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    xed_tables_init();
+    init_ymm_storage();
+
+    auto perInstruction = [](Compiler& compiler, LiveState const&) {
+        compiler.setLaneCoalescing(false);
+        compiler.setZeroUpperTracking(false);
+        compiler.setPeephole(false);
+        compiler.setFlagLiveness(false);
+        compiler.setRegisterLiveness(false);
+    };
+    // as if the code after the block overwrote everything the harness doesn't compare
+    auto blockLevel = [](Compiler& compiler, LiveState const& compared) {
+        compiler.setLiveOut(compared);
+    };
+
+    size_t totalBefore = 0;
+    size_t totalAfter = 0;
+    std::vector<ThunkRequest> laneLocalBlock;
+
+    printf("%-40s %8s %8s  (block of %zu)\n", "", "before", "after", blockLength);
+    for (auto metadata : tests) {
+        TestCompiler compiler(metadata);
+        for (auto const& request : compiler.generateInstructions()) {
+            auto instruction = translate(request);
+            if (instruction->upperLaneRegs().empty()) {
+                continue;
+            }
+
+            std::vector<ThunkRequest> copies(blockLength, request);
+            size_t before = emittedInstructions(copies, perInstruction);
+            size_t after = emittedInstructions(copies, blockLevel);
+            printf("%-40s %8zu %8zu%s\n", xed_iform_enum_t2str(instruction->getIform()), before, after,
+                instruction->isLaneLocal() ? "" : "  (crosses lanes)");
+            totalBefore += before;
+            totalAfter += after;
+
+            if (instruction->isLaneLocal() && isRegisterForm(request)) {
+                laneLocalBlock.push_back(request);
+            }
+        }
+    }
+    printf("%-40s %8zu %8zu\n\n", "total", totalBefore, totalAfter);
+
+    std::vector<ThunkRequest> scalars;
+    for (auto metadata : scalarBlock) {
+        TestCompiler compiler(metadata);
+        for (auto const& request : compiler.generateInstructions()) {
+            if (isRegisterForm(request)) {
+                scalars.push_back(request);
+            }
+        }
+    }
+
+    bool passed = checkBlock("Lane-local block, per instruction", laneLocalBlock, perInstruction);
+    passed = checkBlock("Lane-local block, block level", laneLocalBlock, blockLevel) && passed;
+    passed = checkBlock("Scalar block, per instruction", scalars, perInstruction) && passed;
+    passed = checkBlock("Scalar block, block level", scalars, blockLevel) && passed;
+
+    return passed ? 0 : 1;
+}
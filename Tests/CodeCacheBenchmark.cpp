@@ -0,0 +1,164 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "ProcessStats.h"
+#include "../memmanager.h"
+
+// Allocates and fills chunks the size translated sites usually compile to, once
+// with a mapping per chunk as alloc_executable used to and once from the code
+// cache, and compares mappings, resident memory and chunks per page. Then frees
+// every other chunk and checks the cache reuses them instead of growing.
+
+static const uint32_t numChunks = 20000;
+
+static uint64_t chunkSize(uint32_t i) {
+    // 40 to 360 bytes
+    return 40 + (i * 37) % 321;
+}
+
+static uint8_t* mapChunk(uint64_t size) {
+    auto memory = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, -1, 0);
+    return memory == MAP_FAILED ? nullptr : memory;
+}
+
+struct Measurement {
+    uint64_t vmas;
+    int64_t rssKb;
+    double nanoseconds;
+};
+
+template<typename Alloc, typename Seal>
+static Measurement measure(std::vector<uint8_t*>& chunks, Alloc alloc, Seal seal) {
+    auto vmasBefore = vmaCount();
+    auto rssBefore = rssKb();
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < numChunks; i++) {
+        auto chunk = alloc(chunkSize(i));
+        if (chunk == nullptr) {
+            printf("Out of memory after %u chunks\n", i);
+            exit(1);
+        }
+        memset(code_cache_writable(chunk), 0xcc, chunkSize(i));
+        seal(chunk, chunkSize(i));
+        chunks.push_back(chunk);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return {vmaCount() - vmasBefore, (int64_t)rssKb() - (int64_t)rssBefore, elapsed.count() / numChunks};
+}
+
+static void writeChunk(uint8_t* chunk, uint64_t size) {
+    memset(code_cache_writable(chunk), 0xcc, size);
+    write_protect_memory(chunk, size);
+}
+
+// Frees chunks on two sealed pages with a sealed page between them and carves
+// them again in the given order, writing to a page left sealed crashes
+static bool checkSealedReuse(bool lowerFirst) {
+    uint64_t quarter = sysconf(_SC_PAGESIZE) / 4;
+    std::vector<uint8_t*> chunks;
+    for (int i = 0; i < 17; i++) {
+        chunks.push_back(alloc_executable(quarter));
+        writeChunk(chunks.back(), quarter);
+    }
+    // two neighbours on the second page and one on the fourth, sized so each is only the best fit for one request
+    free_executable(chunks[4], quarter);
+    free_executable(chunks[5], quarter);
+    free_executable(chunks[12], quarter);
+    uint64_t sizes[2] = { 2 * quarter, quarter };
+    uint8_t* expected[2] = { chunks[4], chunks[12] };
+    if (!lowerFirst) {
+        std::swap(sizes[0], sizes[1]);
+        std::swap(expected[0], expected[1]);
+    }
+    // both are carved before either is written, as by two translating threads
+    bool passed = true;
+    uint8_t* carved[2];
+    for (int i = 0; i < 2; i++) {
+        carved[i] = alloc_executable(sizes[i]);
+        if (carved[i] != expected[i]) {
+            printf("Freed chunk %p is not reused, got %p\n", expected[i], carved[i]);
+            passed = false;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        writeChunk(carved[i], sizes[i]);
+        free_executable(carved[i], sizes[i]);
+    }
+    for (int i = 0; i < 17; i++) {
+        if (i != 4 && i != 5 && i != 12) {
+            free_executable(chunks[i], quarter);
+        }
+    }
+    return passed;
+}
+
+int main() {
+    std::vector<uint8_t*> mapped;
+    auto perChunk = measure(mapped, mapChunk, [](uint8_t* chunk, uint64_t size) {
+        mprotect(chunk, size, PROT_READ | PROT_EXEC);
+    });
+    for (uint32_t i = 0; i < numChunks; i++) {
+        munmap(mapped[i], chunkSize(i));
+    }
+
+    std::vector<uint8_t*> cached;
+    auto cache = measure(cached, alloc_executable, write_protect_memory);
+
+    code_cache_stats stats;
+    get_code_cache_stats(&stats);
+    printf("%-10s %10s %10s %14s %10s\n", "", "mappings", "RSS kB", "chunks/page", "ns/chunk");
+    printf("%-10s %10lu %10ld %14.1f %10.1f\n", "mmap", perChunk.vmas, perChunk.rssKb, 1.0, perChunk.nanoseconds);
+    printf("%-10s %10lu %10ld %14.1f %10.1f\n", "slabs", cache.vmas, cache.rssKb, (double)stats.chunks / stats.usedPages, cache.nanoseconds);
+
+    bool passed = true;
+    for (uint32_t i = 0; i < numChunks; i++) {
+        if ((uint64_t)cached[i] % 64 != 0) {
+            printf("Chunk %u is not cache line aligned\n", i);
+            passed = false;
+            break;
+        }
+    }
+
+    // freed chunks are handed out again before the cache grows
+    auto slabsBefore = stats.slabs;
+    auto usedBefore = stats.usedPages;
+    for (uint32_t i = 0; i < numChunks; i += 2) {
+        free_executable(cached[i], chunkSize(i));
+    }
+    for (uint32_t i = 0; i < numChunks; i += 2) {
+        cached[i] = alloc_executable(chunkSize(i));
+        memset(code_cache_writable(cached[i]), 0x90, chunkSize(i));
+        write_protect_memory(cached[i], chunkSize(i));
+    }
+    get_code_cache_stats(&stats);
+    if (stats.slabs != slabsBefore || stats.usedPages != usedBefore) {
+        printf("Freed chunks are not reused: %lu slabs and %lu pages before, %lu and %lu after\n", slabsBefore, usedBefore, stats.slabs, stats.usedPages);
+        passed = false;
+    }
+
+    // neighbouring free chunks merge, so once everything is freed the slabs are empty
+    // and hold chunks bigger than any of the freed ones
+    for (uint32_t i = 0; i < numChunks; i++) {
+        free_executable(cached[i], chunkSize(i));
+    }
+    auto big = alloc_executable(32 << 10);
+    memset(code_cache_writable(big), 0xcc, 32 << 10);
+    write_protect_memory(big, 32 << 10);
+    get_code_cache_stats(&stats);
+    if (stats.slabs != slabsBefore || stats.usedPages != (32 << 10) / (uint64_t)sysconf(_SC_PAGESIZE)) {
+        printf("Freed chunks are not merged: %lu slabs and %lu pages for one 32 KB chunk\n", stats.slabs, stats.usedPages);
+        passed = false;
+    }
+
+    // chunks reused below the sealed pages leave every page they unseal writable
+    passed = checkSealedReuse(true) && checkSealedReuse(false) && passed;
+
+    printCodeCacheStats();
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+#include "TestCompiler.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "../Compiler/DirectEmitter.h"
+
+// Encodes the forms the DirectEmitter covers with it and with xed_encode, checks the
+// bytes are identical and decode back to the same instruction, and compares the
+// translation latency per iclass.
+
+static const uint32_t rounds = 1000;
+
+static const xed_state_t dstate = {.mmode = XED_MACHINE_MODE_LONG_64,
+                                   .stack_addr_width = XED_ADDRESS_WIDTH_64b};
+
+static const xed_iclass_enum_t sseIclasses[] = {
+    XED_ICLASS_MOVUPS, XED_ICLASS_MOVUPD, XED_ICLASS_MOVAPS, XED_ICLASS_MOVAPD, XED_ICLASS_MOVDQU, XED_ICLASS_MOVDQA,
+    XED_ICLASS_ANDPS, XED_ICLASS_ANDPD, XED_ICLASS_ANDNPS, XED_ICLASS_ANDNPD, XED_ICLASS_ORPS, XED_ICLASS_ORPD,
+    XED_ICLASS_XORPS, XED_ICLASS_XORPD, XED_ICLASS_ADDPS, XED_ICLASS_ADDPD, XED_ICLASS_ADDSS, XED_ICLASS_ADDSD,
+    XED_ICLASS_MULPS, XED_ICLASS_MULPD, XED_ICLASS_MULSS, XED_ICLASS_MULSD, XED_ICLASS_SUBPS, XED_ICLASS_SUBPD,
+    XED_ICLASS_SUBSS, XED_ICLASS_SUBSD, XED_ICLASS_DIVSS, XED_ICLASS_DIVSD, XED_ICLASS_UNPCKLPS, XED_ICLASS_UNPCKHPS,
+    XED_ICLASS_PCMPGTB, XED_ICLASS_PCMPGTW, XED_ICLASS_PCMPGTD, XED_ICLASS_PCMPEQB, XED_ICLASS_PCMPEQW, XED_ICLASS_PCMPEQD,
+    XED_ICLASS_PADDB, XED_ICLASS_PADDW, XED_ICLASS_PADDD, XED_ICLASS_PADDQ, XED_ICLASS_PSUBB, XED_ICLASS_PSUBW,
+    XED_ICLASS_PSUBD, XED_ICLASS_PSUBQ, XED_ICLASS_PAND, XED_ICLASS_PANDN, XED_ICLASS_POR, XED_ICLASS_PXOR,
+};
+
+static const xed_reg_enum_t bases[] = {
+    XED_REG_RAX, XED_REG_RCX, XED_REG_RDX, XED_REG_RBX, XED_REG_RSP, XED_REG_RBP, XED_REG_RSI, XED_REG_RDI,
+    XED_REG_R8, XED_REG_R9, XED_REG_R10, XED_REG_R11, XED_REG_R12, XED_REG_R13, XED_REG_R14, XED_REG_R15,
+};
+
+static bool hasStore(xed_iclass_enum_t iclass) {
+    switch (iclass) {
+        case XED_ICLASS_MOVUPS:
+        case XED_ICLASS_MOVUPD:
+        case XED_ICLASS_MOVAPS:
+        case XED_ICLASS_MOVAPD:
+        case XED_ICLASS_MOVDQU:
+        case XED_ICLASS_MOVDQA:
+        case XED_ICLASS_MOV:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static xed_encoder_request_t request(xed_iclass_enum_t iclass, xed_uint_t width, std::vector<xed_encoder_operand_t> const& ops) {
+    xed_encoder_request_t req;
+    xed_encoder_instruction_t enc_inst;
+    if (ops.size() == 1) {
+        xed_inst1(&enc_inst, dstate, iclass, width, ops[0]);
+    } else {
+        xed_inst2(&enc_inst, dstate, iclass, width, ops[0], ops[1]);
+    }
+    xed_convert_to_encoder_request(&req, &enc_inst);
+    return req;
+}
+
+// Every base including RIP and RSP/RBP/R12/R13 with each displacement width, and an indexed form
+static std::vector<xed_encoder_operand_t> memoryOperands(xed_uint_t width) {
+    std::vector<xed_encoder_operand_t> mems;
+    mems.push_back(xed_mem_bd(XED_REG_RIP, xed_disp(0x1234, 32), width));
+    for (auto base : bases) {
+        mems.push_back(xed_mem_b(base, width));
+        mems.push_back(xed_mem_bd(base, xed_disp(-16, 8), width));
+        mems.push_back(xed_mem_bd(base, xed_disp(0x12345, 32), width));
+        if (base != XED_REG_RSP) {
+            mems.push_back(xed_mem_bisd(XED_REG_R13, base, 8, xed_disp(64, 32), width));
+        }
+    }
+    return mems;
+}
+
+static std::vector<xed_encoder_request_t> forms(xed_iclass_enum_t iclass) {
+    std::vector<xed_encoder_request_t> requests;
+    if (iclass == XED_ICLASS_PUSH || iclass == XED_ICLASS_POP) {
+        for (auto reg : TestCompiler::gpRegs) {
+            requests.push_back(request(iclass, 64, {xed_reg(reg)}));
+        }
+        return requests;
+    }
+
+    bool gpr = iclass == XED_ICLASS_MOV;
+    auto const& regs = gpr ? TestCompiler::gpRegs : TestCompiler::xmmRegs;
+    xed_uint_t width = gpr ? 64 : 128;
+    // what the lowerings pass for SSE forms, the operand width of most AVX instructions
+    xed_uint_t opWidth = gpr ? 64 : 32;
+    for (size_t i = 0; i < regs.size(); i++) {
+        auto reg = regs[i];
+        requests.push_back(request(iclass, opWidth, {xed_reg(reg), xed_reg(regs[(i * 5 + 3) % regs.size()])}));
+        for (auto mem : memoryOperands(width)) {
+            requests.push_back(request(iclass, opWidth, {xed_reg(reg), mem}));
+            if (hasStore(iclass)) {
+                requests.push_back(request(iclass, opWidth, {mem, xed_reg(reg)}));
+            }
+        }
+        if (gpr) {
+            requests.push_back(request(iclass, 64, {xed_reg(reg), xed_imm0(0x123456789abcdef0, 64)}));
+            requests.push_back(request(iclass, 32, {xed_reg(TestCompiler::gp32Regs[i]), xed_reg(TestCompiler::gp32Regs[(i + 1) % regs.size()])}));
+        }
+    }
+    return requests;
+}
+
+template<typename F>
+static double nanosecondsPerRequest(std::vector<xed_encoder_request_t> const& requests, F encode) {
+    uint8_t buffer[15];
+    uint32_t olen;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (auto req : requests) {
+            encode(&req, buffer, &olen);
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / (rounds * requests.size());
+}
+
+static bool checkIclass(xed_iclass_enum_t iclass) {
+    auto requests = forms(iclass);
+    std::vector<xed_encoder_request_t> covered;
+    bool passed = true;
+    for (auto const& original : requests) {
+        auto req = original;
+        uint8_t direct[15];
+        uint32_t directLength;
+        if (!DirectEmitter::encode(&req, direct, &directLength)) {
+            continue;
+        }
+        covered.push_back(original);
+
+        req = original;
+        uint8_t encoded[15];
+        uint32_t encodedLength;
+        if (xed_encode(&req, encoded, 15, &encodedLength) != XED_ERROR_NONE) {
+            printf("%s: XED can't encode a covered form\n", xed_iclass_enum_t2str(iclass));
+            passed = false;
+            continue;
+        }
+
+        xed_decoded_inst_t xedd;
+        xed_decoded_inst_zero(&xedd);
+        xed_decoded_inst_set_mode(&xedd, dstate.mmode, dstate.stack_addr_width);
+        bool decoded = xed_decode(&xedd, direct, directLength) == XED_ERROR_NONE
+            && xed_decoded_inst_get_length(&xedd) == directLength
+            && xed_decoded_inst_get_iclass(&xedd) == iclass;
+        if (!decoded || directLength != encodedLength || memcmp(direct, encoded, directLength) != 0) {
+            printf("%s: direct", xed_iclass_enum_t2str(iclass));
+            for (uint32_t i = 0; i < directLength; i++) {
+                printf(" %02x", direct[i]);
+            }
+            printf(", XED");
+            for (uint32_t i = 0; i < encodedLength; i++) {
+                printf(" %02x", encoded[i]);
+            }
+            printf("%s\n", decoded ? "" : ", does not decode back");
+            passed = false;
+        }
+    }
+
+    auto xed = nanosecondsPerRequest(covered, [](xed_encoder_request_t* req, uint8_t* buffer, uint32_t* olen) {
+        xed_encode(req, buffer, 15, olen);
+    });
+    auto direct = nanosecondsPerRequest(covered, [](xed_encoder_request_t* req, uint8_t* buffer, uint32_t* olen) {
+        DirectEmitter::encode(req, buffer, olen);
+    });
+    printf("%-12s %6zu %6zu %10.1f %10.1f\n", xed_iclass_enum_t2str(iclass), covered.size(), requests.size() - covered.size(), xed, direct);
+    return passed;
+}
+
+int main() {
+    xed_tables_init();
+
+    printf("%-12s %6s %6s %10s %10s\n", "", "direct", "xed", "xed ns", "direct ns");
+    bool passed = true;
+    for (auto iclass : sseIclasses) {
+        passed = checkIclass(iclass) && passed;
+    }
+    passed = checkIclass(XED_ICLASS_MOV) && passed;
+    passed = checkIclass(XED_ICLASS_PUSH) && passed;
+    passed = checkIclass(XED_ICLASS_POP) && passed;
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../memmanager.h"
+
+// Installs chunks the way the translator does (allocate, write, write protect)
+// while other threads keep running translated code, with a mapping and an
+// mprotect per chunk as the translator used to, with page batched protection
+// of RWX slabs and with dual mapped slabs. Every protection change has to be
+// shot down from the TLBs of the running threads, which shows as their calls
+// per second dropping. Each backend runs in a process of its own so the slabs
+// of one don't serve the next, the dual one then forks once more to check a
+// child keeps off the slabs it shares with its parent.
+
+static const uint32_t numChunks = 20000;
+static const uint32_t numThreads = 3;
+
+enum class Backend {
+    Mapping,
+    Batched,
+    Dual,
+};
+
+static const char* backendNames[] = {"mmap", "batched", "dual"};
+
+// mov eax, 1; ret
+static const uint8_t function[] = { 0xb8, 0x01, 0x00, 0x00, 0x00, 0xc3 };
+
+static uint64_t chunkSize(uint32_t i) {
+    return 40 + (i * 37) % 321;
+}
+
+static uint8_t* install(Backend backend, uint32_t i, uint64_t* protectCalls) {
+    uint8_t* chunk;
+    if (backend == Backend::Mapping) {
+        chunk = (uint8_t*)mmap(NULL, chunkSize(i), PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, -1, 0);
+        memset(chunk, 0xcc, chunkSize(i));
+        memcpy(chunk, function, sizeof(function));
+        mprotect(chunk, chunkSize(i), PROT_READ | PROT_EXEC);
+        (*protectCalls)++;
+        return chunk;
+    }
+    chunk = alloc_executable(chunkSize(i));
+    auto code = code_cache_writable(chunk);
+    memset(code, 0xcc, chunkSize(i));
+    memcpy(code, function, sizeof(function));
+    write_protect_memory(chunk, chunkSize(i));
+    return chunk;
+}
+
+static void run(Backend backend) {
+    if (backend == Backend::Dual && !init_code_cache_dual_mapping()) {
+        printf("%-8s not supported\n", backendNames[(int)backend]);
+        return;
+    }
+
+    code_cache_stats stats;
+    get_code_cache_stats(&stats);
+    uint64_t protectCallsBefore = stats.protectCalls;
+    uint64_t protectCalls = 0;
+
+    std::atomic<uint8_t*> target{install(backend, 0, &protectCalls)};
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> calls{0};
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < numThreads; t++) {
+        threads.emplace_back([&]() {
+            uint64_t n = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                // the latest chunk, so the threads touch the pages that change protection
+                n += ((int (*)())target.load(std::memory_order_relaxed))();
+            }
+            calls += n;
+        });
+    }
+
+    std::vector<double> latencies;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 1; i < numChunks; i++) {
+        auto begin = std::chrono::steady_clock::now();
+        auto chunk = install(backend, i, &protectCalls);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - begin;
+        latencies.push_back(elapsed.count());
+        target = chunk;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    get_code_cache_stats(&stats);
+    protectCalls += stats.protectCalls - protectCallsBefore;
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-8s %10lu %10.1f %10.1f %14.1f\n", backendNames[(int)backend], protectCalls,
+           latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], calls / elapsed.count() / 1e6);
+}
+
+// mov eax, 2; ret
+static const uint8_t otherFunction[] = { 0xb8, 0x02, 0x00, 0x00, 0x00, 0xc3 };
+
+static uint8_t* installFunction(const uint8_t* code, size_t size) {
+    auto chunk = alloc_executable(64);
+    memcpy(code_cache_writable(chunk), code, size);
+    write_protect_memory(chunk, 64);
+    return chunk;
+}
+
+// A forked child shares the dual mapped slabs with its parent, the chunks it
+// installs must not land on the ones the parent installs after the fork
+static bool checkFork() {
+    installFunction(function, sizeof(function));
+    int pipes[2];
+    if (pipe(pipes) != 0) {
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        char go;
+        read(pipes[0], &go, 1);
+        installFunction(otherFunction, sizeof(otherFunction));
+        _exit(0);
+    }
+    auto chunk = installFunction(function, sizeof(function));
+    write(pipes[1], "x", 1);
+    int status;
+    waitpid(pid, &status, 0);
+    close(pipes[0]);
+    close(pipes[1]);
+
+    if (((int (*)())chunk)() != 1) {
+        printf("A forked child overwrote a chunk of its parent\n");
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    printf("%-8s %10s %10s %10s %14s\n", "", "mprotect", "median ns", "p99 ns", "Mcalls/s");
+    for (auto backend : {Backend::Mapping, Backend::Batched, Backend::Dual}) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            run(backend);
+            bool forkSafe = backend != Backend::Dual || !init_code_cache_dual_mapping() || checkFork();
+            fflush(stdout);
+            _exit(forkSafe ? 0 : 1);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("%s did not finish\n", backendNames[(int)backend]);
+            return 1;
+        }
+    }
+    return 0;
+}
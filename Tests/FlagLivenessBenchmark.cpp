@@ -0,0 +1,116 @@
+#include "Harness.h"
+#include "TestCompiler.h"
+
+#include <cstdio>
+#include <memory>
+
+#include "../Compiler/Compiler.h"
+#include "../Instructions/Instructions.h"
+#include "../memmanager.h"
+
+// Compiles shift-heavy blocks with the flags saved around every BMI shift and
+// with the saves the block does not need left out, checks both against native
+// execution and compares cycles per call.
+
+static const uint32_t iterations = 10000;
+
+static const xed_state_t dstate = {.mmode = XED_MACHINE_MODE_LONG_64,
+                                   .stack_addr_width = XED_ADDRESS_WIDTH_64b};
+
+static xed_encoder_request_t inst(xed_iclass_enum_t iclass, xed_encoder_operand_t op0, xed_encoder_operand_t op1) {
+    xed_encoder_request_t req;
+    xed_encoder_instruction_t enc_inst;
+    xed_inst2(&enc_inst, dstate, iclass, 64, op0, op1);
+    xed_convert_to_encoder_request(&req, &enc_inst);
+    return req;
+}
+
+static xed_encoder_request_t inst(xed_iclass_enum_t iclass, xed_encoder_operand_t op0, xed_encoder_operand_t op1, xed_encoder_operand_t op2) {
+    xed_encoder_request_t req;
+    xed_encoder_instruction_t enc_inst;
+    xed_inst3(&enc_inst, dstate, iclass, 64, op0, op1, op2);
+    xed_convert_to_encoder_request(&req, &enc_inst);
+    return req;
+}
+
+// Rounds of a shift-xor hash, the last ADD sets every flag the block leaves behind
+static std::vector<xed_encoder_request_t> hashBlock() {
+    std::vector<xed_encoder_request_t> block;
+    for (int i = 0; i < 4; i++) {
+        block.push_back(inst(XED_ICLASS_SHLX, xed_reg(XED_REG_RDX), xed_reg(XED_REG_RBX), xed_reg(XED_REG_RSI)));
+        block.push_back(inst(XED_ICLASS_XOR, xed_reg(XED_REG_RBX), xed_reg(XED_REG_RDX)));
+        block.push_back(inst(XED_ICLASS_SHRX, xed_reg(XED_REG_RDX), xed_reg(XED_REG_RBX), xed_reg(XED_REG_RDI)));
+        block.push_back(inst(XED_ICLASS_ADD, xed_reg(XED_REG_RBX), xed_reg(XED_REG_RDX)));
+    }
+    return block;
+}
+
+// Bit tests and sets of a bitset word, ending in the TEST a loop would branch on
+static std::vector<xed_encoder_request_t> bitsetBlock() {
+    std::vector<xed_encoder_request_t> block;
+    for (int i = 0; i < 4; i++) {
+        block.push_back(inst(XED_ICLASS_SHRX, xed_reg(XED_REG_RDX), xed_reg(XED_REG_RBX), xed_reg(XED_REG_RSI)));
+        block.push_back(inst(XED_ICLASS_AND, xed_reg(XED_REG_RDX), xed_reg(XED_REG_RDI)));
+        block.push_back(inst(XED_ICLASS_SHLX, xed_reg(XED_REG_R8), xed_reg(XED_REG_RDI), xed_reg(XED_REG_RSI)));
+        block.push_back(inst(XED_ICLASS_OR, xed_reg(XED_REG_RBX), xed_reg(XED_REG_R8)));
+        block.push_back(inst(XED_ICLASS_SARX, xed_reg(XED_REG_R9), xed_reg(XED_REG_RBX), xed_reg(XED_REG_RDI)));
+    }
+    block.push_back(inst(XED_ICLASS_TEST, xed_reg(XED_REG_R9), xed_reg(XED_REG_RDX)));
+    return block;
+}
+
+static std::shared_ptr<Instruction> translate(xed_encoder_request_t const& request) {
+    auto xedd = populateDecodedInst(request);
+    auto iclass = xed_decoded_inst_get_iclass(&xedd);
+    if (iclassMapping.contains(iclass)) {
+        return iclassMapping.factory(iclass)(0, 0, xedd);
+    }
+    return std::make_shared<NativeInstruction>(0, xed_decoded_inst_get_length(&xedd), xedd);
+}
+
+static bool checkBlock(const char* name, std::vector<xed_encoder_request_t> const& block) {
+    std::unordered_set<xed_reg_enum_t> usedRegisters = {
+        XED_REG_RBX, XED_REG_RDX, XED_REG_RSI, XED_REG_RDI, XED_REG_R8, XED_REG_R9
+    };
+    auto nativeRequests = block;
+    nativeRequests.push_back(inst0(XED_ICLASS_RET_NEAR, 64));
+    auto native = TestCompiler::compileRequests(nativeRequests);
+
+    bool passed = true;
+    uint64_t cycles[2];
+    size_t emitted[2];
+    for (int liveness = 0; liveness < 2; liveness++) {
+        Compiler compiler;
+        compiler.setFlagLiveness(liveness);
+        for (auto const& request : block) {
+            compiler.addInstruction(translate(request));
+        }
+        emitted[liveness] = compiler.compile(CompilationStrategy::DirectCall, 0).size();
+        uint32_t olen;
+        auto translated = compiler.encode(CompilationStrategy::DirectCall, &olen, 0);
+
+        auto xedd = populateDecodedInst(block[0]);
+        TestThunk thunk(xed_decoded_inst_get_iform_enum(&xedd), usedRegisters, TempMemory(XED_REG_INVALID), native, translated);
+        Harness harness(thunk);
+        cycles[liveness] = harness.measureCycles(translated, true, iterations);
+        if (harness.runTests().printResult()) {
+            printf("%s differs from native execution with flag liveness %s\n", name, liveness ? "on" : "off");
+            passed = false;
+        }
+    }
+
+    printf("%-10s %8zu %8zu %8lu %8lu\n", name, emitted[0], emitted[1], cycles[0], cycles[1]);
+    return passed;
+}
+
+int main() {
+    xed_tables_init();
+    init_ymm_storage();
+
+    printf("%-10s %8s %8s %8s %8s\n", "", "emitted", "", "cycles", "");
+    printf("%-10s %8s %8s %8s %8s\n", "", "saved", "liveness", "saved", "liveness");
+    bool passed = checkBlock("hash", hashBlock());
+    passed = checkBlock("bitset", bitsetBlock()) && passed;
+
+    return passed ? 0 : 1;
+}
@@ -7,12 +7,14 @@
 #include "xed/xed-inst.h"
 #include "xed/xed-reg-class-enum.h"
 #include "xed/xed-reg-enum.h"
+#include <algorithm>
 #include <climits>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <immintrin.h>
 #include <mmintrin.h>
+#include <x86intrin.h>
 #include <vector>
 #include <xmmintrin.h>
 #include <ucontext.h>
@@ -233,7 +235,7 @@ __m256 mergeHighYmmFromStorage(xed_reg_enum_t reg, __m256 ymm) {
     return _mm256_set_pd(s[1], s[0], d[1], d[0]);
 }
 
-OneTestResult Harness::runTest(TestValues const& values, const void* thunk, bool translated) {
+void Harness::loadInput(TestValues const& values, volatile ThunkRegisters& registers, bool translated) {
     RegisterBank inputBank;
     // Set register bank
     for (auto const& reg : values.reg) {
@@ -267,12 +269,6 @@ OneTestResult Harness::runTest(TestValues const& values, const void* thunk, bool
     }
     inputBank.gpRegs[testThunk.usedMemory.baseReg] = (uint64_t)testThunk.usedMemory.memory;
 
-    // this is the core of the harness
-    // here we will switch context to the actuall function implementation
-
-    RegisterBank outputBank;
-
-    volatile ThunkRegisters registers;
     for (xed_reg_enum_t reg : TestCompiler::ymmRegs) {
         if (inputBank.ymmRegs.contains(reg)) {
             *(registers.getYmmInOutPtr(reg)) = inputBank.ymmRegs[reg];
@@ -295,7 +291,17 @@ OneTestResult Harness::runTest(TestValues const& values, const void* thunk, bool
             *(registers.getGprInOutPtr(reg)) = 0;
         }
     }
- 
+}
+
+OneTestResult Harness::runTest(TestValues const& values, const void* thunk, bool translated) {
+    volatile ThunkRegisters registers;
+    loadInput(values, registers, translated);
+
+    // this is the core of the harness
+    // here we will switch context to the actuall function implementation
+
+    RegisterBank outputBank;
+
     auto requests = generateHarness(registers, thunk);
     auto compiledHarness = TestCompiler::compileRequests(requests);
     ((void(*)(void))compiledHarness)(); // Execute harness
@@ -350,6 +356,22 @@ OneTestResult Harness::runTest(TestValues const& values, const void* thunk, bool
     return OneTestResult(values, TestValues(regResult, memResult));
 }
 
+uint64_t Harness::measureCycles(const void* thunk, bool translated, uint32_t iterations) {
+    volatile ThunkRegisters registers;
+    loadInput(generateTestValues(), registers, translated);
+    auto compiledHarness = (void(*)(void))TestCompiler::compileRequests(generateHarness(registers, thunk));
+
+    // the fastest run is the one least disturbed by interrupts and cold caches
+    uint64_t best = UINT64_MAX;
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint64_t begin = __rdtsc();
+        compiledHarness();
+        uint64_t cycles = __rdtsc() - begin;
+        best = std::min(best, cycles);
+    }
+    return best;
+}
+
 TestValues Harness::generateTestValues() const {
     return TestValues(generateRegValues(), generateMemValue());
 }
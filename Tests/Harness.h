@@ -9,6 +9,8 @@
 #include <xmmintrin.h>
 #include <immintrin.h>
 
+xed_encoder_request_t inst0(xed_iclass_enum_t iclass, xed_uint_t opWidth);
+
 class ThunkRegisters {
     volatile uint64_t gpRegsValuesTemp[16];
     volatile __m256 ymmRegsValuesTemp[16] __attribute__((aligned(32)));
@@ -99,6 +101,8 @@ public:
     {}
 
     TestResult runTests();
+    // Cycles of one call of the thunk inside the harness, which saves and loads all registers around it
+    uint64_t measureCycles(const void* thunk, bool translated, uint32_t iterations);
 private:
     TestThunk testThunk;
 
@@ -106,6 +110,7 @@ private:
     RegValues generateRegValues() const;
     MemoryValue generateMemValue() const;
     TestValues generateTestValues() const;
+    void loadInput(TestValues const& values, volatile ThunkRegisters& registers, bool translated);
     OneTestResult runTest(TestValues const& values, const void* thunk, bool translated);
     OneTestResult runNativeTest(TestValues const& values) {
         return runTest(values, testThunk.compiledNativeThunk, false);
@@ -0,0 +1,30 @@
+#include "../Scanner/ImageScanner.h"
+
+#include <cstdio>
+#include <dlfcn.h>
+#include <xed/xed-interface.h>
+
+// Sweeps the code of every loaded image, plus any libraries given on the command line,
+// and reports how many sites eager mode would translate. Nothing is patched.
+
+int main(int argc, char** argv) {
+    xed_tables_init();
+
+    for (int i = 1; i < argc; i++) {
+        if (dlopen(argv[i], RTLD_NOW) == nullptr) {
+            printf("Failed to load %s: %s\n", argv[i], dlerror());
+            return 1;
+        }
+    }
+
+    ImageScanner scanner([](uint8_t* site) {
+        return false;
+    });
+
+    auto stats = scanner.scanLoadedImages();
+    printf("%lu images, %.1f MB of code, %lu supported VEX sites found, %lu more unconfirmed in %.2f ms (%.1f MB/s)\n",
+        stats.images, stats.bytesScanned / 1048576.0, stats.sitesFound, stats.sitesUnconfirmed, stats.milliseconds,
+        stats.bytesScanned / 1048576.0 / (stats.milliseconds / 1000));
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include "../addresstable.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Measures trap-site lookup latency while another thread keeps registering new sites,
+// comparing the lock-free AddressTable with a mutex-protected unordered_map.
+
+static const size_t preloadedSites = 16384;
+static const size_t insertedSites = 16384;
+static const size_t lookupsPerThread = 4000000;
+
+static uint64_t siteAddress(size_t i) {
+    // trap sites are scattered through the text segment of a library
+    return 0x7ff800000000ull + i * 37 + 1;
+}
+
+struct LockedMap {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, uint64_t> map;
+
+    void set(uint64_t key, uint64_t value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        map[key] = value;
+    }
+
+    uint64_t get(uint64_t key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = map.find(key);
+        return it == map.end() ? 0 : it->second;
+    }
+};
+
+template<typename Table>
+static void run(const char* name, Table& table, int readers) {
+    for (size_t i = 0; i < preloadedSites; i++) {
+        table.set(siteAddress(i), i + 1);
+    }
+
+    std::atomic<bool> start = false;
+    std::atomic<size_t> misses = 0;
+    std::vector<double> nsPerLookup(readers);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < readers; t++) {
+        threads.emplace_back([&, t]() {
+            while (!start.load()) {}
+            uint64_t x = t + 1;
+            size_t localMisses = 0;
+            auto begin = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < lookupsPerThread; i++) {
+                x = x * 6364136223846793005ull + 1442695040888963407ull;
+                size_t site = (x >> 33) % preloadedSites;
+                if (table.get(siteAddress(site)) != site + 1) {
+                    localMisses++;
+                }
+            }
+            auto end = std::chrono::steady_clock::now();
+            nsPerLookup[t] = std::chrono::duration<double, std::nano>(end - begin).count() / lookupsPerThread;
+            misses += localMisses;
+        });
+    }
+
+    std::thread writer([&]() {
+        while (!start.load()) {}
+        for (size_t i = preloadedSites; i < preloadedSites + insertedSites; i++) {
+            table.set(siteAddress(i), i + 1);
+        }
+    });
+
+    start = true;
+    writer.join();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    double total = 0;
+    double worst = 0;
+    for (auto ns : nsPerLookup) {
+        total += ns;
+        worst = ns > worst ? ns : worst;
+    }
+    printf("%-14s readers=%2d  avg %7.2f ns/lookup  worst thread %7.2f ns/lookup  misses %lu\n",
+        name, readers, total / readers, worst, misses.load());
+}
+
+int main() {
+    int maxReaders = std::thread::hardware_concurrency();
+    if (maxReaders < 1) {
+        maxReaders = 1;
+    }
+
+    for (int readers = 1; readers <= maxReaders; readers *= 2) {
+        auto table = std::make_unique<AddressTable<1 << 16>>();
+        run("AddressTable", *table, readers);
+
+        LockedMap map;
+        run("locked map", map, readers);
+    }
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include "../Compiler/Encoder.h"
+#include "../Cache/Module.h"
+#include "../memmanager.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Translates every site of a file mapped as code, then maps the file again at
+// another address in a new process, as the next run of a program would, and
+// counts how many sites come from the cache instead of being translated again.
+// Finally tears the last record the way a crash during the append would and
+// checks the cache drops only that record.
+
+static const size_t numSites = 1024;
+static const size_t siteStride = 32;
+static const size_t dataOffset = numSites * siteStride;
+static const size_t imageSize = dataOffset + 4096;
+static const uint64_t configuration = 0x1234;
+
+// VADDPS ymm0, ymm1, ymm2
+static const uint8_t vaddps[] = { 0xc5, 0xf4, 0x58, 0xc2 };
+// VADDPS ymm0, ymm1, [rip + disp32]
+static const uint8_t vaddpsRip[] = { 0xc5, 0xf4, 0x58, 0x05 };
+
+static std::vector<uint8_t> makeImage() {
+    std::vector<uint8_t> image(imageSize, 0xcc);
+    for (size_t site = 0; site < numSites; site++) {
+        uint8_t* p = image.data() + site * siteStride;
+        if (site % 4 == 0) {
+            // too short for a jump, ends up as a trap site
+            memcpy(p, vaddps, sizeof(vaddps));
+            p += sizeof(vaddps);
+        } else if (site % 4 == 1) {
+            // RIP-relative operands into the data of the image, relocated when the image moves
+            for (int i = 0; i < 2; i++) {
+                memcpy(p, vaddpsRip, sizeof(vaddpsRip));
+                p += sizeof(vaddpsRip);
+                *(int32_t*)p = (int32_t)(dataOffset + 32 * (site % 64) - (p + 4 - image.data()));
+                p += 4;
+            }
+        } else {
+            for (int i = 0; i < 4; i++) {
+                memcpy(p, vaddps, sizeof(vaddps));
+                p += sizeof(vaddps);
+            }
+        }
+        *p = 0xc3; // RET stops the decoder
+    }
+    return image;
+}
+
+// Translates every site of the image mapped skip bytes further than the kernel would put it
+static void translateSites(const char* imagePath, const char* cachePath, size_t skip) {
+    xed_tables_init();
+    init_ymm_storage();
+
+    int fd = open(imagePath, O_RDONLY);
+    auto hint = (uint8_t*)mmap(nullptr, imageSize + skip, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    munmap(hint, imageSize + skip);
+    auto image = (uint8_t*)mmap(hint + skip, imageSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        printf("Can't map %s\n", imagePath);
+        exit(1);
+    }
+
+    auto encoder = std::make_unique<Encoder>(Cache(cachePath, configuration));
+    size_t failures = 0;
+    for (size_t site = 0; site < numSites; site++) {
+        if (encoder->reencodeInstruction(image + site * siteStride) != 0) {
+            failures++;
+        }
+    }
+    size_t untranslated = 0;
+    for (size_t site = 0; site < numSites; site++) {
+        if (image[site * siteStride] == vaddps[0]) {
+            untranslated++;
+        }
+    }
+    if (failures != 0 || untranslated != 0) {
+        printf("%lu failures, %lu untranslated sites\n", failures, untranslated);
+        exit(1);
+    }
+    exit(0);
+}
+
+static bool runChild(const char* imagePath, const char* cachePath, size_t skip) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        translateSites(imagePath, cachePath, skip);
+    }
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static size_t records(const char* cachePath) {
+    return Cache(cachePath, configuration).size();
+}
+
+static off_t fileSize(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+int main() {
+    char dir[] = "linearavx-cache-test-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string imagePath = std::string(dir) + "/image.bin";
+    std::string cachePath = std::string(dir) + "/image.cache";
+
+    auto image = makeImage();
+    FILE* file = fopen(imagePath.c_str(), "wb");
+    fwrite(image.data(), 1, image.size(), file);
+    fclose(file);
+
+    bool passed = true;
+    if (!runChild(imagePath.c_str(), cachePath.c_str(), 0)) {
+        printf("First run failed\n");
+        passed = false;
+    }
+    size_t stored = records(cachePath.c_str());
+    auto sizeAfterFirst = fileSize(cachePath.c_str());
+
+    // 1 GB further, every RIP-relative operand and jump back is relocated
+    if (!runChild(imagePath.c_str(), cachePath.c_str(), 1ull << 30)) {
+        printf("Second run failed\n");
+        passed = false;
+    }
+    // only translations are stored, so a second run that grew the file translated those sites again
+    size_t translatedAgain = records(cachePath.c_str()) - stored;
+
+    printf("first run: %lu sites, %lu translations stored (%ld bytes)\n", numSites, stored, (long)sizeAfterFirst);
+    printf("second run: %lu sites translated again, %lu traps avoided\n", translatedAgain, stored - translatedAgain);
+    if (stored != numSites || translatedAgain != 0) {
+        printf("Expected every site to be stored by the first run and found by the second\n");
+        passed = false;
+    }
+
+    // what a process checks before it sets up the runtime to patch sites at load
+    auto modules = Cache::modules(cachePath.c_str());
+    if (modules.size() != 1 || modules[0] != moduleKey(imagePath.c_str())) {
+        printf("The cache lists %lu modules instead of just the image\n", modules.size());
+        passed = false;
+    }
+
+    // a record cut short by a crash is dropped and the ones before it are kept
+    auto size = fileSize(cachePath.c_str());
+    if (truncate(cachePath.c_str(), size - 10) != 0) {
+        perror("truncate");
+        return 1;
+    }
+    size_t afterTear = records(cachePath.c_str());
+    if (afterTear != stored - 1) {
+        printf("%lu records left after tearing the last one off %lu\n", afterTear, stored);
+        passed = false;
+    }
+    if (records(cachePath.c_str()) != afterTear) {
+        printf("Reopening the cut cache lost records\n");
+        passed = false;
+    }
+
+    unlink(imagePath.c_str());
+    unlink(cachePath.c_str());
+    rmdir(dir);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+#include "../Compiler/Encoder.h"
+#include "../Scanner/ImageScanner.h"
+#include "../memmanager.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Time until every site of an image is patched, and how many of them trap on
+// the way, for a cold start that translates each site as it traps and for a
+// warm start that patches the sites an earlier run cached as the image is
+// loaded. The trap itself isn't taken, only the work done in the handler is
+// timed, so the difference is a lower bound.
+
+static const size_t numSites = 4096;
+static const size_t siteStride = 32;
+static const size_t imageSize = numSites * siteStride;
+static const uint64_t configuration = 0x5678;
+
+// VADDPS ymm0, ymm1, ymm2
+static const uint8_t vaddps[] = { 0xc5, 0xf4, 0x58, 0xc2 };
+// VMULPS ymm3, ymm0, ymm1
+static const uint8_t vmulps[] = { 0xc5, 0xfc, 0x59, 0xd9 };
+
+static std::vector<uint8_t> makeImage() {
+    std::vector<uint8_t> image(imageSize, 0xcc);
+    for (size_t site = 0; site < numSites; site++) {
+        uint8_t* p = image.data() + site * siteStride;
+        for (int i = 0; i < 3; i++) {
+            memcpy(p, vaddps, sizeof(vaddps));
+            p += sizeof(vaddps);
+            memcpy(p, vmulps, sizeof(vmulps));
+            p += sizeof(vmulps);
+        }
+        *p = 0xc3; // RET stops the decoder
+    }
+    return image;
+}
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static size_t unpatchedSites(uint8_t* image) {
+    size_t unpatched = 0;
+    for (size_t site = 0; site < numSites; site++) {
+        if (image[site * siteStride] == vaddps[0]) {
+            unpatched++;
+        }
+    }
+    return unpatched;
+}
+
+static void startImage(const char* imagePath, const char* cachePath, bool prepatch) {
+    xed_tables_init();
+    init_ymm_storage();
+    auto encoder = std::make_unique<Encoder>(Cache(cachePath, configuration));
+
+    auto start = std::chrono::steady_clock::now();
+    int fd = open(imagePath, O_RDONLY);
+    auto image = (uint8_t*)mmap(nullptr, imageSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        printf("Can't map %s\n", imagePath);
+        exit(1);
+    }
+
+    double prepatchMs = 0;
+    if (prepatch) {
+        ImageScanner scanner([&](uint8_t* site) {
+            return encoder->installCachedSite(site);
+        }, [&](uint8_t* begin, uint8_t* end) {
+            return encoder->cachedSites(begin, end);
+        });
+        prepatchMs = scanner.scanRange(image, image + imageSize).milliseconds;
+    }
+
+    // whatever is left traps when the code first runs
+    size_t traps = unpatchedSites(image);
+    for (size_t site = 0; site < numSites; site++) {
+        if (image[site * siteStride] == vaddps[0] && encoder->reencodeInstruction(image + site * siteStride) != 0) {
+            printf("Failed to translate site %lu\n", site);
+            exit(1);
+        }
+    }
+    double totalMs = msSince(start);
+
+    printf("%-5s %5lu traps, %8.2f ms to patch every site (%.2f ms of it at load)\n",
+        prepatch ? "warm" : "cold", traps, totalMs, prepatchMs);
+    exit(unpatchedSites(image) == 0 ? 0 : 1);
+}
+
+static bool runChild(const char* imagePath, const char* cachePath, bool prepatch) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        startImage(imagePath, cachePath, prepatch);
+    }
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main() {
+    char dir[] = "linearavx-prepatch-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string imagePath = std::string(dir) + "/image.bin";
+    std::string cachePath = std::string(dir) + "/image.cache";
+
+    auto image = makeImage();
+    FILE* file = fopen(imagePath.c_str(), "wb");
+    fwrite(image.data(), 1, image.size(), file);
+    fclose(file);
+
+    printf("%lu sites\n", numSites);
+    // the cold start fills the cache the warm one starts from
+    bool passed = runChild(imagePath.c_str(), cachePath.c_str(), false)
+        && runChild(imagePath.c_str(), cachePath.c_str(), true);
+    if (!passed) {
+        printf("A run left sites unpatched\n");
+    }
+
+    unlink(imagePath.c_str());
+    unlink(cachePath.c_str());
+    rmdir(dir);
+    return passed ? 0 : 1;
+}
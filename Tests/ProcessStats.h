@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#endif
+
+#include "../memmanager.h"
+
+// Number of mappings in the address space of the process
+static uint64_t vmaCount() {
+    uint64_t count = 0;
+#ifdef __APPLE__
+    mach_vm_address_t address = 0;
+    mach_vm_size_t size = 0;
+    vm_region_basic_info_data_64_t info;
+    mach_msg_type_number_t infoCount = VM_REGION_BASIC_INFO_COUNT_64;
+    mach_port_t object;
+    while (mach_vm_region(mach_task_self(), &address, &size, VM_REGION_BASIC_INFO_64, (vm_region_info_t)&info, &infoCount, &object) == KERN_SUCCESS) {
+        count++;
+        address += size;
+        infoCount = VM_REGION_BASIC_INFO_COUNT_64;
+    }
+#else
+    if (FILE* maps = fopen("/proc/self/maps", "r")) {
+        for (int c; (c = fgetc(maps)) != EOF;) {
+            count += c == '\n';
+        }
+        fclose(maps);
+    }
+#endif
+    return count;
+}
+
+// Resident set of the process right now, in kilobytes
+static uint64_t rssKb() {
+#ifdef __APPLE__
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t infoCount = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &infoCount) != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.resident_size / 1024;
+#else
+    uint64_t pages = 0;
+    uint64_t resident = 0;
+    if (FILE* statm = fopen("/proc/self/statm", "r")) {
+        if (fscanf(statm, "%lu %lu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+}
+
+static void printCodeCacheStats() {
+    code_cache_stats stats;
+    get_code_cache_stats(&stats);
+    double density = stats.usedPages ? (double)stats.chunks / stats.usedPages : 0;
+    printf("Code cache: %lu chunks (%lu bytes) in %lu slabs, %.1f chunks per page, %lu large chunks (%lu bytes)\n",
+           stats.chunks, stats.liveBytes, stats.slabs, density, stats.largeChunks, stats.largeBytes);
+    printf("Process: %lu mappings, %lu kB resident\n", vmaCount(), rssKb());
+}
@@ -0,0 +1,125 @@
+#include "Harness.h"
+#include "TestCompiler.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include "../Compiler/Compiler.h"
+#include "../Instructions/Instructions.h"
+#include "../memmanager.h"
+
+// Compiles a block loading its constants RIP-relative with every RipMode, checks
+// each against native code addressing the same constants through RAX and
+// compares emitted instructions and cycles per call.
+
+static const uint32_t iterations = 10000;
+
+static const xed_state_t dstate = {.mmode = XED_MACHINE_MODE_LONG_64,
+                                   .stack_addr_width = XED_ADDRESS_WIDTH_64b};
+
+static xed_encoder_request_t inst(xed_iclass_enum_t iclass, xed_uint_t width, xed_encoder_operand_t op0, xed_encoder_operand_t op1) {
+    xed_encoder_request_t req;
+    xed_encoder_instruction_t enc_inst;
+    xed_inst2(&enc_inst, dstate, iclass, width, op0, op1);
+    xed_convert_to_encoder_request(&req, &enc_inst);
+    return req;
+}
+
+static xed_encoder_request_t inst(xed_iclass_enum_t iclass, xed_uint_t width, xed_encoder_operand_t op0, xed_encoder_operand_t op1, xed_encoder_operand_t op2) {
+    xed_encoder_request_t req;
+    xed_encoder_instruction_t enc_inst;
+    xed_inst3(&enc_inst, dstate, iclass, width, op0, op1, op2);
+    xed_convert_to_encoder_request(&req, &enc_inst);
+    return req;
+}
+
+// The instructions of the block with the constant each one loads, as an offset into the constants
+struct ConstantLoad {
+    xed_iclass_enum_t iclass;
+    xed_uint_t width;
+    std::vector<xed_reg_enum_t> regs;
+    uint32_t memoryWidth;
+    uint32_t constant;
+};
+
+static const std::vector<ConstantLoad> block = {
+    {XED_ICLASS_VADDPS, 256, {XED_REG_YMM0, XED_REG_YMM1}, 256, 0},
+    {XED_ICLASS_VMULPS, 256, {XED_REG_YMM2, XED_REG_YMM0}, 256, 32},
+    {XED_ICLASS_ADD, 64, {XED_REG_RBX}, 64, 64},
+    {XED_ICLASS_VSUBPS, 256, {XED_REG_YMM3, XED_REG_YMM2}, 256, 0},
+};
+
+static xed_encoder_request_t request(ConstantLoad const& load, xed_encoder_operand_t mem) {
+    if (load.regs.size() == 1) {
+        return inst(load.iclass, load.width, xed_reg(load.regs[0]), mem);
+    }
+    return inst(load.iclass, load.width, xed_reg(load.regs[0]), xed_reg(load.regs[1]), mem);
+}
+
+// As the original code would have it, RIP-relative from where the instruction sits
+static std::shared_ptr<Instruction> translate(ConstantLoad const& load, uint8_t* constants) {
+    auto xedd = populateDecodedInst(request(load, xed_mem_bd(XED_REG_RIP, xed_disp(0, 32), load.memoryWidth)));
+    auto ilen = xed_decoded_inst_get_length(&xedd);
+    uint64_t rip = (uint64_t)constants + load.constant - ilen;
+    auto iclass = xed_decoded_inst_get_iclass(&xedd);
+    if (iclassMapping.contains(iclass)) {
+        return iclassMapping.factory(iclass)(rip, ilen, xedd);
+    }
+    return std::make_shared<NativeInstruction>(rip, ilen, xedd);
+}
+
+int main() {
+    xed_tables_init();
+    init_ymm_storage();
+
+    // next to where chunks are allocated, so the Relative mode keeps them in reach
+    auto constants = alloc_executable(4096);
+    auto writable = code_cache_writable(constants);
+    for (uint32_t i = 0; i < 16; i++) {
+        ((float*)writable)[i] = 1.5f + i;
+    }
+    *(uint64_t*)(writable + 64) = 0x123456789;
+    write_protect_memory(constants, 4096);
+
+    std::unordered_set<xed_reg_enum_t> usedRegisters = {
+        XED_REG_YMM0, XED_REG_YMM1, XED_REG_YMM2, XED_REG_YMM3, XED_REG_RBX
+    };
+    std::vector<xed_encoder_request_t> nativeRequests;
+    nativeRequests.push_back(inst(XED_ICLASS_MOV, 64, xed_reg(XED_REG_RAX), xed_imm0((uint64_t)constants, 64)));
+    for (auto const& load : block) {
+        nativeRequests.push_back(request(load, xed_mem_bd(XED_REG_RAX, xed_disp(load.constant, 32), load.memoryWidth)));
+    }
+    nativeRequests.push_back(inst0(XED_ICLASS_RET_NEAR, 64));
+    auto native = TestCompiler::compileRequests(nativeRequests);
+    auto first = populateDecodedInst(nativeRequests[1]);
+
+    const std::pair<RipMode, const char*> modes[] = {
+        {RipMode::Absolute, "absolute"},
+        {RipMode::Relative, "relative"},
+        {RipMode::Pool, "pool"},
+    };
+
+    bool passed = true;
+    printf("%-10s %8s %8s\n", "", "emitted", "cycles");
+    for (auto const& [mode, name] : modes) {
+        Compiler compiler;
+        compiler.setRipMode(mode);
+        for (auto const& load : block) {
+            compiler.addInstruction(translate(load, constants));
+        }
+        size_t emitted = compiler.compile(CompilationStrategy::DirectCall, 0).size();
+        uint32_t olen;
+        auto translated = compiler.encode(CompilationStrategy::DirectCall, &olen, 0);
+
+        TestThunk thunk(xed_decoded_inst_get_iform_enum(&first), usedRegisters, TempMemory(XED_REG_INVALID), native, translated);
+        Harness harness(thunk);
+        printf("%-10s %8zu %8lu\n", name, emitted, harness.measureCycles(translated, true, iterations));
+        if (harness.runTests().printResult()) {
+            printf("%s differs from native execution\n", name);
+            passed = false;
+        }
+    }
+
+    return passed ? 0 : 1;
+}
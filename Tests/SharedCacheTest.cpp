@@ -0,0 +1,156 @@
+#include "../Compiler/Encoder.h"
+#include "../memmanager.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <spawn.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Runs this binary as several processes that map the same image and trap on
+// every site of it, the way the processes of a Wine prefix load the same
+// DLLs. The first process translates the sites, the rest start together
+// once it is done and should install every site from the shared cache
+// without translating any of them.
+//
+// shared_cache_test [processes]
+
+extern char** environ;
+
+static const size_t numSites = 2048;
+static const size_t siteStride = 32;
+static const size_t dataOffset = numSites * siteStride;
+static const size_t imageSize = dataOffset + 4096;
+
+// VADDPS ymm0, ymm1, ymm2
+static const uint8_t vaddps[] = { 0xc5, 0xf4, 0x58, 0xc2 };
+// VADDPS ymm0, ymm1, [rip + disp32]
+static const uint8_t vaddpsRip[] = { 0xc5, 0xf4, 0x58, 0x05 };
+
+static std::vector<uint8_t> makeImage() {
+    std::vector<uint8_t> image(imageSize, 0xcc);
+    for (size_t site = 0; site < numSites; site++) {
+        uint8_t* p = image.data() + site * siteStride;
+        if (site % 2 == 0) {
+            for (int i = 0; i < 2; i++) {
+                memcpy(p, vaddpsRip, sizeof(vaddpsRip));
+                p += sizeof(vaddpsRip);
+                *(int32_t*)p = (int32_t)(dataOffset + 32 * (site % 64) - (p + 4 - image.data()));
+                p += 4;
+            }
+        } else {
+            for (int i = 0; i < 4; i++) {
+                memcpy(p, vaddps, sizeof(vaddps));
+                p += sizeof(vaddps);
+            }
+        }
+        *p = 0xc3; // RET stops the decoder
+    }
+    return image;
+}
+
+static int child(int index, const char* imagePath, const char* sharedName) {
+    xed_tables_init();
+    init_ymm_storage();
+
+    int fd = open(imagePath, O_RDONLY);
+    auto image = (uint8_t*)mmap(nullptr, imageSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        printf("Can't map %s\n", imagePath);
+        return 1;
+    }
+
+    // no persistent cache, every site comes from the shared one or is translated
+    SharedCache shared(sharedName);
+    size_t before = shared.size();
+    auto encoder = std::make_unique<Encoder>(Cache(), 64, SharedCache(sharedName));
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t site = 0; site < numSites; site++) {
+        if (encoder->reencodeInstruction(image + site * siteStride) != 0) {
+            printf("process %d: failed to translate site %lu\n", index, site);
+            return 1;
+        }
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("process %2d: %8.2f ms, shared cache %lu -> %lu records\n", index, elapsed.count(), before, shared.size());
+    return 0;
+}
+
+static pid_t spawn(const char* self, int index, const char* imagePath, const char* sharedName) {
+    std::string indexArg = std::to_string(index);
+    std::vector<char*> argv = { (char*)self, (char*)"--child", indexArg.data(), (char*)imagePath, (char*)sharedName, nullptr };
+    pid_t pid;
+    if (posix_spawn(&pid, self, nullptr, nullptr, argv.data(), environ) != 0) {
+        perror("posix_spawn");
+        exit(1);
+    }
+    return pid;
+}
+
+static bool waitFor(pid_t pid) {
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 5 && strcmp(argv[1], "--child") == 0) {
+        return child(atoi(argv[2]), argv[3], argv[4]);
+    }
+    int processes = argc > 1 ? atoi(argv[1]) : 8;
+    if (processes < 2) {
+        printf("usage: %s [processes, at least 2]\n", argv[0]);
+        return 1;
+    }
+
+    char dir[] = "linearavx-shared-test-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string imagePath = std::string(dir) + "/image.bin";
+    // a configuration of its own, so the test never shares with anything else
+    std::string sharedName = SharedCache::name(getpid());
+    SharedCache::remove(sharedName.c_str());
+
+    auto image = makeImage();
+    FILE* file = fopen(imagePath.c_str(), "wb");
+    fwrite(image.data(), 1, image.size(), file);
+    fclose(file);
+
+    fflush(stdout);
+    bool passed = waitFor(spawn(argv[0], 0, imagePath.c_str(), sharedName.c_str()));
+    size_t afterFirst = SharedCache(sharedName.c_str()).size();
+
+    fflush(stdout);
+    std::vector<pid_t> pids;
+    for (int i = 1; i < processes; i++) {
+        pids.push_back(spawn(argv[0], i, imagePath.c_str(), sharedName.c_str()));
+    }
+    for (auto pid : pids) {
+        passed = waitFor(pid) && passed;
+    }
+    size_t afterRest = SharedCache(sharedName.c_str()).size();
+
+    printf("%lu sites, first process stored %lu translations, the other %d stored %lu\n",
+        numSites, afterFirst, processes - 1, afterRest - afterFirst);
+    if (afterFirst != numSites || afterRest != afterFirst) {
+        printf("Expected only the first process to translate\n");
+        passed = false;
+    }
+
+    SharedCache::remove(sharedName.c_str());
+    unlink(imagePath.c_str());
+    rmdir(dir);
+    return passed ? 0 : 1;
+}
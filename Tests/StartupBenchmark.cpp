@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <spawn.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <vector>
+
+// Starts a program that never runs AVX code with and without the library
+// injected, and compares the time to exit and the peak RSS of the process.
+//
+// startup_benchmark <path to libavxhandler> [program [args...]]
+// runs this benchmark itself as a trivial child when no program is given,
+// system binaries may have the injection variable stripped on macOS.
+
+extern char** environ;
+
+static const uint32_t runs = 200;
+
+#ifdef __APPLE__
+static const char* preloadVariable = "DYLD_INSERT_LIBRARIES";
+// ru_maxrss is in bytes
+static const long rssUnit = 1024;
+#else
+static const char* preloadVariable = "LD_PRELOAD";
+// ru_maxrss is in kilobytes
+static const long rssUnit = 1;
+#endif
+
+struct Run {
+    double microseconds;
+    long rssKb;
+};
+
+static Run spawnOnce(std::vector<char*> const& argv, std::vector<char*> const& env) {
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid;
+    if (posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), env.data()) != 0) {
+        perror("posix_spawn");
+        exit(1);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%s did not exit cleanly\n", argv[0]);
+        exit(1);
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return {elapsed.count(), usage.ru_maxrss / rssUnit};
+}
+
+static void report(const char* name, std::vector<char*> const& argv, std::vector<char*> const& env) {
+    std::vector<double> latencies;
+    long rss = 0;
+    for (uint32_t i = 0; i < runs; i++) {
+        auto run = spawnOnce(argv, env);
+        latencies.push_back(run.microseconds);
+        rss = std::max(rss, run.rssKb);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-10s %12.1f %12.1f %12ld\n", name, latencies[runs / 2], latencies[runs * 9 / 10], rss);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "--child") == 0) {
+        return 0;
+    }
+    if (argc < 2) {
+        printf("usage: %s <library> [program [args...]]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<char*> childArgv;
+    if (argc > 2) {
+        childArgv.assign(argv + 2, argv + argc);
+    } else {
+        childArgv = {argv[0], (char*)"--child"};
+    }
+    childArgv.push_back(nullptr);
+
+    std::vector<char*> plainEnv;
+    for (char** var = environ; *var != nullptr; var++) {
+        if (strncmp(*var, preloadVariable, strlen(preloadVariable)) != 0) {
+            plainEnv.push_back(*var);
+        }
+    }
+    auto preloadEnv = plainEnv;
+    std::string preload = std::string(preloadVariable) + "=" + argv[1];
+    preloadEnv.push_back(preload.data());
+    plainEnv.push_back(nullptr);
+    preloadEnv.push_back(nullptr);
+
+    printf("%-10s %12s %12s %12s\n", "", "median us", "p90 us", "max RSS kB");
+    report("plain", childArgv, plainEnv);
+    report("preloaded", childArgv, preloadEnv);
+    return 0;
+}
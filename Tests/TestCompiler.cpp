@@ -51,8 +51,10 @@ const std::vector<xed_reg_enum_t> TestCompiler::ymmRegs = {
     XED_REG_YMM15
 };
 
-TestCompiler::TestCompiler(InstructionMetadata const& metadata)
+TestCompiler::TestCompiler(InstructionMetadata const& metadata, bool peephole, bool deadScratch)
 : metadata(metadata)
+, peephole(peephole)
+, deadScratch(deadScratch)
 {}
 
 std::vector<ThunkRequest> TestCompiler::generateInstructions() const {
@@ -280,11 +282,13 @@ void* TestCompiler::compileRequests(std::vector<xed_encoder_request_t> requests)
     }
 
     uint8_t* stencil = alloc_executable(totalOlen);
+    uint8_t* code = code_cache_writable(stencil);
     uint32_t offset = 0;
     for (auto const &instr : instructions) {
-        memcpy(stencil + offset, instr.buf, instr.length);
+        memcpy(code + offset, instr.buf, instr.length);
         offset += instr.length;
     }
+    write_protect_memory(stencil, totalOlen);
     return stencil;
 }
 
@@ -333,11 +337,20 @@ void* TestCompiler::compileNativeThunk(ThunkRequest const& request) const {
 
 void* TestCompiler::compileTranslatedThunk(ThunkRequest const& request) const {
     xed_iclass_enum_t iclass = request.iclass;
-    auto instructionFactory = iclassMapping.at(iclass);
+    auto instructionFactory = iclassMapping.factory(iclass);
     auto xedd = populateDecodedInst(request.instructionRequest);
     auto instruction = instructionFactory(0, 0, xedd);
 
     Compiler compiler;
+    compiler.setPeephole(peephole);
+    if (deadScratch) {
+        LiveState live;
+        live.flags = Liveness::arithmeticFlags();
+        for (auto reg : request.usedRegisters) {
+            live.insert(reg);
+        }
+        compiler.setLiveOut(live);
+    }
     compiler.addInstruction(instruction);
     uint32_t olen;
     return compiler.encode(CompilationStrategy::DirectCall, &olen, 0);
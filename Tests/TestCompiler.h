@@ -84,12 +84,18 @@ struct TestThunk {
     const void* compiledTranslatedThunk;
 };
 
+xed_decoded_inst_t populateDecodedInst(xed_encoder_request_t req);
+
 class TestCompiler {
     InstructionMetadata const& metadata;
+    const bool peephole;
+    // only the registers the harness compares are live after the instruction
+    const bool deadScratch;
 public:
-    TestCompiler(InstructionMetadata const& metadata);
+    TestCompiler(InstructionMetadata const& metadata, bool peephole = true, bool deadScratch = false);
 
     std::vector<TestThunk> getThunks() const;
+    std::vector<ThunkRequest> generateInstructions() const;
 
     static void* compileRequests(std::vector<xed_encoder_request_t> requests);
 
@@ -100,7 +106,6 @@ public:
     static const std::vector<xed_reg_enum_t> ymmRegs;
 
 private:
-    std::vector<ThunkRequest> generateInstructions() const;
     ThunkRequest generateInstruction(OperandsMetadata const& operands) const;
     TestThunk compileThunk(ThunkRequest const& request) const;
     void* compileNativeThunk(ThunkRequest const& request) const;
@@ -0,0 +1,169 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "../Compiler/Arena.h"
+#include "../Compiler/Compiler.h"
+#include "../Instructions/Instructions.h"
+#include "../memmanager.h"
+
+// Decodes and compiles a mixed block the way a trap does, with the allocations
+// going to the heap and with them taken from the translation arena, checks both
+// compile to the same bytes and compares heap allocations and latency per block.
+
+static const uint32_t rounds = 2000;
+
+static const xed_state_t dstate = {.mmode = XED_MACHINE_MODE_LONG_64,
+                                   .stack_addr_width = XED_ADDRESS_WIDTH_64b};
+
+static uint64_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    if (void* p = malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    allocations++;
+    if (void* p = aligned_alloc((size_t)alignment, (size + (size_t)alignment - 1) & ~((size_t)alignment - 1))) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { free(p); }
+
+static xed_encoder_request_t inst(xed_iclass_enum_t iclass, xed_uint_t width, xed_encoder_operand_t op0, xed_encoder_operand_t op1) {
+    xed_encoder_request_t req;
+    xed_encoder_instruction_t enc_inst;
+    xed_inst2(&enc_inst, dstate, iclass, width, op0, op1);
+    xed_convert_to_encoder_request(&req, &enc_inst);
+    return req;
+}
+
+static xed_encoder_request_t inst(xed_iclass_enum_t iclass, xed_uint_t width, xed_encoder_operand_t op0, xed_encoder_operand_t op1, xed_encoder_operand_t op2) {
+    xed_encoder_request_t req;
+    xed_encoder_instruction_t enc_inst;
+    xed_inst3(&enc_inst, dstate, iclass, width, op0, op1, op2);
+    xed_convert_to_encoder_request(&req, &enc_inst);
+    return req;
+}
+
+// YMM arithmetic with memory and RIP-relative operands, BMI shifts and GPR code in between
+static std::vector<uint8_t> mixedBlock() {
+    std::vector<xed_encoder_request_t> requests = {
+        inst(XED_ICLASS_VMOVUPS, 256, xed_reg(XED_REG_YMM0), xed_mem_bd(XED_REG_RSI, xed_disp(0, 8), 256)),
+        inst(XED_ICLASS_VADDPS, 256, xed_reg(XED_REG_YMM1), xed_reg(XED_REG_YMM0), xed_reg(XED_REG_YMM2)),
+        inst(XED_ICLASS_VMULPS, 256, xed_reg(XED_REG_YMM3), xed_reg(XED_REG_YMM1), xed_mem_bd(XED_REG_RIP, xed_disp(0x100, 32), 256)),
+        inst(XED_ICLASS_ADD, 64, xed_reg(XED_REG_RSI), xed_imm0(32, 8)),
+        inst(XED_ICLASS_VSUBPS, 256, xed_reg(XED_REG_YMM4), xed_reg(XED_REG_YMM3), xed_reg(XED_REG_YMM0)),
+        inst(XED_ICLASS_SHLX, 64, xed_reg(XED_REG_RDX), xed_reg(XED_REG_RBX), xed_reg(XED_REG_RCX)),
+        inst(XED_ICLASS_VXORPS, 128, xed_reg(XED_REG_XMM5), xed_reg(XED_REG_XMM5), xed_reg(XED_REG_XMM6)),
+        inst(XED_ICLASS_MOV, 64, xed_reg(XED_REG_RAX), xed_mem_bd(XED_REG_RSP, xed_disp(8, 8), 64)),
+        inst(XED_ICLASS_VPCMPEQD, 128, xed_reg(XED_REG_XMM7), xed_reg(XED_REG_XMM5), xed_reg(XED_REG_XMM0)),
+        inst(XED_ICLASS_VMOVUPS, 256, xed_mem_bd(XED_REG_RDI, xed_disp(0, 8), 256), xed_reg(XED_REG_YMM4)),
+    };
+
+    std::vector<uint8_t> bytes;
+    for (auto req : requests) {
+        uint8_t buffer[15];
+        uint32_t olen;
+        if (xed_encode(&req, buffer, 15, &olen) != XED_ERROR_NONE) {
+            printf("Can't encode %s\n", xed_iclass_enum_t2str(xed_encoder_request_get_iclass(&req)));
+            exit(1);
+        }
+        bytes.insert(bytes.end(), buffer, buffer + olen);
+    }
+    return bytes;
+}
+
+// Decode, instantiate and compile as Encoder::translate does, the compiled bytes go to out
+static void translateBlock(std::vector<uint8_t> const& block, std::vector<uint8_t>* out) {
+    Compiler compiler;
+    for (size_t offset = 0; offset < block.size();) {
+        xed_decoded_inst_t xedd;
+        xed_decoded_inst_zero(&xedd);
+        xed_decoded_inst_set_mode(&xedd, dstate.mmode, dstate.stack_addr_width);
+        xed_decode(&xedd, block.data() + offset, std::min<size_t>(15, block.size() - offset));
+        auto ilen = xed_decoded_inst_get_length(&xedd);
+        auto rip = (uint64_t)block.data() + offset;
+
+        if (auto factory = iclassMapping.factory(xed_decoded_inst_get_iclass(&xedd))) {
+            compiler.addInstruction(factory(rip, ilen, xedd));
+        } else {
+            compiler.addInstruction(std::allocate_shared<NativeInstruction>(ArenaAllocator<NativeInstruction>(), rip, ilen, xedd));
+        }
+        offset += ilen;
+    }
+
+    auto encoded = compiler.compile(CompilationStrategy::DirectCall, 0);
+    if (out != nullptr) {
+        for (auto const& instr : encoded) {
+            out->insert(out->end(), instr.buffer, instr.buffer + instr.olen);
+        }
+    }
+}
+
+struct Measurement {
+    double nanoseconds;
+    double allocations;
+};
+
+template<typename F>
+static Measurement measure(F translate) {
+    uint64_t allocationsBefore = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < rounds; round++) {
+        translate();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return {elapsed.count() / rounds, (double)(allocations - allocationsBefore) / rounds};
+}
+
+int main() {
+    xed_tables_init();
+    init_ymm_storage();
+
+    auto block = mixedBlock();
+
+    std::vector<uint8_t> heapBytes;
+    std::vector<uint8_t> arenaBytes;
+    translateBlock(block, &heapBytes);
+    {
+        ArenaScope arena;
+        translateBlock(block, &arenaBytes);
+    }
+    bool passed = true;
+    if (heapBytes != arenaBytes) {
+        printf("Compiling in the arena changes the translation\n");
+        passed = false;
+    }
+
+    auto heap = measure([&]() {
+        translateBlock(block, nullptr);
+    });
+    auto arena = measure([&]() {
+        ArenaScope arena;
+        translateBlock(block, nullptr);
+    });
+
+    printf("%-8s %12s %12s\n", "", "allocations", "ns/block");
+    printf("%-8s %12.1f %12.1f\n", "heap", heap.allocations, heap.nanoseconds);
+    printf("%-8s %12.1f %12.1f\n", "arena", arena.allocations, arena.nanoseconds);
+    if (arena.allocations != 0) {
+        printf("Translating in the arena still allocates from the heap\n");
+        passed = false;
+    }
+
+    return passed ? 0 : 1;
+}
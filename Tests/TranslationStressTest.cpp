@@ -0,0 +1,91 @@
+#include "../Compiler/Encoder.h"
+#include "../memmanager.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Many threads trap on many distinct sites at once, each thread walking the
+// sites from a different starting point so that most sites are contended.
+
+static const size_t numSites = 4096;
+static const size_t siteStride = 32;
+
+// VADDPS ymm0, ymm1, ymm2
+static const uint8_t vaddps[] = { 0xc5, 0xf4, 0x58, 0xc2 };
+
+static uint8_t* makeSites() {
+    uint8_t* code = alloc_executable(numSites * siteStride);
+    memset(code, 0xcc, numSites * siteStride);
+    for (size_t site = 0; site < numSites; site++) {
+        uint8_t* p = code + site * siteStride;
+        // every fourth site is too short for a jump and ends up as a trap site
+        size_t count = site % 4 == 0 ? 1 : 4;
+        for (size_t i = 0; i < count; i++) {
+            memcpy(p, vaddps, sizeof(vaddps));
+            p += sizeof(vaddps);
+        }
+        *p = 0xc3; // RET stops the decoder
+    }
+    return code;
+}
+
+static size_t run(int numThreads) {
+    auto encoder = std::make_unique<Encoder>(Cache());
+    uint8_t* code = makeSites();
+
+    std::atomic<bool> start = false;
+    std::atomic<size_t> failures = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&, t]() {
+            while (!start.load()) {}
+            size_t first = t * numSites / numThreads;
+            for (size_t i = 0; i < numSites; i++) {
+                size_t site = (first + i) % numSites;
+                if (encoder->reencodeInstruction(code + site * siteStride) < 0) {
+                    failures++;
+                }
+            }
+        });
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    start = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    size_t untranslated = 0;
+    for (size_t site = 0; site < numSites; site++) {
+        if (code[site * siteStride] == vaddps[0]) {
+            untranslated++;
+        }
+    }
+
+    printf("threads=%2d  %lu sites translated in %.2f ms, %lu failures, %lu untranslated\n",
+        numThreads, numSites, std::chrono::duration<double, std::milli>(end - begin).count(), failures.load(), untranslated);
+
+    return failures + untranslated;
+}
+
+int main() {
+    xed_tables_init();
+    init_ymm_storage();
+
+    int maxThreads = std::max(16u, std::thread::hardware_concurrency());
+    size_t numErrors = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        numErrors += run(threads);
+    }
+
+    printf("There were %lu errors\n", numErrors);
+    return numErrors == 0 ? 0 : 1;
+}
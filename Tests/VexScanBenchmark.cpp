@@ -0,0 +1,162 @@
+#include "../Scanner/VexScanner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <unordered_set>
+#include <vector>
+
+// Scans the .text sections of the ELF files given on the command line, repeated
+// until a few hundred MB went through, and reports throughput of the candidate
+// search and of the full scan together with the false-positive rate of C4/C5 bytes.
+//
+//   vex_scan_benchmark /usr/lib/x86_64-linux-gnu/*.so*
+
+static const uint64_t targetBytes = 256ull << 20;
+
+// Just enough of the ELF64 layout to find sections
+struct ElfHeader {
+    uint8_t ident[16];
+    uint16_t type, machine;
+    uint32_t version;
+    uint64_t entry, phoff, shoff;
+    uint32_t flags;
+    uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+
+struct ElfSection {
+    uint32_t name, type;
+    uint64_t flags, addr, offset, size;
+    uint32_t link, info;
+    uint64_t addralign, entsize;
+};
+
+static bool readText(const char* path, std::vector<std::vector<uint8_t>>& sections) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(ElfHeader) || memcmp(data.data(), "\x7f" "ELF\x02", 5) != 0) {
+        return false;
+    }
+
+    auto header = (const ElfHeader*)data.data();
+    if (header->shoff + (uint64_t)header->shnum * sizeof(ElfSection) > data.size() || header->shstrndx >= header->shnum) {
+        return false;
+    }
+    auto sectionHeaders = (const ElfSection*)(data.data() + header->shoff);
+    auto names = sectionHeaders[header->shstrndx];
+    for (uint16_t i = 0; i < header->shnum; i++) {
+        auto const& section = sectionHeaders[i];
+        if (names.offset + section.name >= data.size() || section.offset + section.size > data.size()) {
+            continue;
+        }
+        if (strcmp((const char*)data.data() + names.offset + section.name, ".text") == 0) {
+            sections.emplace_back(data.begin() + section.offset, data.begin() + section.offset + section.size);
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename F>
+static double seconds(F f) {
+    auto begin = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+// Decodes every instruction from the start of the section, the slow way eager scanning would otherwise take
+static std::unordered_set<const uint8_t*> linearSweep(std::vector<uint8_t>& section) {
+    std::unordered_set<const uint8_t*> sites;
+    const uint8_t* p = section.data();
+    const uint8_t* end = section.data() + section.size();
+    while (p < end) {
+        xed_decoded_inst_t xedd;
+        xed_decoded_inst_zero(&xedd);
+        xed_decoded_inst_set_mode(&xedd, XED_MACHINE_MODE_LONG_64, XED_ADDRESS_WIDTH_64b);
+        if (xed_decode(&xedd, p, std::min<uint64_t>(15, end - p)) != XED_ERROR_NONE) {
+            p++;
+            continue;
+        }
+        if ((*p & 0xfe) == 0xc4) {
+            sites.insert(p);
+        }
+        p += xed_decoded_inst_get_length(&xedd);
+    }
+    return sites;
+}
+
+int main(int argc, char** argv) {
+    xed_tables_init();
+
+    std::vector<std::vector<uint8_t>> sections;
+    uint64_t corpusBytes = 0;
+    for (int i = 1; i < argc; i++) {
+        if (readText(argv[i], sections)) {
+            corpusBytes += sections.back().size();
+        }
+    }
+    if (corpusBytes == 0) {
+        printf("Usage: %s <ELF files with .text>...\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t repeats = (targetBytes + corpusBytes - 1) / corpusBytes;
+    double totalGB = (double)corpusBytes * repeats / 1e9;
+    printf("%lu .text sections, %.1f MB, scanned %lu times\n", sections.size(), corpusBytes / 1048576.0, repeats);
+
+    std::vector<VexScanner::Kernel> kernels = { VexScanner::Kernel::Scalar, VexScanner::Kernel::SSE2 };
+    if (VexScanner::bestKernel() == VexScanner::Kernel::AVX2) {
+        kernels.push_back(VexScanner::Kernel::AVX2);
+    }
+
+    std::vector<uint32_t> offsets;
+    for (auto kernel : kernels) {
+        VexScanner scanner(kernel);
+        uint64_t candidates = 0;
+        double time = seconds([&]() {
+            for (uint64_t r = 0; r < repeats; r++) {
+                for (auto& section : sections) {
+                    offsets.clear();
+                    scanner.findCandidates(section.data(), section.data() + section.size(), offsets);
+                    candidates += offsets.size();
+                }
+            }
+        });
+        printf("candidates %-6s %7.2f GB/s  (%lu candidates)\n", VexScanner::kernelName(kernel), totalGB / time, candidates / repeats);
+    }
+
+    VexScanner scanner;
+    VexScanStats stats;
+    std::unordered_set<const uint8_t*> scanned;
+    double scanTime = seconds([&]() {
+        for (auto& section : sections) {
+            stats += scanner.scan(section.data(), section.data() + section.size(), [&](uint8_t* site, xed_decoded_inst_t const& xedd, bool confirmed) {
+                scanned.insert(site);
+            });
+        }
+    });
+    // without symbols nothing is an anchor, every site is a hint
+    uint64_t found = stats.confirmed + stats.hints;
+    printf("full scan %-6s %7.2f GB/s  %lu candidates, %lu sites (%lu confirmed), %.1f%% false positives\n",
+        VexScanner::kernelName(VexScanner::bestKernel()), corpusBytes / 1e9 / scanTime,
+        stats.candidates, found, stats.confirmed, 100.0 * (stats.candidates - found) / stats.candidates);
+
+    uint64_t sweepSites = 0;
+    uint64_t agreeing = 0;
+    double sweepTime = seconds([&]() {
+        for (auto& section : sections) {
+            for (auto site : linearSweep(section)) {
+                sweepSites++;
+                agreeing += scanned.contains(site);
+            }
+        }
+    });
+    printf("linear sweep    %7.2f GB/s  %lu VEX instructions, %lu also found by the scanner, %lu found only by the scanner\n",
+        corpusBytes / 1e9 / sweepTime, sweepSites, agreeing, scanned.size() - agreeing);
+
+    return 0;
+}
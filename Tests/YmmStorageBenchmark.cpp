@@ -0,0 +1,66 @@
+#include "Harness.h"
+#include "TestCompiler.h"
+
+#include <cstdio>
+
+#include "../Instructions/Metadata.h"
+#include "../Instructions/Instructions.h"
+#include "../memmanager.h"
+#include "xed/xed-iform-enum.h"
+
+// Compiles the harness thunks twice, once calling get_ymm_storage and once
+// addressing the storage through FS/GS, and compares cycles per call.
+
+static const uint32_t iterations = 10000;
+
+InstructionMetadata benchmarks[] = {
+    VADDPS::Metadata,
+    VMULPD::Metadata,
+    VXORPS::Metadata,
+    VMOVUPS::Metadata,
+    VPERMILPS::Metadata,
+    VBLENDVPS::Metadata,
+    VINSERTF128::Metadata,
+    VEXTRACTF128::Metadata,
+    VFMADD231PS::Metadata,
+    VADDSS::Metadata,
+    VPADDD::Metadata,
+};
+
+int main() {
+    xed_tables_init();
+    if (!init_ymm_storage()) {
+        printf("Direct YMM storage access is not available\n");
+        return 1;
+    }
+
+    uint64_t nativeTotal = 0;
+    uint64_t callTotal = 0;
+    uint64_t directTotal = 0;
+
+    printf("%-40s %8s %8s %8s\n", "", "native", "call", "direct");
+    for (auto metadata : benchmarks) {
+        TestCompiler compiler(metadata);
+        set_ymm_storage_direct(false);
+        auto callThunks = compiler.getThunks();
+        set_ymm_storage_direct(true);
+        auto directThunks = compiler.getThunks();
+
+        for (size_t i = 0; i < callThunks.size(); i++) {
+            Harness callHarness(callThunks[i]);
+            Harness directHarness(directThunks[i]);
+            uint64_t native = callHarness.measureCycles(callThunks[i].compiledNativeThunk, false, iterations);
+            uint64_t call = callHarness.measureCycles(callThunks[i].compiledTranslatedThunk, true, iterations);
+            uint64_t direct = directHarness.measureCycles(directThunks[i].compiledTranslatedThunk, true, iterations);
+            printf("%-40s %8lu %8lu %8lu\n", xed_iform_enum_t2str(callThunks[i].iform), native, call, direct);
+
+            nativeTotal += native;
+            callTotal += call;
+            directTotal += direct;
+        }
+    }
+
+    printf("Overhead over native: %lu cycles calling get_ymm_storage, %lu cycles direct\n",
+        callTotal - nativeTotal, directTotal - nativeTotal);
+    return 0;
+}
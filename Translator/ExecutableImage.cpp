@@ -0,0 +1,358 @@
+#include "ExecutableImage.h"
+#include "../Scanner/FunctionStarts.h"
+
+#include <algorithm>
+#include <cstring>
+
+// The headers of each format are declared here, none of the system headers
+// for them is available on every host
+
+struct Elf64Header {
+    uint8_t ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+};
+
+struct Elf64SectionHeader {
+    uint32_t name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t addr;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint32_t info;
+    uint64_t addralign;
+    uint64_t entsize;
+};
+
+struct Elf64ProgramHeader {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t filesz;
+    uint64_t memsz;
+    uint64_t align;
+};
+
+static const uint16_t elfMachineX86_64 = 62;
+static const uint32_t elfSectionNoBits = 8;
+static const uint64_t elfSectionExecute = 0x4;
+static const uint32_t elfSegmentLoad = 1;
+static const uint32_t elfSegmentExecute = 0x1;
+static const uint32_t elfSegmentEhFrame = 0x6474e550;
+
+struct PeFileHeader {
+    uint16_t machine;
+    uint16_t numberOfSections;
+    uint32_t timeDateStamp;
+    uint32_t pointerToSymbolTable;
+    uint32_t numberOfSymbols;
+    uint16_t sizeOfOptionalHeader;
+    uint16_t characteristics;
+};
+
+struct PeSectionHeader {
+    char name[8];
+    uint32_t virtualSize;
+    uint32_t virtualAddress;
+    uint32_t sizeOfRawData;
+    uint32_t pointerToRawData;
+    uint32_t pointerToRelocations;
+    uint32_t pointerToLinenumbers;
+    uint16_t numberOfRelocations;
+    uint16_t numberOfLinenumbers;
+    uint32_t characteristics;
+};
+
+static const uint16_t peMachineAmd64 = 0x8664;
+static const uint32_t peSectionCode = 0x20;
+static const uint32_t peSectionExecute = 0x20000000;
+static const uint16_t peOptionalMagic64 = 0x20b;
+// the exception directory in the optional header of PE32+, the RVA and size of .pdata
+static const uint64_t peExceptionDirectory = 112 + 3 * 8;
+static const uint32_t peRuntimeFunctionSize = 12;
+
+struct MachHeader64 {
+    uint32_t magic;
+    int32_t cputype;
+    int32_t cpusubtype;
+    uint32_t filetype;
+    uint32_t ncmds;
+    uint32_t sizeofcmds;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct MachLoadCommand {
+    uint32_t cmd;
+    uint32_t cmdsize;
+};
+
+struct MachSegment64 {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    char segname[16];
+    uint64_t vmaddr;
+    uint64_t vmsize;
+    uint64_t fileoff;
+    uint64_t filesize;
+    int32_t maxprot;
+    int32_t initprot;
+    uint32_t nsects;
+    uint32_t flags;
+};
+
+struct MachSection64 {
+    char sectname[16];
+    char segname[16];
+    uint64_t addr;
+    uint64_t size;
+    uint32_t offset;
+    uint32_t align;
+    uint32_t reloff;
+    uint32_t nreloc;
+    uint32_t flags;
+    uint32_t reserved1;
+    uint32_t reserved2;
+    uint32_t reserved3;
+};
+
+static const uint32_t machMagic64 = 0xfeedfacf;
+static const int32_t machCpuX86_64 = 0x01000007;
+static const uint32_t machSegment64 = 0x19;
+static const uint32_t machFunctionStarts = 0x26;
+static const uint32_t machSomeInstructions = 0x00000400;
+static const uint32_t machPureInstructions = 0x80000000;
+
+struct MachLinkeditData {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t dataoff;
+    uint32_t datasize;
+};
+
+// Copies a header out of the file, false if it doesn't fit
+template<typename T>
+static bool read(const uint8_t* contents, size_t size, uint64_t offset, T* header) {
+    if (offset > size || size - offset < sizeof(T)) {
+        return false;
+    }
+    memcpy(header, contents + offset, sizeof(T));
+    return true;
+}
+
+static void addSection(ExecutableImage* image, size_t fileSize, std::string name, uint64_t offset, uint64_t size) {
+    if (size == 0 || offset >= fileSize) {
+        return;
+    }
+    if (size > fileSize - offset) {
+        size = fileSize - offset;
+    }
+    image->sections.push_back({ std::move(name), offset, size });
+}
+
+// A range of addresses as it is laid out in the file
+struct FileMapping {
+    uint64_t address;
+    uint64_t size;
+    uint64_t offset;
+};
+
+static void addFunctionStart(ExecutableImage* image, std::vector<FileMapping> const& mappings, uint64_t address) {
+    for (auto const& mapping : mappings) {
+        if (address >= mapping.address && address - mapping.address < mapping.size) {
+            image->functionStarts.push_back(mapping.offset + (address - mapping.address));
+            return;
+        }
+    }
+}
+
+static bool parseElf(const uint8_t* contents, size_t size, ExecutableImage* image) {
+    Elf64Header header;
+    if (!read(contents, size, 0, &header) || memcmp(header.ident, "\x7f" "ELF", 4) != 0) {
+        return false;
+    }
+    // 64-bit little endian x86-64
+    if (header.ident[4] != 2 || header.ident[5] != 1 || header.machine != elfMachineX86_64) {
+        return false;
+    }
+    image->format = "ELF";
+
+    Elf64SectionHeader names = {};
+    bool haveNames = header.shstrndx < header.shnum
+        && read(contents, size, header.shoff + (uint64_t)header.shstrndx * sizeof(Elf64SectionHeader), &names);
+    for (uint16_t i = 0; i < header.shnum; i++) {
+        Elf64SectionHeader section;
+        if (!read(contents, size, header.shoff + (uint64_t)i * sizeof(Elf64SectionHeader), &section)) {
+            break;
+        }
+        if (!(section.flags & elfSectionExecute) || section.type == elfSectionNoBits) {
+            continue;
+        }
+        std::string name;
+        if (haveNames && section.name < names.size && names.offset + section.name < size) {
+            auto start = (const char*)contents + names.offset + section.name;
+            name.assign(start, strnlen(start, size - (names.offset + section.name)));
+        }
+        addSection(image, size, name, section.offset, section.size);
+    }
+
+    bool stripped = image->sections.empty();
+    std::vector<FileMapping> mappings;
+    Elf64ProgramHeader ehFrame = {};
+    for (uint16_t i = 0; i < header.phnum; i++) {
+        Elf64ProgramHeader segment;
+        if (!read(contents, size, header.phoff + (uint64_t)i * sizeof(Elf64ProgramHeader), &segment)) {
+            break;
+        }
+        if (segment.type == elfSegmentLoad) {
+            mappings.push_back({ segment.vaddr, segment.filesz, segment.offset });
+            // stripped of section headers, the executable segments are all there is
+            if (stripped && (segment.flags & elfSegmentExecute)) {
+                addSection(image, size, "PT_LOAD", segment.offset, segment.filesz);
+            }
+        }
+        if (segment.type == elfSegmentEhFrame) {
+            ehFrame = segment;
+        }
+    }
+
+    std::vector<int64_t> starts;
+    if (ehFrame.filesz != 0 && ehFrame.offset < size
+        && ehFrameHdrFunctionStarts(contents + ehFrame.offset, std::min<uint64_t>(ehFrame.filesz, size - ehFrame.offset), starts)) {
+        for (auto start : starts) {
+            addFunctionStart(image, mappings, ehFrame.vaddr + start);
+        }
+    }
+    return true;
+}
+
+static bool parsePe(const uint8_t* contents, size_t size, ExecutableImage* image) {
+    uint32_t peOffset;
+    if (size < 0x40 || contents[0] != 'M' || contents[1] != 'Z' || !read(contents, size, 0x3c, &peOffset)) {
+        return false;
+    }
+    PeFileHeader header;
+    if (!read(contents, size, (uint64_t)peOffset + 4, &header) || memcmp(contents + peOffset, "PE\0\0", 4) != 0) {
+        return false;
+    }
+    if (header.machine != peMachineAmd64) {
+        return false;
+    }
+    image->format = "PE";
+
+    uint64_t optionalHeader = (uint64_t)peOffset + 4 + sizeof(PeFileHeader);
+    uint64_t sections = optionalHeader + header.sizeOfOptionalHeader;
+    std::vector<FileMapping> mappings;
+    for (uint16_t i = 0; i < header.numberOfSections; i++) {
+        PeSectionHeader section;
+        if (!read(contents, size, sections + (uint64_t)i * sizeof(PeSectionHeader), &section)) {
+            break;
+        }
+        mappings.push_back({ section.virtualAddress, std::min(section.virtualSize, section.sizeOfRawData), section.pointerToRawData });
+        if (!(section.characteristics & (peSectionCode | peSectionExecute))) {
+            continue;
+        }
+        // the raw data is padded to the file alignment, the rest of it isn't code
+        uint32_t length = section.sizeOfRawData;
+        if (section.virtualSize != 0 && section.virtualSize < length) {
+            length = section.virtualSize;
+        }
+        addSection(image, size, std::string(section.name, strnlen(section.name, sizeof(section.name))), section.pointerToRawData, length);
+    }
+
+    // every function that isn't a leaf has a RUNTIME_FUNCTION in .pdata, sorted by its start
+    uint16_t magic;
+    uint32_t exceptions[2];
+    if (header.sizeOfOptionalHeader >= peExceptionDirectory + sizeof(exceptions)
+        && read(contents, size, optionalHeader, &magic) && magic == peOptionalMagic64
+        && read(contents, size, optionalHeader + peExceptionDirectory, &exceptions)) {
+        for (uint32_t entry = 0; entry + peRuntimeFunctionSize <= exceptions[1]; entry += peRuntimeFunctionSize) {
+            uint32_t begin = 0;
+            for (auto const& mapping : mappings) {
+                uint64_t rva = (uint64_t)exceptions[0] + entry;
+                if (rva >= mapping.address && rva - mapping.address + sizeof(begin) <= mapping.size) {
+                    read(contents, size, mapping.offset + (rva - mapping.address), &begin);
+                    break;
+                }
+            }
+            if (begin != 0) {
+                addFunctionStart(image, mappings, begin);
+            }
+        }
+    }
+    return true;
+}
+
+static bool parseMachO(const uint8_t* contents, size_t size, ExecutableImage* image) {
+    MachHeader64 header;
+    if (!read(contents, size, 0, &header) || header.magic != machMagic64 || header.cputype != machCpuX86_64) {
+        return false;
+    }
+    image->format = "Mach-O";
+
+    std::vector<FileMapping> mappings;
+    uint64_t textAddress = 0;
+    MachLinkeditData functionStarts = {};
+    uint64_t command = sizeof(MachHeader64);
+    for (uint32_t i = 0; i < header.ncmds; i++) {
+        MachLoadCommand load;
+        if (!read(contents, size, command, &load) || load.cmdsize < sizeof(MachLoadCommand)) {
+            break;
+        }
+        if (load.cmd == machFunctionStarts) {
+            read(contents, size, command, &functionStarts);
+        }
+        MachSegment64 segment;
+        if (load.cmd == machSegment64 && read(contents, size, command, &segment)) {
+            mappings.push_back({ segment.vmaddr, segment.filesize, segment.fileoff });
+            if (strncmp(segment.segname, "__TEXT", sizeof(segment.segname)) == 0) {
+                textAddress = segment.vmaddr;
+            }
+            for (uint32_t j = 0; j < segment.nsects; j++) {
+                MachSection64 section;
+                if (!read(contents, size, command + sizeof(MachSegment64) + (uint64_t)j * sizeof(MachSection64), &section)) {
+                    break;
+                }
+                if (section.flags & (machPureInstructions | machSomeInstructions)) {
+                    addSection(image, size, std::string(section.sectname, strnlen(section.sectname, sizeof(section.sectname))), section.offset, section.size);
+                }
+            }
+        }
+        command += load.cmdsize;
+    }
+
+    if (functionStarts.datasize != 0 && functionStarts.dataoff < size) {
+        std::vector<uint64_t> starts;
+        machOFunctionStarts(contents + functionStarts.dataoff, std::min<uint64_t>(functionStarts.datasize, size - functionStarts.dataoff), starts);
+        for (auto start : starts) {
+            addFunctionStart(image, mappings, textAddress + start);
+        }
+    }
+    return true;
+}
+
+bool parseExecutableImage(const uint8_t* contents, size_t size, ExecutableImage* image) {
+    *image = ExecutableImage();
+    if (!parseElf(contents, size, image) && !parsePe(contents, size, image) && !parseMachO(contents, size, image)) {
+        return false;
+    }
+    auto& starts = image->functionStarts;
+    std::sort(starts.begin(), starts.end());
+    starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+    return true;
+}
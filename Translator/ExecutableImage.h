@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A range of an executable file that holds code, in file offsets, which is
+// what sites are stored relative to
+struct CodeSection {
+    std::string name;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct ExecutableImage {
+    const char* format = nullptr;
+    std::vector<CodeSection> sections;
+    // file offsets of the functions the unwind info or function starts list, sorted
+    std::vector<uint64_t> functionStarts;
+};
+
+// Finds the executable sections and function starts of an x86-64 ELF, PE or
+// thin Mach-O file, false if the file is none of them
+bool parseExecutableImage(const uint8_t* contents, size_t size, ExecutableImage* image);
@@ -0,0 +1,281 @@
+#include "ExecutableImage.h"
+#include "../Cache/Cache.h"
+#include "../Cache/Module.h"
+#include "../Compiler/Encoder.h"
+#include "../Instructions/Instructions.h"
+#include "../Scanner/VexScanner.h"
+#include "../memmanager.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Translates every supported VEX site of x86-64 binaries ahead of time into
+// a cache file the runtime picks up, so a program starts with its sites
+// patched as its images are loaded instead of trapping on each of them.
+//
+// The binary is mapped from its file here as the loader would, so sites are
+// found again by file offset and module key wherever the program maps it.
+// Translations address the YMM storage where the program's process has it,
+// which the runtime logs when it opens the cache.
+
+static void usage(const char* self) {
+    printf("usage: %s [-j threads] [-o cache-dir] [-p program] [-b block-limit] [-s fs|gs:offset] binary...\n", self);
+    printf("  -j  threads to translate with, 0 for every core (default 1)\n");
+    printf("  -o  directory to write the cache file to (default .)\n");
+    printf("  -p  name of the program whose cache this is (default the first binary's)\n");
+    printf("  -b  LINEARAVX_BLOCK_LIMIT of the program (default 64)\n");
+    printf("  -s  where the program addresses YMM storage (default where this process does)\n");
+}
+
+// A supported site and its instruction as the scan found it
+struct ScannedSite {
+    uint8_t* site;
+    uint8_t length;
+    uint8_t bytes[15];
+};
+
+struct SectionScan {
+    std::vector<ScannedSite> sites;
+    uint64_t unsupported = 0;
+    uint64_t unconfirmed = 0;
+    std::map<xed_iclass_enum_t, uint64_t> unsupportedIclasses;
+};
+
+struct Binary {
+    std::string path;
+    uint8_t* contents = nullptr;
+    size_t size = 0;
+    ExecutableImage image;
+};
+
+static bool mapBinary(const char* path, Binary* binary) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        printf("Can't open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    // private, so patching the sites while translating never reaches the file
+    auto contents = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (contents == MAP_FAILED) {
+        printf("Can't map %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    binary->path = path;
+    binary->contents = (uint8_t*)contents;
+    binary->size = st.st_size;
+    if (!parseExecutableImage(binary->contents, binary->size, &binary->image)) {
+        printf("%s is not an x86-64 ELF, PE or Mach-O file\n", path);
+        return false;
+    }
+    Module module;
+    if (!moduleForAddress((uint64_t)binary->contents, &module) || module.base != (uint64_t)binary->contents) {
+        printf("Can't tell which module %s is\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bool parseStorageLocation(const char* location) {
+    xed_reg_enum_t segment;
+    if (strncmp(location, "fs:", 3) == 0) {
+        segment = XED_REG_FS;
+    } else if (strncmp(location, "gs:", 3) == 0) {
+        segment = XED_REG_GS;
+    } else {
+        return false;
+    }
+    char* end;
+    long long offset = strtoll(location + 3, &end, 0);
+    if (*end != 0 || offset < INT32_MIN || offset > INT32_MAX) {
+        return false;
+    }
+    set_ymm_storage_location(segment, (int32_t)offset);
+    return true;
+}
+
+// Runs work(i) for every i in [0, count) on the given number of threads
+template<typename Work>
+static void parallelFor(size_t count, unsigned threads, Work const& work) {
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            work(i);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < std::min<size_t>(threads, count); i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+}
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    unsigned threads = 1;
+    std::string dir = ".";
+    const char* program = nullptr;
+    uint32_t maxBlockInstructions = 64;
+    const char* storage = nullptr;
+
+    int option;
+    while ((option = getopt(argc, argv, "j:o:p:b:s:h")) != -1) {
+        switch (option) {
+            case 'j': threads = atoi(optarg) > 0 ? atoi(optarg) : std::max(1u, std::thread::hardware_concurrency()); break;
+            case 'o': dir = optarg; break;
+            case 'p': program = optarg; break;
+            case 'b': maxBlockInstructions = atoi(optarg) > 0 ? atoi(optarg) : maxBlockInstructions; break;
+            case 's': storage = optarg; break;
+            default: usage(argv[0]); return option == 'h' ? 0 : 1;
+        }
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    xed_tables_init();
+    if (storage != nullptr) {
+        if (!parseStorageLocation(storage)) {
+            printf("YMM storage location %s is not fs:offset or gs:offset\n", storage);
+            return 1;
+        }
+    } else if (!init_ymm_storage()) {
+        // chunks calling get_ymm_storage hold its absolute address, they can't be cached
+        printf("This platform can't address YMM storage through a segment, give its location with -s\n");
+        return 1;
+    }
+
+    if (program == nullptr) {
+        program = strrchr(argv[optind], '/') != nullptr ? strrchr(argv[optind], '/') + 1 : argv[optind];
+    }
+    uint64_t configuration = cacheConfiguration(maxBlockInstructions, ymm_storage_segment(), ymm_storage_offset());
+    std::string cachePath = cacheFilePath(dir, program, configuration);
+    size_t recordsBefore = Cache(cachePath.c_str(), configuration).size();
+    auto encoder = std::make_unique<Encoder>(Cache(cachePath.c_str(), configuration), maxBlockInstructions);
+
+    printf("Translating for %s with YMM storage at %s:%d on %u threads\n",
+        program, ymm_storage_segment() == XED_REG_FS ? "fs" : "gs", ymm_storage_offset(), threads);
+
+    bool failed = false;
+    for (int arg = optind; arg < argc; arg++) {
+        Binary binary;
+        if (!mapBinary(argv[arg], &binary)) {
+            failed = true;
+            continue;
+        }
+        auto const& sections = binary.image.sections;
+        auto start = std::chrono::steady_clock::now();
+
+        // cached sites are patched at load without decoding, so only sites
+        // decoded from a function start are translated
+        std::vector<uint8_t*> functionStarts;
+        for (auto offset : binary.image.functionStarts) {
+            functionStarts.push_back(binary.contents + offset);
+        }
+
+        // every section is swept on its own, nothing is patched yet
+        std::vector<SectionScan> scans(sections.size());
+        parallelFor(sections.size(), threads, [&](size_t i) {
+            auto begin = binary.contents + sections[i].offset;
+            VexScanner().scan(begin, begin + sections[i].size, [&](uint8_t* site, xed_decoded_inst_t const& xedd, bool confirmed) {
+                auto iclass = xed_decoded_inst_get_iclass(&xedd);
+                if (!confirmed) {
+                    scans[i].unconfirmed++;
+                } else if (iclassMapping.contains(iclass)) {
+                    ScannedSite scanned = { site, (uint8_t)xed_decoded_inst_get_length(&xedd) };
+                    memcpy(scanned.bytes, site, scanned.length);
+                    scans[i].sites.push_back(scanned);
+                } else {
+                    scans[i].unsupported++;
+                    scans[i].unsupportedIclasses[iclass]++;
+                }
+            }, functionStarts);
+        });
+
+        std::vector<ScannedSite> sites;
+        uint64_t codeBytes = 0;
+        uint64_t unsupported = 0;
+        uint64_t unconfirmed = 0;
+        std::map<xed_iclass_enum_t, uint64_t> unsupportedIclasses;
+        for (size_t i = 0; i < sections.size(); i++) {
+            codeBytes += sections[i].size;
+            sites.insert(sites.end(), scans[i].sites.begin(), scans[i].sites.end());
+            unsupported += scans[i].unsupported;
+            unconfirmed += scans[i].unconfirmed;
+            for (auto [iclass, count] : scans[i].unsupportedIclasses) {
+                unsupportedIclasses[iclass] += count;
+            }
+        }
+
+        // Batches of consecutive sites go to the threads. A site inside the
+        // block of an earlier one keeps its original code and gets a block of
+        // its own, for branches into the middle. Blocks overlapping across
+        // batches are sorted out by the encoder like traps racing on two threads,
+        // a site the patch of an earlier block wrote over is left alone.
+        static const size_t batchSize = 64;
+        std::atomic<uint64_t> translated = 0;
+        std::atomic<uint64_t> patched = 0;
+        std::atomic<uint64_t> failures = 0;
+        parallelFor((sites.size() + batchSize - 1) / batchSize, threads, [&](size_t batch) {
+            size_t end = std::min(sites.size(), (batch + 1) * batchSize);
+            for (size_t i = batch * batchSize; i < end; i++) {
+                if (memcmp(sites[i].site, sites[i].bytes, sites[i].length) != 0) {
+                    patched++;
+                    continue;
+                }
+                switch (encoder->reencodeInstruction(sites[i].site)) {
+                    case 0: translated++; break;
+                    case 1: patched++; break;
+                    default: failures++; break;
+                }
+            }
+        });
+
+        printf("%s: %s, %lu code sections, %.1f KB of code in %.2f ms\n",
+            binary.path.c_str(), binary.image.format, sections.size(), codeBytes / 1024.0, msSince(start));
+        printf("  %lu VEX sites: %lu supported, %lu unsupported, %lu not reached from a function start\n",
+            sites.size() + unsupported + unconfirmed, sites.size(), unsupported, unconfirmed);
+        printf("  %lu translated, %lu patched over by an earlier block, %lu failed\n",
+            translated.load(), patched.load(), failures.load());
+
+        std::vector<std::pair<uint64_t, xed_iclass_enum_t>> mostUnsupported;
+        for (auto [iclass, count] : unsupportedIclasses) {
+            mostUnsupported.push_back({ count, iclass });
+        }
+        std::sort(mostUnsupported.rbegin(), mostUnsupported.rend());
+        for (size_t i = 0; i < mostUnsupported.size() && i < 10; i++) {
+            printf("  unsupported %-16s %lu\n", xed_iclass_enum_t2str(mostUnsupported[i].second), mostUnsupported[i].first);
+        }
+    }
+
+    encoder.reset();
+    size_t recordsAfter = Cache(cachePath.c_str(), configuration).size();
+    printf("%s: %lu translations stored, %lu in total\n", cachePath.c_str(), recordsAfter - recordsBefore, recordsAfter);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Fixed-capacity open-addressed map from code addresses to 64-bit values.
+// Lookups never lock or allocate, so they are safe to do from a signal handler
+// while other threads insert. Entries are never removed and address 0 is
+// reserved to mark empty slots.
+template<size_t Capacity>
+class AddressTable {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    struct Slot {
+        std::atomic<uint64_t> key;
+        std::atomic<uint64_t> value;
+    };
+
+    Slot slots[Capacity];
+
+    static size_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        return key & (Capacity - 1);
+    }
+
+public:
+    // Returns the value word for key, claiming an empty slot if the key is new.
+    // Returns nullptr when the table is full.
+    std::atomic<uint64_t>* insert(uint64_t key) {
+        size_t idx = hash(key);
+        for (size_t probe = 0; probe < Capacity; probe++, idx = (idx + 1) & (Capacity - 1)) {
+            uint64_t current = slots[idx].key.load(std::memory_order_acquire);
+            if (current == 0) {
+                if (slots[idx].key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+                    return &slots[idx].value;
+                }
+                // lost the race for this slot, current now holds the winner's key
+            }
+            if (current == key) {
+                return &slots[idx].value;
+            }
+        }
+        return nullptr;
+    }
+
+    // Returns the value word for key or nullptr if the key was never inserted.
+    std::atomic<uint64_t> const* find(uint64_t key) const {
+        size_t idx = hash(key);
+        for (size_t probe = 0; probe < Capacity; probe++, idx = (idx + 1) & (Capacity - 1)) {
+            uint64_t current = slots[idx].key.load(std::memory_order_acquire);
+            if (current == key) {
+                return &slots[idx].value;
+            }
+            if (current == 0) {
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    bool set(uint64_t key, uint64_t value) {
+        auto slot = insert(key);
+        if (slot == nullptr) {
+            return false;
+        }
+        slot->store(value, std::memory_order_release);
+        return true;
+    }
+
+    uint64_t get(uint64_t key) const {
+        auto slot = find(key);
+        if (slot == nullptr) {
+            return 0;
+        }
+        return slot->load(std::memory_order_acquire);
+    }
+};
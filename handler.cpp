@@ -1,31 +1,52 @@
 #include <assert.h>
+#ifdef __APPLE__
 #include <mach/kern_return.h>
 #include <mach/mach_init.h>
 #include <mach/mach_traps.h>
 #include <mach/vm_map.h>
+#include <libproc.h>
+#endif
+#include <errno.h>
+#include <algorithm>
 #include <memory>
 #include <signal.h>
 #include <sys/signal.h>
 #include <stdio.h>
+#include <dirent.h>
 #include <dlfcn.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
+#include <sys/stat.h>
 #include <sys/signal.h>
 #include <unistd.h>
 #include "handler.h"
 #include "Compiler/Encoder.h"
-#include <libproc.h>
+#include "Cache/Module.h"
+#include "Scanner/ImageScanner.h"
 #include <pthread.h>
 #include "memmanager.h"
 #include "printinstr.h"
 #include "decoder.h"
 #include "utils.h"
 
+#ifdef __APPLE__
+#define CONTEXT_RIP(uc) ((uc)->uc_mcontext->__ss.__rip)
+#define CONTEXT_RSP(uc) ((uc)->uc_mcontext->__ss.__rsp)
+#else
+#define CONTEXT_RIP(uc) ((uc)->uc_mcontext.gregs[REG_RIP])
+#define CONTEXT_RSP(uc) ((uc)->uc_mcontext.gregs[REG_RSP])
+#endif
+
 static std::unique_ptr<Encoder> encoder;
+static std::unique_ptr<ImageScanner> scanner;
+// sorted, see cached_modules
+static std::vector<uint64_t> cachedModules;
 
 void hello(void)
 {
     debug_print("Avxhandler loaded\n");
+#ifdef __APPLE__
     struct proc_bsdshortinfo info;
     pid_t pid = getpid(); // Get the PID of the current process
 
@@ -34,6 +55,132 @@ void hello(void)
     } else {
         debug_print("Failed to get process name.\n");
     }
+#else
+    debug_print("Current process name: %s\n", program_invocation_short_name);
+#endif
+}
+
+// LINEARAVX_CACHE=0 turns the persistent translation cache off, LINEARAVX_CACHE_DIR puts it elsewhere.
+// There is a file per program and configuration, all processes of a program share it.
+static std::string cache_dir(void) {
+    const char* enabled = getenv("LINEARAVX_CACHE");
+    if (enabled != nullptr && strcmp(enabled, "0") == 0) {
+        return "";
+    }
+
+    const char* home = getenv("HOME");
+    if (const char* configured = getenv("LINEARAVX_CACHE_DIR")) {
+        return configured;
+    } else if (home != nullptr) {
+#ifdef __APPLE__
+        return std::string(home) + "/Library/Caches/LinearAVX";
+#else
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        return (xdg != nullptr && *xdg ? std::string(xdg) : std::string(home) + "/.cache") + "/linearavx";
+#endif
+    }
+    return "";
+}
+
+static const char* program_name(void) {
+#ifdef __APPLE__
+    return getprogname();
+#else
+    return program_invocation_short_name;
+#endif
+}
+
+// Modules an earlier run of this program left translations behind for, read
+// without setting up the runtime, which the configuration of the files depends on
+static std::vector<uint64_t> cached_modules(void) {
+    std::vector<uint64_t> modules;
+    std::string dir = cache_dir();
+    DIR* entries = dir.empty() ? nullptr : opendir(dir.c_str());
+    if (entries == nullptr) {
+        return modules;
+    }
+    // the files of this program and no other, see cacheFilePath
+    std::string prefix = std::string(program_name()) + "-";
+    while (struct dirent* entry = readdir(entries)) {
+        const char* name = entry->d_name;
+        if (strncmp(name, prefix.c_str(), prefix.size()) != 0) {
+            continue;
+        }
+        const char* configuration = name + prefix.size();
+        if (strlen(configuration) != 16 + strlen(".cache") || strspn(configuration, "0123456789abcdef") != 16 || strcmp(configuration + 16, ".cache") != 0) {
+            continue;
+        }
+        auto found = Cache::modules((dir + "/" + name).c_str());
+        modules.insert(modules.end(), found.begin(), found.end());
+    }
+    closedir(entries);
+    std::sort(modules.begin(), modules.end());
+    return modules;
+}
+
+static Cache open_cache(uint64_t configuration) {
+    std::string dir = cache_dir();
+    if (dir.empty()) {
+        return Cache();
+    }
+    for (size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1)) {
+        mkdir(dir.substr(0, slash).c_str(), 0755);
+        if (slash == std::string::npos) {
+            break;
+        }
+    }
+
+    // what to pass avxtranslate -s to make translations for this file ahead of time
+    if (ymm_storage_segment() != XED_REG_INVALID) {
+        debug_print("YMM storage at %s:%d\n", ymm_storage_segment() == XED_REG_FS ? "fs" : "gs", ymm_storage_offset());
+    }
+    return Cache(cacheFilePath(dir, program_name(), configuration).c_str(), configuration);
+}
+
+// LINEARAVX_SHARED_CACHE=0 stops sharing translations with the other processes running now,
+// Wine starts many of them that load the same DLLs
+static SharedCache open_shared_cache(uint64_t configuration) {
+    const char* enabled = getenv("LINEARAVX_SHARED_CACHE");
+    if (enabled != nullptr && strcmp(enabled, "0") == 0) {
+        return SharedCache();
+    }
+    return SharedCache(SharedCache::name(configuration).c_str());
+}
+
+// Everything but the signal handlers is set up by the first SIGILL, so the many
+// processes the library is injected into that never run AVX code don't pay for it
+static pthread_once_t runtimeOnce = PTHREAD_ONCE_INIT;
+
+static void init_runtime(void) {
+    hello();
+    xed_tables_init();
+
+    // LINEARAVX_BLOCK_LIMIT caps how many instructions are translated as one block
+    uint32_t maxBlockInstructions = 64;
+    const char* blockLimit = getenv("LINEARAVX_BLOCK_LIMIT");
+    if (blockLimit != nullptr && atoi(blockLimit) > 0) {
+        maxBlockInstructions = atoi(blockLimit);
+    }
+
+    // LINEARAVX_DIRECT_TLS=0 makes translated code call get_ymm_storage instead of addressing it through FS/GS
+    init_ymm_storage();
+    const char* directTls = getenv("LINEARAVX_DIRECT_TLS");
+    if (directTls != nullptr && strcmp(directTls, "0") == 0) {
+        set_ymm_storage_direct(false);
+    }
+
+    // LINEARAVX_DUAL_MAP=0 keeps a single RWX mapping per code slab that is write protected in page batches
+    const char* dualMap = getenv("LINEARAVX_DUAL_MAP");
+    if ((dualMap == nullptr || strcmp(dualMap, "0") != 0) && !init_code_cache_dual_mapping()) {
+        debug_print("Can't dual map the code cache\n");
+    }
+
+    uint64_t configuration = cacheConfiguration(maxBlockInstructions, ymm_storage_segment(), ymm_storage_offset());
+    encoder = std::make_unique<Encoder>(open_cache(configuration), maxBlockInstructions, open_shared_cache(configuration));
+}
+
+static void ensure_runtime(void) {
+    pthread_once(&runtimeOnce, &init_runtime);
 }
 
 void decode_instruction2(unsigned char *inst, xed_decoded_inst_t *xedd, uint32_t *olen) {
@@ -55,12 +202,14 @@ void decode_instruction2(unsigned char *inst, xed_decoded_inst_t *xedd, uint32_t
 
 void sigill_handler(int sig, siginfo_t *info, void *ucontext) {
     ucontext_t *uc = (ucontext_t *)ucontext;
-    debug_print("RIP: %llx\n", uc->uc_mcontext->__ss.__rip);
+    debug_print("RIP: %llx\n", (uint64_t)CONTEXT_RIP(uc));
 
+    ensure_runtime();
     int result = encoder->reencodeInstruction(info->si_addr);
     if (result < 0) {
     // if (true) {
         debug_print("========================\n");
+#ifdef __APPLE__
         uint64_t tid;
         pthread_t self;
         self = pthread_self();
@@ -174,14 +323,20 @@ void sigill_handler(int sig, siginfo_t *info, void *ucontext) {
         debug_print("YMM15: %llx %llx ", buff[0], buff[1]);
         memcpy(buff, &uc->uc_mcontext->__fs.__fpu_xmm15, sizeof(uc->uc_mcontext->__fs.__fpu_xmm15));
         debug_print("XMM15: %llx %llx\n", buff[0], buff[1]);
+#else
+        debug_print("Invalid instruction at %p pid %d\n", info->si_addr, getpid());
+        debug_print("RIP: %llx\n", (uint64_t)CONTEXT_RIP(uc));
+        debug_print("RSP: %llx\n", (uint64_t)CONTEXT_RSP(uc));
+#endif
         exit(1);
     }
     if (result) {
-        // set RIP one byte further
-        uc->uc_mcontext->__ss.__rip += result;
+        // step over the NOP in front of a patch
+        CONTEXT_RIP(uc) += result;
     }
 }
 
+#ifdef __APPLE__
 #define DYLD_INTERPOSE(_replacment,_replacee) \
   __attribute__((used)) static struct{ const void* replacment; const void* replacee; } _interpose_##_replacee \
   __attribute__ ((section ("__DATA,__interpose"))) = { (const void*)(unsigned long)&_replacment, (const void*)(unsigned long)    &_replacee };
@@ -203,6 +358,7 @@ int	mysigaction(int signum, const struct sigaction * __restrict act, struct siga
 }
 
 DYLD_INTERPOSE(mysigaction, sigaction);
+#endif
 
 void init_sigill_handler(void) {
     struct sigaction act;
@@ -219,8 +375,9 @@ void init_sigill_handler(void) {
 static uint64_t trapped = 0;
 
 void sigtrap_handler(int sig, siginfo_t *info, void *ucontext) {
-    uint64_t rip = ((ucontext_t*)ucontext)->uc_mcontext->__ss.__rip;
-    void* chunk = jumptable_get_chunk(rip-1); // RIP points to instruction after the trap instruction
+    uint64_t rip = CONTEXT_RIP((ucontext_t*)ucontext);
+    uint64_t ret_addr;
+    void* chunk = jumptable_get_chunk(rip-1, &ret_addr); // RIP points to instruction after the trap instruction
     if (chunk == NULL) {
         debug_print("sigtrap_handler: No chunk found for rip 0x%llx\n", rip);
         // if (origSigtrapAct != NULL) {
@@ -234,14 +391,13 @@ void sigtrap_handler(int sig, siginfo_t *info, void *ucontext) {
         // exit(1);
     }
 
-    // Save return address on stack
-    uint64_t rsp = ((ucontext_t*)ucontext)->uc_mcontext->__ss.__rsp - 8;
-    uint64_t ret_addr = rip;
+    // Save return address on stack, the end of the block the INT3 starts
+    uint64_t rsp = CONTEXT_RSP((ucontext_t*)ucontext) - 8;
     *((uint64_t*)(rsp)) = ret_addr;
-    ((ucontext_t*)ucontext)->uc_mcontext->__ss.__rsp = rsp;
+    CONTEXT_RSP((ucontext_t*)ucontext) = rsp;
 
     // Set RIP to point to chunk start
-    ((ucontext_t*)ucontext)->uc_mcontext->__ss.__rip = (uint64_t)chunk;
+    CONTEXT_RIP((ucontext_t*)ucontext) = (uint64_t)chunk;
     trapped++;
     if (trapped % 1000 == 0) {
         debug_print("PID %d: trapped %llu instructions, last RIP = %llx, last chunk = %llx\n", getpid(), trapped, rip, (uint64_t)chunk);
@@ -266,12 +422,34 @@ void init_sigtrap_handler(void) {
 __attribute__((constructor))
 void loadMsg(void)
 {
-    hello();
-    xed_tables_init();
     init_sigill_handler();
     init_sigtrap_handler();
 
-    encoder = std::make_unique<Encoder>(Cache());
+    // LINEARAVX_EAGER=1 translates the supported sites of every image when it is loaded instead of on first trap
+    const char* eager = getenv("LINEARAVX_EAGER");
+    if (eager != nullptr && strcmp(eager, "0") != 0) {
+        ensure_runtime();
+        scanner = std::make_unique<ImageScanner>([](uint8_t* site) {
+            return encoder->reencodeInstruction(site) == 0;
+        });
+        scanner->watchNewImages();
+    } else if (!(cachedModules = cached_modules()).empty()) {
+        // Patches the sites an earlier run translated as every image is loaded,
+        // before its code runs, so they don't trap again. Nothing is decoded,
+        // a site whose bytes changed since is left to trap. The runtime is only
+        // set up once an image turns out to have translations.
+        scanner = std::make_unique<ImageScanner>([](uint8_t* site) {
+            return encoder->installCachedSite(site);
+        }, [](uint8_t* begin, uint8_t* end) {
+            Module module;
+            if (!moduleForAddress((uint64_t)begin, &module) || !std::binary_search(cachedModules.begin(), cachedModules.end(), module.key)) {
+                return std::vector<uint8_t*>();
+            }
+            ensure_runtime();
+            return encoder->cachedSites(begin, end);
+        });
+        scanner->watchNewImages();
+    }
 
     // debug_print("PID %d, attach debugger and press any key...\n", getpid());
     // getchar();
@@ -1,8 +1,14 @@
 #include "memmanager.h"
+#include "addresstable.h"
 #include "utils.h"
 #include "xed/xed-iclass-enum.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
 #include <cstring>
 #include <dlfcn.h>
+#include <fcntl.h>
 // #include <mach/mach_traps.h>
 // #include <mach/vm_map.h>
 // #include <mach/vm_prot.h>
@@ -10,17 +16,128 @@
 #include <memory>
 #include <pthread.h>
 // #include <sys/_pthread/_pthread_key_t.h>
-#include <unordered_map>
+#include <vector>
 #include <sys/mman.h>
+#include <unistd.h>
 
 extern "C" {
     #include "xed/xed-encode.h"
 }
 
+#ifdef __APPLE__
 static volatile thread_local __m128 gYmmStorage[32];
+#else
+// Static TLS sits at the same offset from FS in every thread
+static volatile thread_local __m128 gYmmStorage[32] __attribute__((tls_model("initial-exec")));
+#endif
 
-// static pthread_key_t tls_key;
-// static bool initialized = false;
+static xed_reg_enum_t ymmStorageSegment = XED_REG_INVALID;
+static int32_t ymmStorageOffset = 0;
+static bool ymmStorageDirect = false;
+
+#ifdef __APPLE__
+// thread_local goes through a TLV getter on macOS, but the pthread TSD slots are
+// addressed as gs:[key * 8], so a run of consecutive keys is per-thread storage
+// that translated code reaches with a plain memory operand.
+static const size_t ymmStorageKeys = sizeof(gYmmStorage) / sizeof(void*);
+static const size_t pthreadScanWords = 1024;
+static intptr_t ymmStorageFromSelf = 0;
+
+static bool init_tsd_storage() {
+    pthread_key_t keys[ymmStorageKeys];
+    size_t created = 0;
+    bool consecutive = true;
+    for (; created < ymmStorageKeys; created++) {
+        if (pthread_key_create(&keys[created], nullptr) != 0) {
+            break;
+        }
+        consecutive = consecutive && keys[created] == keys[0] + created;
+    }
+
+    // find where the TSD array lives inside the thread structure, get_ymm_storage needs the address
+    static const void* marker = &marker;
+    intptr_t fromSelf = -1;
+    if (created == ymmStorageKeys && consecutive) {
+        pthread_setspecific(keys[0], marker);
+        uint64_t viaGs;
+        __asm__ volatile("mov %%gs:(%1), %0" : "=r"(viaGs) : "r"((uint64_t)keys[0] * sizeof(void*)));
+        auto self = (const void* const*)pthread_self();
+        for (size_t i = 0; i < pthreadScanWords && viaGs == (uint64_t)marker; i++) {
+            if (self[i] == marker) {
+                fromSelf = i * sizeof(void*);
+                break;
+            }
+        }
+        pthread_setspecific(keys[0], nullptr);
+    }
+
+    if (fromSelf < 0) {
+        for (size_t i = 0; i < created; i++) {
+            pthread_key_delete(keys[i]);
+        }
+        return false;
+    }
+
+    ymmStorageSegment = XED_REG_GS;
+    ymmStorageOffset = keys[0] * sizeof(void*);
+    ymmStorageFromSelf = fromSelf;
+    return true;
+}
+#endif
+
+static volatile __m128* current_ymm_storage() {
+#ifdef __APPLE__
+    if (ymmStorageSegment != XED_REG_INVALID) {
+        return (volatile __m128*)((uint8_t*)pthread_self() + ymmStorageFromSelf);
+    }
+#endif
+    return gYmmStorage;
+}
+
+bool init_ymm_storage() {
+    if (ymmStorageSegment != XED_REG_INVALID) {
+        return true;
+    }
+
+#ifdef __APPLE__
+    if (!init_tsd_storage()) {
+        debug_print("No consecutive TSD keys, translated code will call get_ymm_storage\n");
+        return false;
+    }
+#else
+    // fs:0 holds the thread pointer itself
+    uint64_t threadPointer;
+    __asm__ volatile("mov %%fs:0, %0" : "=r"(threadPointer));
+    int64_t offset = (int64_t)((uint64_t)gYmmStorage - threadPointer);
+    if (offset < INT32_MIN || offset > INT32_MAX) {
+        debug_print("YMM storage is out of reach of FS, translated code will call get_ymm_storage\n");
+        return false;
+    }
+    ymmStorageSegment = XED_REG_FS;
+    ymmStorageOffset = (int32_t)offset;
+#endif
+
+    ymmStorageDirect = true;
+    return true;
+}
+
+void set_ymm_storage_direct(bool direct) {
+    ymmStorageDirect = direct;
+}
+
+void set_ymm_storage_location(xed_reg_enum_t segment, int32_t offset) {
+    ymmStorageSegment = segment;
+    ymmStorageOffset = offset;
+    ymmStorageDirect = true;
+}
+
+xed_reg_enum_t ymm_storage_segment() {
+    return ymmStorageDirect ? ymmStorageSegment : XED_REG_INVALID;
+}
+
+int32_t ymm_storage_offset() {
+    return ymmStorageOffset;
+}
 
 volatile __m128 *get_ymm_storage() {
     uint64_t /*rax,*/ rbx, rcx, rdx, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15;
@@ -42,7 +159,7 @@ volatile __m128 *get_ymm_storage() {
     __asm__ volatile("mov %%r15, %0" : "=r"(r15));
 
 
-    auto ymmStorage = gYmmStorage;
+    auto ymmStorage = current_ymm_storage();
 
     // Restore registers
     //__asm__ volatile("mov %0, %%rax" : : "r"(rax));
@@ -63,26 +180,477 @@ volatile __m128 *get_ymm_storage() {
     return ymmStorage;
 }
 
-uint8_t* alloc_executable(uint64_t size) {
-    // mmap anonymous memory
-    auto memory = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, -1, 0);
-    return memory;
+// Chunks are bump-allocated from slabs instead of getting a mapping each, so
+// thousands of translated sites share a handful of VMAs and pages. Chunks that
+// are entered with a JMP rel32 from the patched site and leave with a JMP rel32
+// back must live within +-2GB of that site, so those come from slabs reserved
+// next to the code that traps.
+//
+// [base, base + sealed) of a slab is RX, the rest stays RWX. Pages behind the
+// frontier are sealed together once no chunk in the slab is being written.
+// A dual mapped slab is a shared object mapped RX at base and RW at
+// base + writeDelta, chunks are written through the second view and its
+// protection never changes. A fork()ed child shares that object with its
+// parent, so it marks the slabs it inherited as full and leaves them to the
+// parent, its own chunks come from new slabs.
+struct FreeChunk {
+    uint8_t* chunk;
+    uint64_t size;
+};
+
+struct Slab {
+    uint8_t* base;
+    int64_t writeDelta;
+    uint64_t used;
+    uint64_t sealed;
+    uint32_t writing;
+    uint64_t chunks;
+    uint64_t liveBytes;
+    std::vector<FreeChunk> freeChunks;
+    // shared with the parent process, never written again
+    bool inherited;
+};
+
+static const uint64_t slabSize = 1 << 20;
+static const uint64_t nearSlabProbeStep = 64 << 20;
+static const uint64_t chunkAlignment = 64;
+// bigger requests get a mapping of their own
+static const uint64_t largeChunkSize = 64 << 10;
+static std::vector<Slab> slabs;
+static uint64_t largeChunks = 0;
+static uint64_t largeBytes = 0;
+static bool dualMapping = false;
+static std::atomic<uint64_t> protectCalls{0};
+static pthread_mutex_t slabMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t page_size() {
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    return pageSize;
 }
 
-void write_protect_memory(void* memory, size_t length) {
-    auto result = mprotect(memory, length, PROT_READ | PROT_EXEC);
-    if(result != 0) {
+static bool fitsRel32(uint64_t from, uint64_t to) {
+    int64_t distance = (int64_t)(to - from);
+    return distance >= INT32_MIN && distance <= INT32_MAX;
+}
+
+static bool isNear(uint64_t location, uint8_t* memory, uint64_t size) {
+    return fitsRel32(location, (uint64_t)memory) && fitsRel32(location, (uint64_t)memory + size);
+}
+
+static void protect(uint8_t* begin, uint8_t* end, int protection) {
+    protectCalls++;
+    if (mprotect(begin, end - begin, protection) != 0) {
         debug_print("mprotect failed: %s\n", strerror(errno));
         exit(1);
     }
 }
 
-static std::unordered_map<uint64_t, void*> executable_chunks_for_locations;
+// An unnamed shared memory object of size bytes, -1 on failure
+static int shared_code_object(uint64_t size) {
+#ifdef __APPLE__
+    char name[32];
+    static std::atomic<uint32_t> serial{0};
+    snprintf(name, sizeof(name), "/linearavx.%d.%u", getpid(), serial++);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(name);
+    }
+#else
+    int fd = memfd_create("linearavx-code", MFD_CLOEXEC);
+#endif
+    if (fd >= 0 && ftruncate(fd, size) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void lock_slabs_for_fork() {
+    pthread_mutex_lock(&slabMutex);
+}
+
+static void unlock_slabs_after_fork() {
+    pthread_mutex_unlock(&slabMutex);
+}
+
+static void leave_shared_slabs_to_parent() {
+    for (auto& slab : slabs) {
+        // the threads that were writing chunks are gone
+        slab.writing = 0;
+        if (slab.writeDelta != 0) {
+            slab.used = slabSize;
+            slab.freeChunks.clear();
+            slab.inherited = true;
+        }
+    }
+    pthread_mutex_unlock(&slabMutex);
+}
+
+static void watch_forks() {
+    pthread_atfork(&lock_slabs_for_fork, &unlock_slabs_after_fork, &leave_shared_slabs_to_parent);
+}
+
+// Maps a slab at the hint if the kernel agrees, anywhere otherwise
+static uint8_t* map_slab(void* hint, int64_t* writeDelta) {
+    *writeDelta = 0;
+    if (dualMapping) {
+        static pthread_once_t forksWatched = PTHREAD_ONCE_INIT;
+        pthread_once(&forksWatched, &watch_forks);
+
+        int fd = shared_code_object(slabSize);
+        if (fd >= 0) {
+            auto code = (uint8_t*)mmap(hint, slabSize, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+            auto data = (uint8_t*)mmap(NULL, slabSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (code != MAP_FAILED && data != MAP_FAILED) {
+                *writeDelta = data - code;
+                return code;
+            }
+            if (code != MAP_FAILED) {
+                munmap(code, slabSize);
+            }
+            if (data != MAP_FAILED) {
+                munmap(data, slabSize);
+            }
+        }
+        debug_print("Can't dual map a code slab, mapping it RWX\n");
+    }
+
+    auto memory = (uint8_t*)mmap(hint, slabSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, -1, 0);
+    return memory == MAP_FAILED ? nullptr : memory;
+}
+
+static void unmap_slab(uint8_t* base, int64_t writeDelta) {
+    munmap(base, slabSize);
+    if (writeDelta != 0) {
+        munmap(base + writeDelta, slabSize);
+    }
+}
+
+static uint8_t* reserve_near_slab(uint64_t location, int64_t* writeDelta) {
+    // Walk away from the location in both directions and let the kernel
+    // place the slab at the hint if that range is free.
+    for (uint64_t distance = nearSlabProbeStep; distance < INT32_MAX; distance += nearSlabProbeStep) {
+        for (int direction = -1; direction <= 1; direction += 2) {
+            if (direction < 0 && location < distance) {
+                continue;
+            }
+            uint64_t hint = (direction < 0 ? location - distance : location + distance) & ~(slabSize - 1);
+            auto memory = map_slab((void*)hint, writeDelta);
+            if (memory == nullptr) {
+                continue;
+            }
+            if (isNear(location, memory, slabSize)) {
+                return memory;
+            }
+            unmap_slab(memory, *writeDelta);
+        }
+    }
+
+    return nullptr;
+}
+
+bool init_code_cache_dual_mapping() {
+    // a byte written through the RW view has to show up in the RX one
+    uint64_t size = page_size();
+    int fd = shared_code_object(size);
+    if (fd < 0) {
+        return false;
+    }
+    auto code = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    auto data = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    bool works = code != MAP_FAILED && data != MAP_FAILED;
+    if (works) {
+        data[0] = 0xc3;
+        works = *(volatile uint8_t*)code == 0xc3;
+    }
+    if (code != MAP_FAILED) {
+        munmap(code, size);
+    }
+    if (data != MAP_FAILED) {
+        munmap(data, size);
+    }
+
+    pthread_mutex_lock(&slabMutex);
+    dualMapping = works;
+    pthread_mutex_unlock(&slabMutex);
+    return works;
+}
+
+void set_code_cache_dual_mapping(bool dual) {
+    pthread_mutex_lock(&slabMutex);
+    dualMapping = dual;
+    pthread_mutex_unlock(&slabMutex);
+}
 
-void jumptable_add_chunk(uint64_t location, void* chunk) {
-    executable_chunks_for_locations[location] = chunk;
+static Slab* find_slab(void* chunk) {
+    for (auto& slab : slabs) {
+        if ((uint8_t*)chunk >= slab.base && (uint8_t*)chunk < slab.base + slabSize) {
+            return &slab;
+        }
+    }
+    return nullptr;
 }
 
-void* jumptable_get_chunk(uint64_t location) {
-    return executable_chunks_for_locations[location];
+// Takes size bytes from the slab if it has room near location (anywhere when location is 0)
+static uint8_t* carve(Slab& slab, uint64_t location, uint64_t size) {
+    // freed chunks are few (lost races, literal pool fallbacks) and merged, so the best fit is a plain scan
+    FreeChunk* best = nullptr;
+    for (auto& free : slab.freeChunks) {
+        if (free.size >= size && (best == nullptr || free.size < best->size) && (location == 0 || isNear(location, free.chunk, size))) {
+            best = &free;
+        }
+    }
+
+    uint8_t* chunk = nullptr;
+    if (best != nullptr) {
+        chunk = best->chunk;
+        if (best->size > size) {
+            // the rest stays free, it is a multiple of the alignment as well
+            best->chunk += size;
+            best->size -= size;
+        } else {
+            *best = slab.freeChunks.back();
+            slab.freeChunks.pop_back();
+        }
+        if (slab.writeDelta == 0 && chunk < slab.base + slab.sealed) {
+            // everything from the chunk's page on is unsealed, so chunks carved
+            // there later are written without a protect call, the pages are
+            // sealed with the rest of the slab later
+            auto begin = (uint8_t*)((uint64_t)chunk & ~(page_size() - 1));
+            protect(begin, slab.base + slab.sealed, PROT_READ | PROT_WRITE | PROT_EXEC);
+            slab.sealed = begin - slab.base;
+        }
+    } else if (slab.used + size <= slabSize && (location == 0 || isNear(location, slab.base + slab.used, size))) {
+        chunk = slab.base + slab.used;
+        slab.used += size;
+    } else {
+        return nullptr;
+    }
+
+    slab.writing++;
+    slab.chunks++;
+    slab.liveBytes += size;
+    return chunk;
+}
+
+static uint8_t* alloc_chunk(uint64_t location, uint64_t size) {
+    size = (size + chunkAlignment - 1) & ~(chunkAlignment - 1);
+
+    pthread_mutex_lock(&slabMutex);
+    uint8_t* chunk = nullptr;
+    for (auto& slab : slabs) {
+        if ((chunk = carve(slab, location, size)) != nullptr) {
+            break;
+        }
+    }
+
+    if (chunk == nullptr) {
+        int64_t writeDelta;
+        auto base = location == 0 ? map_slab(nullptr, &writeDelta) : reserve_near_slab(location, &writeDelta);
+        if (base != nullptr) {
+            debug_print("Reserved code slab at %llx for %llx\n", (uint64_t)base, location);
+            slabs.push_back({ .base = base, .writeDelta = writeDelta });
+            chunk = carve(slabs.back(), location, size);
+        }
+    }
+    pthread_mutex_unlock(&slabMutex);
+
+    return chunk;
+}
+
+uint8_t* alloc_executable(uint64_t size) {
+    if (size > largeChunkSize) {
+        auto memory = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (memory == MAP_FAILED) {
+            return nullptr;
+        }
+        pthread_mutex_lock(&slabMutex);
+        largeChunks++;
+        largeBytes += size;
+        pthread_mutex_unlock(&slabMutex);
+        return memory;
+    }
+    return alloc_chunk(0, size);
+}
+
+uint8_t* alloc_executable_near(uint64_t location, uint64_t size) {
+    if (size > largeChunkSize) {
+        return nullptr;
+    }
+    return alloc_chunk(location, size);
+}
+
+// Seals every complete page behind the frontier in one go, the page the
+// frontier is in stays writable for the next chunk
+static void seal_slab(Slab& slab) {
+    uint64_t end = slab.used & ~(page_size() - 1);
+    if (slab.writeDelta != 0 || slab.writing != 0 || end <= slab.sealed) {
+        return;
+    }
+    protect(slab.base + slab.sealed, slab.base + end, PROT_READ | PROT_EXEC);
+    slab.sealed = end;
+}
+
+void write_protect_memory(void* memory, size_t length) {
+    pthread_mutex_lock(&slabMutex);
+    auto slab = find_slab(memory);
+    if (slab != nullptr) {
+        slab->writing--;
+        seal_slab(*slab);
+    }
+    pthread_mutex_unlock(&slabMutex);
+
+    if (slab == nullptr) {
+        auto pageMask = page_size() - 1;
+        auto begin = (uint8_t*)((uint64_t)memory & ~pageMask);
+        protect(begin, (uint8_t*)(((uint64_t)memory + length + pageMask) & ~pageMask), PROT_READ | PROT_EXEC);
+    }
+}
+
+uint8_t* code_cache_writable(void* chunk) {
+    pthread_mutex_lock(&slabMutex);
+    auto slab = find_slab(chunk);
+    auto writable = (uint8_t*)chunk + (slab != nullptr ? slab->writeDelta : 0);
+    pthread_mutex_unlock(&slabMutex);
+    return writable;
+}
+
+// Gives a chunk back to the slab merged with the free space around it, so
+// freed chunks can be carved into bigger ones again. Free space that reaches
+// the frontier moves it back, a slab with nothing live starts over.
+static void release(Slab& slab, uint8_t* chunk, uint64_t size) {
+    for (size_t i = 0; i < slab.freeChunks.size();) {
+        auto& free = slab.freeChunks[i];
+        if (free.chunk + free.size == chunk || chunk + size == free.chunk) {
+            chunk = std::min(chunk, free.chunk);
+            size += free.size;
+            free = slab.freeChunks.back();
+            slab.freeChunks.pop_back();
+        } else {
+            i++;
+        }
+    }
+
+    if (chunk + size != slab.base + slab.used) {
+        slab.freeChunks.push_back({ .chunk = chunk, .size = size });
+        return;
+    }
+    slab.used = chunk - slab.base;
+    if (slab.writeDelta == 0 && slab.used < slab.sealed) {
+        // the pages past the frontier are written without a protect call
+        uint64_t begin = slab.used & ~(page_size() - 1);
+        protect(slab.base + begin, slab.base + slab.sealed, PROT_READ | PROT_WRITE | PROT_EXEC);
+        slab.sealed = begin;
+    }
+}
+
+void free_executable(void* memory, size_t length) {
+    pthread_mutex_lock(&slabMutex);
+    auto slab = find_slab(memory);
+    if (slab != nullptr) {
+        length = (length + chunkAlignment - 1) & ~(chunkAlignment - 1);
+        if (!slab->inherited) {
+            release(*slab, (uint8_t*)memory, length);
+        }
+        slab->chunks--;
+        slab->liveBytes -= length;
+    } else {
+        largeChunks--;
+        largeBytes -= length;
+    }
+    pthread_mutex_unlock(&slabMutex);
+
+    if (slab == nullptr) {
+        munmap(memory, length);
+    }
+}
+
+bool is_code_cache_address(const void* address) {
+    pthread_mutex_lock(&slabMutex);
+    bool found = find_slab((void*)address) != nullptr;
+    pthread_mutex_unlock(&slabMutex);
+    return found;
+}
+
+void get_code_cache_stats(struct code_cache_stats* stats) {
+    *stats = {};
+    pthread_mutex_lock(&slabMutex);
+    for (auto const& slab : slabs) {
+        stats->slabs++;
+        stats->chunks += slab.chunks;
+        stats->liveBytes += slab.liveBytes;
+        stats->usedPages += (slab.used + page_size() - 1) / page_size();
+        stats->dualMappedSlabs += slab.writeDelta != 0;
+    }
+    stats->largeChunks = largeChunks;
+    stats->largeBytes = largeBytes;
+    stats->protectCalls = protectCalls;
+    pthread_mutex_unlock(&slabMutex);
+}
+
+// Looked up from sigtrap_handler, so it must not lock or allocate. A table that
+// is half full gets another one after it, mapped when it is first needed, and
+// lookups go through the tables in order. Keeping each half empty keeps the
+// probes for locations in later tables short.
+typedef AddressTable<1 << 16> JumpTable;
+static const size_t jumpTableEntries = (1 << 16) / 2;
+static const int maxJumpTables = 64;
+static JumpTable executable_chunks_for_locations;
+static std::atomic<JumpTable*> moreJumpTables[maxJumpTables - 1];
+static std::atomic<size_t> jumpTableSizes[maxJumpTables];
+
+static JumpTable* jump_table(int index, bool map) {
+    if (index == 0) {
+        return &executable_chunks_for_locations;
+    }
+    auto table = moreJumpTables[index - 1].load(std::memory_order_acquire);
+    if (table != nullptr || !map) {
+        return table;
+    }
+    // all zero, which is empty
+    auto memory = mmap(NULL, sizeof(JumpTable), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    if (!moreJumpTables[index - 1].compare_exchange_strong(table, (JumpTable*)memory, std::memory_order_acq_rel)) {
+        munmap(memory, sizeof(JumpTable));
+        return table;
+    }
+    return (JumpTable*)memory;
+}
+
+// User space addresses fit in 48 bits, the distance to the return address goes in the bits above
+static const int chunkBits = 48;
+
+bool jumptable_add_chunk(uint64_t location, void* chunk, uint64_t returnAddress) {
+    uint64_t returnOffset = returnAddress - location;
+    if ((uint64_t)chunk >> chunkBits != 0 || returnOffset >> (64 - chunkBits) != 0) {
+        return false;
+    }
+    uint64_t value = (uint64_t)chunk | returnOffset << chunkBits;
+    for (int index = 0; index < maxJumpTables; index++) {
+        auto table = jump_table(index, true);
+        if (table == nullptr) {
+            return false;
+        }
+        if (table->find(location) != nullptr || jumpTableSizes[index].fetch_add(1) < jumpTableEntries) {
+            return table->set(location, value);
+        }
+    }
+    return false;
+}
+
+void* jumptable_get_chunk(uint64_t location, uint64_t* returnAddress) {
+    uint64_t value = 0;
+    for (int index = 0; index < maxJumpTables && value == 0; index++) {
+        auto table = jump_table(index, false);
+        if (table == nullptr) {
+            break;
+        }
+        value = table->get(location);
+    }
+    *returnAddress = location + (value >> chunkBits);
+    return (void*)(value & ((1ull << chunkBits) - 1));
 }
@@ -9,11 +9,51 @@ extern "C" {
 
 
 #include <emmintrin.h>
+#include <stdbool.h>
 volatile __m128 *get_ymm_storage();
+// Translated code addresses the YMM storage of the current thread as
+// segment:[offset + n * 16] instead of calling get_ymm_storage when the platform
+// allows it. Must run before any chunk executes.
+bool init_ymm_storage();
+void set_ymm_storage_direct(bool direct);
+// Makes chunks address the storage where another process has it, for
+// translating ahead of time. They must not run in this process.
+void set_ymm_storage_location(xed_reg_enum_t segment, int32_t offset);
+// XED_REG_INVALID when translated code has to call get_ymm_storage
+xed_reg_enum_t ymm_storage_segment();
+int32_t ymm_storage_offset();
+// Chunks are written through code_cache_writable until write_protect_memory
+// makes them RX, free_executable takes back a write protected chunk with the
+// size it was allocated with.
 uint8_t* alloc_executable(uint64_t size);
+uint8_t* alloc_executable_near(uint64_t location, uint64_t size);
+uint8_t* code_cache_writable(void* chunk);
 void write_protect_memory(void* memory, size_t length);
-void jumptable_add_chunk(uint64_t location, void* chunk);
-void* jumptable_get_chunk(uint64_t location);
+void free_executable(void* memory, size_t length);
+// Slabs reserved from now on are mapped twice, RX where chunks run and RW where
+// they are written, so the code cache never changes protection. Returns false
+// if the platform doesn't allow it.
+bool init_code_cache_dual_mapping();
+void set_code_cache_dual_mapping(bool dual);
+struct code_cache_stats {
+    uint64_t slabs;
+    uint64_t chunks;
+    uint64_t liveBytes;
+    // pages of the slabs chunks have been carved from so far
+    uint64_t usedPages;
+    uint64_t largeChunks;
+    uint64_t largeBytes;
+    uint64_t dualMappedSlabs;
+    uint64_t protectCalls;
+};
+void get_code_cache_stats(struct code_cache_stats* stats);
+// Whether the address is inside a code slab, where every near chunk lives
+bool is_code_cache_address(const void* address);
+// The chunk an INT3 at location enters and the address it returns to. False
+// when no more memory can be mapped for the table or the chunk can't be stored
+// with the return address.
+bool jumptable_add_chunk(uint64_t location, void* chunk, uint64_t returnAddress);
+void* jumptable_get_chunk(uint64_t location, uint64_t* returnAddress);
 
 #ifdef __cplusplus
 }